@@ -0,0 +1,257 @@
+#include "Client.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Client::Client(Reactor &_reactor, Transport transport) :
+    reactor(_reactor), core(transport, *this), fd(-1), socketUp(false), tickTimer(0)
+{
+}
+
+Client::~Client()
+{
+    closeSocket();
+}
+
+bool Client::connect(const char *host, const char *port)
+{
+    if (fd >= 0)
+    {
+        error_ = "already connected";
+        return false;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = core.transport() == Transport::Tcp ? SOCK_STREAM : SOCK_DGRAM;
+    addrinfo *res = nullptr;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0)
+    {
+        error_ = std::string(host) + ": " + gai_strerror(err);
+        return false;
+    }
+
+    for (addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        // Connecting a UDP socket only sets the default destination (and lets us hear about
+        // ICMP errors), it never blocks
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+            break;
+        error_ = std::strerror(errno);
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+    {
+        if (error_.empty())
+            error_ = std::strerror(errno);
+        return false;
+    }
+
+    socketUp = false;
+    txbuf.clear();
+    error_.clear();
+    bool tcp = core.transport() == Transport::Tcp;
+    reactor.add(fd, tcp ? Reactor::Write : Reactor::Read, [this](int, unsigned events) { socketEvent(events); });
+    core.startConnect(host, (unsigned)std::atoi(port));
+    scheduleTick();
+    return true;
+}
+
+void Client::disconnect()
+{
+    core.disconnect();
+    // Give a pending byebye a chance, the socket is non-blocking so this can't hang
+    flush();
+    closeSocket();
+}
+
+void Client::closeSocket()
+{
+    if (tickTimer)
+    {
+        reactor.cancelTimer(tickTimer);
+        tickTimer = 0;
+    }
+    if (fd < 0)
+        return;
+    reactor.remove(fd);
+    ::close(fd);
+    fd = -1;
+    socketUp = false;
+    txbuf.clear();
+}
+
+void Client::scheduleTick()
+{
+    if (tickTimer)
+    {
+        reactor.cancelTimer(tickTimer);
+        tickTimer = 0;
+    }
+    std::uint64_t deadline = core.nextDeadline();
+    if (!deadline)
+        return;
+    std::uint64_t now = monotonicMs();
+    tickTimer = reactor.addTimer(deadline > now ? (unsigned)(deadline - now) : 0, [this]() {
+            tickTimer = 0;
+            core.tick();
+            if (core.state() == ProtocolCore::State::Disconnected)
+                closeSocket();
+            else
+                scheduleTick();
+        });
+}
+
+void Client::socketEvent(unsigned events)
+{
+    if (core.transport() == Transport::Tcp && !socketUp)
+    {
+        int soerr = 0;
+        socklen_t len = sizeof(soerr);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+        if (soerr != 0)
+        {
+            error_ = std::strerror(soerr);
+            closeSocket();
+            core.connectionDown();
+            onError(ProtocolError::ConnectFailed, error_.c_str());
+            return;
+        }
+        socketUp = true;
+        reactor.modify(fd, Reactor::Read);
+        core.connectionUp();        // Sends the first commands
+        scheduleTick();
+        return;
+    }
+
+    if (events & Reactor::Write)
+        flush();
+    if (fd >= 0 && (events & (Reactor::Read | Reactor::Error)))
+        readSocket();
+}
+
+void Client::readSocket()
+{
+    char buf[2048];
+    while (fd >= 0)
+    {
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            core.received(buf, (std::size_t)n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        if (n < 0 && core.transport() == Transport::Udp)
+        {
+            // ICMP port unreachable and the like. The pings will notice if the server is
+            // really gone.
+            continue;
+        }
+        error_ = n == 0 ? "connection closed by server" : std::strerror(errno);
+        closeSocket();
+        core.connectionDown();
+        return;
+    }
+    if (fd >= 0 && core.state() == ProtocolCore::State::Disconnected)
+        closeSocket();
+    else
+        scheduleTick();
+}
+
+void Client::flush()
+{
+    while (fd >= 0 && !txbuf.empty())
+    {
+        ssize_t n = ::send(fd, txbuf.data(), txbuf.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                txbuf.clear();  // The read side will find out what happened
+            break;
+        }
+        txbuf.erase(0, (std::size_t)n);
+    }
+    if (fd >= 0 && socketUp)
+        reactor.modify(fd, txbuf.empty() ? Reactor::Read : Reactor::Read | Reactor::Write);
+}
+
+void Client::writeToServer(const char *data, std::size_t len)
+{
+    if (fd < 0)
+        return;
+
+    if (core.transport() == Transport::Udp)
+    {
+        ::send(fd, data, len, MSG_NOSIGNAL); // A lost datagram is a lost datagram
+        scheduleTick();                      // There may be copies to send (see setRedundancy)
+        return;
+    }
+
+    // Write straight away unless something is already waiting (keeps the order), buffer the rest
+    if (socketUp && txbuf.empty())
+    {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+        if (n == (ssize_t)len)
+            return;
+        if (n > 0)
+        {
+            data += n;
+            len -= (std::size_t)n;
+        }
+    }
+    txbuf.append(data, len);
+    if (socketUp)
+        reactor.modify(fd, Reactor::Read | Reactor::Write);
+}
+
+void Client::onConnected()
+{
+    if (connected)
+        connected();
+}
+
+void Client::onDisconnected()
+{
+    if (disconnected)
+        disconnected();
+}
+
+void Client::onStatus(const ServerStatus &status)
+{
+    if (statusReceived)
+        statusReceived(status);
+}
+
+void Client::onStats(const DeviceStats &stats)
+{
+    if (statsReceived)
+        statsReceived(stats);
+}
+
+void Client::onError(ProtocolError err, const char *detail)
+{
+    if (err == ProtocolError::ConnectFailed || err == ProtocolError::ConnectionLost)
+        error_ = detail;
+    if (error)
+        error(err, detail);
+}
+
+void Client::onReply(const char *line, std::size_t len)
+{
+    if (replyReceived)
+        replyReceived(line, len);
+}
@@ -0,0 +1,69 @@
+// -*- Mode: C++ -*-
+
+#ifndef __CLIENT_H
+#define __CLIENT_H
+
+#include <functional>
+#include <string>
+
+#include "ProtocolCore.h"
+#include "Reactor.h"
+
+/**
+ * \brief ProtocolCore on a plain POSIX socket, driven by a Reactor.
+ *
+ * Everything is non-blocking except the host name lookup. What happens is reported through the
+ * std::function members, set whichever are of interest before connecting.
+ */
+class Client : private ProtocolHandler
+{
+public:
+    Client(Reactor &reactor, Transport transport);
+    ~Client();
+
+    /**
+     * \brief Start connecting to host:port.
+     * \return false (with errorString set) if the host can't be looked up or no socket could be
+     *         made. Otherwise the outcome is reported through connected/error.
+     */
+    bool connect(const char *host, const char *port);
+    /// \brief Say goodbye and close the socket
+    void disconnect();
+
+    ProtocolCore &protocol() { return core; }
+
+    /// \brief Why connect failed, or why the connection was dropped
+    const std::string &errorString() const { return error_; }
+
+    std::function<void()> connected;
+    std::function<void()> disconnected;
+    std::function<void(const ServerStatus &)> statusReceived;
+    std::function<void(const DeviceStats &)> statsReceived;
+    std::function<void(const char *line, std::size_t len)> replyReceived;
+    std::function<void(ProtocolError, const char *detail)> error;
+
+private:
+    Reactor &reactor;
+    ProtocolCore core;
+    int fd;
+    bool socketUp;          //!< TCP connect completed
+    std::string txbuf;      //!< What the socket didn't take yet
+    std::string error_;
+    unsigned tickTimer;     //!< 0 when not scheduled
+
+    void writeToServer(const char *data, std::size_t len) override;
+    void onConnected() override;
+    void onDisconnected() override;
+    void onStatus(const ServerStatus &status) override;
+    void onStats(const DeviceStats &stats) override;
+    void onError(ProtocolError err, const char *detail) override;
+    void onReply(const char *line, std::size_t len) override;
+
+    void socketEvent(unsigned events);
+    void readSocket();
+    void flush();
+    void closeSocket();
+    void scheduleTick();
+};
+
+#endif
@@ -0,0 +1,229 @@
+#include "Command.h"
+
+#include <cstring>
+
+struct Token
+{
+    const char *str;
+    std::size_t len;
+};
+
+#define TOKEN(s) { s, sizeof(s) - 1 }
+
+/* Indexed by Command */
+static const Token commandTokens[] = {
+    TOKEN("set"),
+    TOKEN("setmaster"),
+    TOKEN("inc"),
+    TOKEN("incmaster"),
+    TOKEN("status"),
+    TOKEN("mute"),
+    TOKEN("mutechan"),
+    TOKEN("reset"),
+    TOKEN("byebye"),
+    TOKEN("subscribe"),
+    TOKEN("stats"),
+};
+static_assert(sizeof(commandTokens)/sizeof(commandTokens[0]) == static_cast<std::size_t>(Command::Stats) + 1,
+              "commandTokens out of sync with Command");
+
+/* Indexed by Channel */
+static const Token channelTokens[] = {
+    TOKEN("F"),      TOKEN("FL"),  TOKEN("FR"),
+    TOKEN("CENSUB"), TOKEN("CEN"), TOKEN("SUB"),
+    TOKEN("R"),      TOKEN("RL"),  TOKEN("RR"),
+};
+static_assert(sizeof(channelTokens)/sizeof(channelTokens[0]) == static_cast<std::size_t>(Channel::RR) + 1,
+              "channelTokens out of sync with Channel");
+
+#undef TOKEN
+
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+const char *commandName(Command cmd)
+{
+    return commandTokens[static_cast<std::size_t>(cmd)].str;
+}
+
+const char *channelName(Channel chan)
+{
+    return channelTokens[static_cast<std::size_t>(chan)].str;
+}
+
+template <typename Enum, std::size_t N>
+static bool lookup(const Token (&tokens)[N], const char *name, Enum &out)
+{
+    std::size_t len = std::strlen(name);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        if (tokens[i].len == len && std::memcmp(tokens[i].str, name, len) == 0)
+        {
+            out = static_cast<Enum>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool commandFromName(const char *name, Command &cmd)
+{
+    return lookup(commandTokens, name, cmd);
+}
+
+bool channelFromName(const char *name, Channel &chan)
+{
+    return lookup(channelTokens, name, chan);
+}
+
+bool channelCovers(Channel outer, Channel inner)
+{
+    // Channel comes in threes: the pair, then its two sides
+    int o = static_cast<int>(outer), i = static_cast<int>(inner);
+    return o == i || (o % 3 == 0 && i / 3 == o / 3);
+}
+
+CommandBuffer::CommandBuffer() :
+    len(0), targetLen(0), cmd(Command::Status), chan(-1), chanEnd(0)
+{
+    buf[0] = '\0';
+}
+
+CommandBuffer &CommandBuffer::begin(Command command)
+{
+    const Token &token = commandTokens[static_cast<std::size_t>(command)];
+    std::memcpy(buf, token.str, token.len);
+    len = targetLen = token.len;
+    cmd = command;
+    chan = -1;
+    chanEnd = 0;
+    return *this;
+}
+
+CommandBuffer &CommandBuffer::arg(Channel chan)
+{
+    const Token &token = channelTokens[static_cast<std::size_t>(chan)];
+    targetLen = len;
+    buf[len++] = ' ';
+    std::memcpy(buf + len, token.str, token.len);
+    len += token.len;
+    this->chan = static_cast<int>(chan);
+    chanEnd = len;
+    return *this;
+}
+
+CommandBuffer &CommandBuffer::arg(int value)
+{
+    targetLen = len;
+    buf[len++] = ' ';
+    unsigned u = static_cast<unsigned>(value);
+    if (value < 0)
+    {
+        buf[len++] = '-';
+        u = 0u - u;
+    }
+
+    // Digits come out least significant first, so fill a scratch area from the back
+    char digits[10];
+    char *p = digits + sizeof(digits);
+    while (u >= 100)
+    {
+        unsigned pair = (u % 100)*2;
+        u /= 100;
+        *--p = digitPairs[pair + 1];
+        *--p = digitPairs[pair];
+    }
+    if (u >= 10)
+    {
+        *--p = digitPairs[u*2 + 1];
+        *--p = digitPairs[u*2];
+    }
+    else
+    {
+        *--p = static_cast<char>('0' + u);
+    }
+
+    std::size_t n = digits + sizeof(digits) - p;
+    std::memcpy(buf + len, p, n);
+    len += n;
+    return *this;
+}
+
+CommandBuffer &CommandBuffer::end()
+{
+    buf[len++] = '\n';
+    buf[len] = '\0';
+    return *this;
+}
+
+bool CommandBuffer::isHighPriority() const
+{
+    return cmd == Command::Mute || cmd == Command::MuteChan;
+}
+
+bool CommandBuffer::isQuery() const
+{
+    return cmd == Command::Status || cmd == Command::Stats;
+}
+
+bool CommandBuffer::supersedes(const CommandBuffer &other) const
+{
+    switch (cmd)
+    {
+    case Command::Reset:
+        switch (other.cmd)
+        {
+        case Command::Set:
+        case Command::SetMaster:
+        case Command::Inc:
+        case Command::IncMaster:
+        case Command::Mute:
+        case Command::MuteChan:
+            return true;
+        default:
+            return false;
+        }
+    case Command::Set:
+    case Command::MuteChan:
+        return other.cmd == cmd && chan >= 0 && other.chan >= 0 &&
+            channelCovers(static_cast<Channel>(chan), static_cast<Channel>(other.chan));
+    case Command::SetMaster:
+    case Command::Mute:
+    case Command::Subscribe:
+    case Command::Status:
+    case Command::Stats:
+        break;
+    default:
+        return false;           // Relative (inc) or not idempotent (byebye)
+    }
+    return other.cmd == cmd && other.targetLen == targetLen &&
+        std::memcmp(other.buf, buf, targetLen) == 0;
+}
+
+bool CommandBuffer::narrow(CommandBuffer &other) const
+{
+    if ((cmd != Command::Set && cmd != Command::MuteChan) || other.cmd != cmd ||
+        chan < 0 || other.chan < 0 || chan == other.chan ||
+        !channelCovers(static_cast<Channel>(other.chan), static_cast<Channel>(chan)))
+        return false;
+
+    // other is a pair and this one of its sides: other keeps the other side, and its value
+    Channel rest = static_cast<Channel>(other.chan + 3 - chan % 3);
+    CommandBuffer narrowed;
+    narrowed.begin(cmd).arg(rest);
+    std::size_t tail = other.len + 1 - other.chanEnd;  // " <value>\n" and the NUL
+    std::memcpy(narrowed.buf + narrowed.len, other.buf + other.chanEnd, tail);
+    narrowed.targetLen = narrowed.len;
+    narrowed.len += tail - 1;
+    other = narrowed;
+    return true;
+}
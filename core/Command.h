@@ -0,0 +1,106 @@
+// -*- Mode: C++ -*-
+
+#ifndef __COMMAND_H
+#define __COMMAND_H
+
+#include <cstddef>
+
+/// \brief Commands understood by the server
+enum class Command
+{
+    Set,        //!< set <chan> <level>
+    SetMaster,  //!< setmaster <level>
+    Inc,        //!< inc <chan> [<step>]
+    IncMaster,  //!< incmaster [<step>]
+    Status,     //!< status
+    Mute,       //!< mute <0/1>
+    MuteChan,   //!< mutechan <chan> <0/1>
+    Reset,      //!< reset
+    Byebye,     //!< byebye
+    Subscribe,  //!< subscribe <0/1>
+    Stats,      //!< stats (server performance counters)
+};
+
+/// \brief Channel names understood by the server
+enum class Channel
+{
+    F, FL, FR,          //!< Front (both), front left, front right
+    CenSub, Cen, Sub,   //!< Center and sub (both), center, sub
+    R, RL, RR,          //!< Rear (both), rear left, rear right
+};
+
+/// \brief Protocol name of cmd ("setmaster" etc.)
+const char *commandName(Command cmd);
+/// \brief Protocol name of chan ("FL" etc.)
+const char *channelName(Channel chan);
+/// \brief Look up a command by its protocol name. Returns false if there is no such command.
+bool commandFromName(const char *name, Command &cmd);
+/// \brief Look up a channel by its protocol name ("FL" etc.). Returns false if there is no such channel.
+bool channelFromName(const char *name, Channel &chan);
+/// \brief Whether setting outer also sets inner: the same channel, or inner is a side of the pair
+///        outer stands for (F covers F, FL and FR)
+bool channelCovers(Channel outer, Channel inner);
+
+/**
+ * \brief A single command line, built in place.
+ *
+ * Command and channel names come from tables of string literals (with their lengths known at
+ * compile time), integers are converted by hand two digits at a time. The result is a
+ * newline-terminated line that can be handed to a socket as is.
+ */
+class CommandBuffer
+{
+public:
+    /// Room for the longest possible line, "mutechan CENSUB -2147483648\n", plus NUL
+    static const std::size_t capacity = 32;
+
+    CommandBuffer();
+
+    /// \brief Start a new line with cmd, throwing away whatever was in the buffer
+    CommandBuffer &begin(Command cmd);
+    /// \brief Append a channel argument
+    CommandBuffer &arg(Channel chan);
+    /// \brief Append an integer argument
+    CommandBuffer &arg(int value);
+    /// \brief Terminate the line (adds the newline and a NUL after it)
+    CommandBuffer &end();
+
+    /// \brief The command the line was started with
+    Command command() const { return cmd; }
+    /// \brief The line, including the newline once end has been called. NUL-terminated.
+    const char *data() const { return buf; }
+    /// \brief Length of the line including the newline
+    std::size_t size() const { return len; }
+
+    /**
+     * \brief Whether the command is latency critical (mute, mutechan): sent ahead of queued
+     *        level changes, and more than once over UDP (see ProtocolCore).
+     */
+    bool isHighPriority() const;
+    /// \brief Whether the command only asks for something (status, stats) and changes nothing
+    bool isQuery() const;
+    /**
+     * \brief Whether sending this command makes sending other pointless: both set the same
+     *        thing to an absolute value (the same command, on a channel this one covers, see
+     *        channelCovers), so only the latest one matters. A reset supersedes every level and
+     *        mute change. Never true for relative commands like inc.
+     */
+    bool supersedes(const CommandBuffer &other) const;
+    /**
+     * \brief Take what this command sets out of other, where this covers part of it: other
+     *        becomes the same command for the rest of its channels ("set F 10" becomes "set FR
+     *        10" given "set FL 50"). Returns false, leaving other alone, if this doesn't cover
+     *        just part of other.
+     */
+    bool narrow(CommandBuffer &other) const;
+
+private:
+    char buf[capacity];
+    std::size_t len;
+    std::size_t targetLen;  //!< Length of the line up to the last argument ("set FL" of "set FL 20")
+    Command cmd;
+    int chan;               //!< The channel argument (a Channel), -1 if none
+    std::size_t chanEnd;    //!< Where the channel argument ends
+};
+
+#endif
@@ -0,0 +1,52 @@
+// -*- Mode: C++ -*-
+
+#ifndef __LATESTVALUE_H
+#define __LATESTVALUE_H
+
+#include <atomic>
+
+/**
+ * \brief Hands the latest of a stream of values from one writer thread to one reader thread,
+ *        without locks: values the reader didn't get to in time are simply overwritten.
+ *
+ * A triple buffer. The writer fills its own buffer and swaps it for the one in the middle, the
+ * reader swaps its own for the middle one when that holds something new. Both sides are wait
+ * free, and neither ever sees a buffer the other is using. T is copied, keep it small and plain.
+ */
+template <typename T>
+class LatestValue
+{
+public:
+    LatestValue() : writeIndex(0), middle(1), readIndex(2) {}
+
+    /// \brief Writer: make value the latest
+    void publish(const T &value)
+    {
+        buffers[writeIndex] = value;
+        unsigned previous = middle.exchange(writeIndex | fresh, std::memory_order_acq_rel);
+        writeIndex = previous & indexMask;
+    }
+
+    /// \brief Reader: get the latest value if there is one not taken yet, otherwise return false
+    ///        and leave value alone
+    bool take(T &value)
+    {
+        if (!(middle.load(std::memory_order_relaxed) & fresh))
+            return false;
+        unsigned previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = previous & indexMask;
+        value = buffers[readIndex];
+        return true;
+    }
+
+private:
+    static const unsigned indexMask = 3;
+    static const unsigned fresh = 4;    //!< In middle: published and not taken yet
+
+    T buffers[3];
+    unsigned writeIndex;                //!< Writer's buffer, touched by the writer only
+    std::atomic<unsigned> middle;       //!< Index of the buffer in between, plus fresh
+    unsigned readIndex;                 //!< Reader's buffer, touched by the reader only
+};
+
+#endif
@@ -0,0 +1,595 @@
+#include "NetProxy.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//// Impairment ////
+
+static bool parseUnsigned(const std::string &text, unsigned &value)
+{
+    char *end;
+    unsigned long v = std::strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end || text[0] == '-')
+        return false;
+    value = (unsigned)v;
+    return true;
+}
+
+static bool parseProbability(const std::string &text, double &value)
+{
+    char *end;
+    double v = std::strtod(text.c_str(), &end);
+    if (end == text.c_str())
+        return false;
+    if (*end == '%')
+    {
+        v /= 100;
+        ++end;
+    }
+    if (*end || !(v >= 0 && v <= 1))
+        return false;
+    value = v;
+    return true;
+}
+
+bool Impairment::parse(const char *spec, std::string &error)
+{
+    const char *p = spec;
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            ++p;
+        if (!*p)
+            break;
+        const char *start = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n')
+            ++p;
+        std::string word(start, p);
+        std::size_t eq = word.find('=');
+        if (eq == std::string::npos)
+        {
+            error = "expected key=value: " + word;
+            return false;
+        }
+        std::string key = word.substr(0, eq), value = word.substr(eq + 1);
+
+        bool ok;
+        if (key == "delay")
+            ok = parseUnsigned(value, delayMs);
+        else if (key == "jitter")
+            ok = parseUnsigned(value, jitterMs);
+        else if (key == "loss")
+            ok = parseProbability(value, loss);
+        else if (key == "dup")
+            ok = parseProbability(value, duplicate);
+        else if (key == "reorder")
+            ok = parseProbability(value, reorder);
+        else if (key == "gap")
+            ok = parseUnsigned(value, reorderMs);
+        else if (key == "rate")
+            ok = parseUnsigned(value, rateKbps);
+        else if (key == "stall")
+            ok = parseUnsigned(value, stallMs);
+        else if (key == "every")
+            ok = parseUnsigned(value, stallEveryMs);
+        else if (key == "dist")
+        {
+            ok = true;
+            if (value == "uniform")
+                distribution = Distribution::Uniform;
+            else if (value == "normal")
+                distribution = Distribution::Normal;
+            else if (value == "pareto")
+                distribution = Distribution::Pareto;
+            else
+                ok = false;
+        }
+        else
+        {
+            error = "unknown impairment: " + key;
+            return false;
+        }
+        if (!ok)
+        {
+            error = "bad value for " + key + ": " + value;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string Impairment::describe() const
+{
+    static const char *distributions[] = { "uniform", "normal", "pareto" };
+    std::string s;
+    char buf[48];
+    auto add = [&s](const char *text) {
+        if (!s.empty())
+            s += ' ';
+        s += text;
+    };
+    if (delayMs)
+    {
+        std::snprintf(buf, sizeof(buf), "delay=%u", delayMs);
+        add(buf);
+    }
+    if (jitterMs)
+    {
+        std::snprintf(buf, sizeof(buf), "jitter=%u dist=%s", jitterMs,
+                      distributions[static_cast<int>(distribution)]);
+        add(buf);
+    }
+    if (loss > 0)
+    {
+        std::snprintf(buf, sizeof(buf), "loss=%g%%", loss*100);
+        add(buf);
+    }
+    if (duplicate > 0)
+    {
+        std::snprintf(buf, sizeof(buf), "dup=%g%%", duplicate*100);
+        add(buf);
+    }
+    if (reorder > 0)
+    {
+        std::snprintf(buf, sizeof(buf), "reorder=%g%% gap=%u", reorder*100, reorderMs);
+        add(buf);
+    }
+    if (rateKbps)
+    {
+        std::snprintf(buf, sizeof(buf), "rate=%u", rateKbps);
+        add(buf);
+    }
+    if (stallMs && stallEveryMs)
+    {
+        std::snprintf(buf, sizeof(buf), "stall=%u every=%u", stallMs, stallEveryMs);
+        add(buf);
+    }
+    return s.empty() ? "none" : s;
+}
+
+//// NetProxy ////
+
+NetProxy::NetProxy(Reactor &_reactor, Transport _transport) :
+    reactor(_reactor), transport(_transport), impairedSince(monotonicMs()), rng(1), listenFd(-1), port_(0), upstream(),
+    upstreamLen(0), nextSession(1), linkFreeAt{0, 0}, timer(0)
+{
+}
+
+NetProxy::~NetProxy()
+{
+    close();
+}
+
+void NetProxy::setImpairment(const Impairment &impairment)
+{
+    this->impairment = impairment;
+    impairedSince = monotonicMs();
+}
+
+bool NetProxy::listen(unsigned port, const char *upstreamHost, unsigned upstreamPort)
+{
+    bool tcp = transport == Transport::Tcp;
+    if (listenFd >= 0)
+    {
+        error_ = "already listening";
+        return false;
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+    addrinfo *res = nullptr;
+    char service[8];
+    std::snprintf(service, sizeof(service), "%u", upstreamPort);
+    int err = getaddrinfo(upstreamHost, service, &hints, &res);
+    if (err != 0)
+    {
+        error_ = std::string(upstreamHost) + ": " + gai_strerror(err);
+        return false;
+    }
+    std::memcpy(&upstream, res->ai_addr, res->ai_addrlen);
+    upstreamLen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    listenFd = ::socket(AF_INET, (tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        error_ = std::strerror(errno);
+        return false;
+    }
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((std::uint16_t)port);
+    socklen_t len = sizeof(addr);
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || (tcp && ::listen(listenFd, 16) < 0) ||
+        getsockname(listenFd, (sockaddr *)&addr, &len) < 0)
+    {
+        error_ = std::strerror(errno);
+        ::close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+    port_ = ntohs(addr.sin_port);
+
+    reactor.add(listenFd, Reactor::Read, [this, tcp](int, unsigned) {
+            if (tcp)
+                acceptClient();
+            else
+                readUdpClient();
+        });
+    return true;
+}
+
+void NetProxy::close()
+{
+    if (timer)
+    {
+        reactor.cancelTimer(timer);
+        timer = 0;
+    }
+    while (!sessions.empty())
+        closeSession(sessions.begin()->first);
+    queue.clear();
+    if (listenFd >= 0)
+    {
+        reactor.remove(listenFd);
+        ::close(listenFd);
+        listenFd = -1;
+    }
+}
+
+void NetProxy::acceptClient()
+{
+    for (;;)
+    {
+        int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd < 0)
+            return;
+        int fd = ::socket(upstream.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || (::connect(fd, (sockaddr *)&upstream, upstreamLen) < 0 && errno != EINPROGRESS))
+        {
+            if (fd >= 0)
+                ::close(fd);
+            ::close(clientFd);  // The client sees the server refusing
+            continue;
+        }
+        // Chunks are timed by the proxy, the kernel shouldn't hold them back as well
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        unsigned id = nextSession++;
+        Session &s = sessions[id];
+        s.fd = fd;
+        s.clientFd = clientFd;
+        reactor.add(clientFd, Reactor::Read, [this, id](int, unsigned events) {
+                auto it = sessions.find(id);
+                if (it != sessions.end() && (events & Reactor::Write))
+                    flushTcp(id, it->second, Down);
+                if (sessions.count(id) && (events & (Reactor::Read | Reactor::Error)))
+                    readSession(id, Up);
+            });
+        reactor.add(fd, Reactor::Write, [this, id](int, unsigned events) {
+                auto it = sessions.find(id);
+                if (it == sessions.end())
+                    return;
+                Session &s = it->second;
+                if (!s.upConnected)
+                {
+                    int soerr = 0;
+                    socklen_t len = sizeof(soerr);
+                    getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+                    if (soerr != 0)
+                    {
+                        closeSession(id);
+                        return;
+                    }
+                    s.upConnected = true;
+                    updateTcpEvents(s);
+                }
+                if (events & Reactor::Write)
+                    flushTcp(id, s, Up);
+                if (sessions.count(id) && (events & (Reactor::Read | Reactor::Error)))
+                    readSession(id, Down);
+            });
+    }
+}
+
+void NetProxy::readUdpClient()
+{
+    char buf[2048];
+    for (;;)
+    {
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t n = recvfrom(listenFd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+        if (n < 0)
+            return;
+
+        std::uint64_t key = (std::uint64_t)from.sin_addr.s_addr << 16 | from.sin_port;
+        auto it = udpClients.find(key);
+        unsigned id;
+        if (it != udpClients.end())
+        {
+            id = it->second;
+        }
+        else
+        {
+            int fd = ::socket(upstream.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                continue;
+            ::connect(fd, (sockaddr *)&upstream, upstreamLen);
+            id = nextSession++;
+            Session &s = sessions[id];
+            s.fd = fd;
+            s.client = from;
+            udpClients[key] = id;
+            reactor.add(fd, Reactor::Read, [this, id](int, unsigned) { readSession(id, Down); });
+        }
+        submit(id, Up, buf, (std::size_t)n);
+    }
+}
+
+void NetProxy::readSession(unsigned id, Direction dir)
+{
+    char buf[4096];
+    for (;;)
+    {
+        auto it = sessions.find(id);
+        if (it == sessions.end())
+            return;
+        Session &s = it->second;
+        int fd = dir == Up ? s.clientFd : s.fd;
+        if (fd < 0 || s.readDone[dir])
+            return;
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n > 0)
+        {
+            submit(id, dir, buf, (std::size_t)n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (transport == Transport::Udp)
+        {
+            if (n < 0 && errno == ECONNREFUSED)
+                continue;       // The server isn't there (yet), the client will find out
+            return;
+        }
+        if (n < 0)
+        {
+            closeSession(id);
+            return;
+        }
+        // End of stream, passed on in order after what was read before it
+        s.readDone[dir] = true;
+        updateTcpEvents(s);
+        submit(id, dir, nullptr, 0);
+        return;
+    }
+}
+
+double NetProxy::sampleDelay()
+{
+    double d = impairment.delayMs, j = impairment.jitterMs;
+    if (j <= 0)
+        return d;
+    switch (impairment.distribution)
+    {
+    case Impairment::Distribution::Uniform:
+        d += std::uniform_real_distribution<double>(-j, j)(rng);
+        break;
+    case Impairment::Distribution::Normal:
+        d = std::normal_distribution<double>(d, j)(rng);
+        break;
+    case Impairment::Distribution::Pareto:
+    {
+        // Shape 2, scaled so that the extra delay averages j
+        double u = std::uniform_real_distribution<double>(1e-9, 1.0)(rng);
+        d += j*(1/std::sqrt(u) - 1);
+        break;
+    }
+    }
+    return d > 0 ? d : 0;
+}
+
+std::uint64_t NetProxy::departure(Session &s, Direction dir, std::size_t len, std::uint64_t now)
+{
+    double t = (double)now;
+    if (impairment.rateKbps && len)
+    {
+        // kbit/s is bits per ms
+        if (linkFreeAt[dir] > t)
+            t = linkFreeAt[dir];
+        t += len*8.0 / impairment.rateKbps;
+        linkFreeAt[dir] = t;
+    }
+    t += sampleDelay();
+    if (transport == Transport::Udp && impairment.reorder > 0 &&
+        std::uniform_real_distribution<double>(0, 1)(rng) < impairment.reorder)
+    {
+        t += impairment.reorderMs;
+        ++counters_[dir].reordered;
+    }
+
+    std::uint64_t at = (std::uint64_t)std::ceil(t);
+    if (impairment.stallMs && impairment.stallEveryMs)
+    {
+        std::uint64_t phase = (at - impairedSince) % impairment.stallEveryMs;
+        if (phase < impairment.stallMs)
+            at += impairment.stallMs - phase;
+    }
+    if (transport == Transport::Tcp)
+    {
+        if (at < s.lastDelivery[dir])
+            at = s.lastDelivery[dir];
+        s.lastDelivery[dir] = at;
+    }
+    return at;
+}
+
+void NetProxy::submit(unsigned id, Direction dir, const char *data, std::size_t len)
+{
+    auto it = sessions.find(id);
+    if (it == sessions.end())
+        return;
+    std::uint64_t now = monotonicMs();
+    std::uniform_real_distribution<double> chance(0, 1);
+
+    unsigned copies = 1;
+    if (transport == Transport::Udp)
+    {
+        if (impairment.loss > 0 && chance(rng) < impairment.loss)
+        {
+            ++counters_[dir].dropped;
+            return;
+        }
+        if (impairment.duplicate > 0 && chance(rng) < impairment.duplicate)
+        {
+            ++counters_[dir].duplicated;
+            copies = 2;
+        }
+    }
+    for (unsigned i = 0; i < copies; ++i)
+    {
+        Packet packet = { id, dir, now, std::string(data ? data : "", len) };
+        queue.emplace(departure(it->second, dir, len, now), std::move(packet));
+    }
+    schedule();
+}
+
+void NetProxy::schedule()
+{
+    if (timer)
+    {
+        reactor.cancelTimer(timer);
+        timer = 0;
+    }
+    if (queue.empty())
+        return;
+    std::uint64_t now = monotonicMs();
+    std::uint64_t at = queue.begin()->first;
+    timer = reactor.addTimer(at > now ? (unsigned)(at - now) : 0, [this]() {
+            timer = 0;
+            deliverDue();
+        });
+}
+
+void NetProxy::deliverDue()
+{
+    std::uint64_t now = monotonicMs();
+    while (!queue.empty() && queue.begin()->first <= now)
+    {
+        Packet packet = std::move(queue.begin()->second);
+        queue.erase(queue.begin());
+        deliver(packet, now);
+    }
+    schedule();
+}
+
+void NetProxy::deliver(const Packet &packet, std::uint64_t now)
+{
+    auto it = sessions.find(packet.session);
+    if (it == sessions.end())
+        return;
+    Session &s = it->second;
+    Direction dir = packet.dir;
+
+    if (!packet.data.empty())
+    {
+        Counters &c = counters_[dir];
+        double delay = (double)(now - packet.readAt);
+        ++c.packets;
+        c.bytes += packet.data.size();
+        c.delayMsTotal += delay;
+        if (delay > c.delayMsMax)
+            c.delayMsMax = delay;
+    }
+
+    if (transport == Transport::Udp)
+    {
+        if (dir == Up)
+            ::send(s.fd, packet.data.data(), packet.data.size(), MSG_NOSIGNAL);
+        else
+            sendto(listenFd, packet.data.data(), packet.data.size(), 0, (const sockaddr *)&s.client, sizeof(s.client));
+        return;
+    }
+
+    if (packet.data.empty())
+        s.eof[dir] = true;
+    else
+        s.tx[dir] += packet.data;
+    flushTcp(packet.session, s, dir);
+}
+
+void NetProxy::flushTcp(unsigned id, Session &s, Direction dir)
+{
+    int fd = dir == Up ? s.fd : s.clientFd;
+    if (dir == Up && !s.upConnected)
+        return;
+    std::string &tx = s.tx[dir];
+    while (!tx.empty())
+    {
+        ssize_t n = ::send(fd, tx.data(), tx.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            closeSession(id);
+            return;
+        }
+        tx.erase(0, (std::size_t)n);
+    }
+    if (tx.empty() && s.eof[dir])
+    {
+        shutdown(fd, SHUT_WR);
+        if (s.eof[Up] && s.eof[Down] && s.tx[Up].empty() && s.tx[Down].empty())
+        {
+            closeSession(id);
+            return;
+        }
+    }
+    updateTcpEvents(s);
+}
+
+void NetProxy::updateTcpEvents(Session &s)
+{
+    // Stop reading a side once it has ended (the end is queued), keep watching for room to write
+    unsigned client = (s.readDone[Up] ? 0u : (unsigned)Reactor::Read) |
+        (s.tx[Down].empty() ? 0u : (unsigned)Reactor::Write);
+    unsigned server = !s.upConnected ? (unsigned)Reactor::Write :
+        (s.readDone[Down] ? 0u : (unsigned)Reactor::Read) | (s.tx[Up].empty() ? 0u : (unsigned)Reactor::Write);
+    reactor.modify(s.clientFd, client);
+    reactor.modify(s.fd, server);
+}
+
+void NetProxy::closeSession(unsigned id)
+{
+    auto it = sessions.find(id);
+    if (it == sessions.end())
+        return;
+    Session &s = it->second;
+    for (int fd: { s.fd, s.clientFd })
+    {
+        if (fd >= 0)
+        {
+            reactor.remove(fd);
+            ::close(fd);
+        }
+    }
+    if (transport == Transport::Udp)
+        udpClients.erase((std::uint64_t)s.client.sin_addr.s_addr << 16 | s.client.sin_port);
+    sessions.erase(it);
+}
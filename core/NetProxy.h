@@ -0,0 +1,158 @@
+// -*- Mode: C++ -*-
+
+#ifndef __NETPROXY_H
+#define __NETPROXY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+
+#include <netinet/in.h>
+
+#include "ProtocolCore.h"       // Transport
+#include "Reactor.h"
+
+/**
+ * \brief How NetProxy mistreats the traffic going through it, the same in both directions.
+ *
+ * Written as "key=value ..." (see parse): delay=50 jitter=20 dist=normal loss=0.05 ...
+ */
+struct Impairment
+{
+    enum class Distribution
+    {
+        Uniform,        //!< delay +- jitter
+        Normal,         //!< mean delay, standard deviation jitter
+        Pareto,         //!< delay plus a heavy tail with mean jitter (the odd very late packet)
+    };
+
+    unsigned delayMs = 0;           //!< delay: one way
+    unsigned jitterMs = 0;          //!< jitter: spread of the delay, see Distribution
+    Distribution distribution = Distribution::Uniform;  //!< dist: uniform, normal or pareto
+    double loss = 0;                //!< loss: probability a datagram is dropped (UDP)
+    double duplicate = 0;           //!< dup: probability a datagram is sent twice (UDP)
+    double reorder = 0;             //!< reorder: probability a datagram is held back ...
+    unsigned reorderMs = 20;        //!< gap: ... by this much longer, so that later ones overtake it (UDP)
+    unsigned rateKbps = 0;          //!< rate: bandwidth cap in kbit/s, 0 = none
+    unsigned stallMs = 0;           //!< stall: nothing gets through for this long ...
+    unsigned stallEveryMs = 0;      //!< every: ... at the start of every period this long
+                                    //!< (from when the impairment was set)
+
+    /**
+     * \brief Set the keys named in spec ("delay=50 loss=0.1", whitespace separated), leaving the
+     *        rest alone. Probabilities are 0 to 1, or percentages with a % sign ("loss=10%").
+     * \return false (with error set) on an unknown key or a bad value
+     */
+    bool parse(const char *spec, std::string &error);
+    /// \brief The non-default settings, in the form parse takes
+    std::string describe() const;
+};
+
+/**
+ * \brief A TCP or UDP proxy on loopback that impairs what goes through it: delay with jitter,
+ *        loss, duplication, reordering, a bandwidth cap and stalls.
+ *
+ * Runs on a Reactor, so a test can have the proxy, the client and even a fake server in one
+ * process and one event loop, and change the impairment (setImpairment) at any point of the
+ * test. Random decisions come from a seeded generator, so that a run can be repeated exactly.
+ *
+ * Every UDP client (address and port) gets its own socket to the server, every TCP connection its
+ * own connection. A TCP stream is only delayed, rate limited and stalled (it can't lose or reorder
+ * bytes), and stays in order: a chunk never overtakes the one read before it.
+ */
+class NetProxy
+{
+public:
+    enum Direction { Up, Down };    //!< Client to server, server to client
+
+    struct Counters
+    {
+        unsigned long packets = 0;      //!< Datagrams or TCP reads delivered (copies included)
+        unsigned long bytes = 0;
+        unsigned long dropped = 0;
+        unsigned long duplicated = 0;
+        unsigned long reordered = 0;
+        double delayMsTotal = 0;        //!< Time spent in the proxy, over all packets
+        double delayMsMax = 0;
+    };
+
+    NetProxy(Reactor &reactor, Transport transport);
+    ~NetProxy();
+
+    /**
+     * \brief Listen on 127.0.0.1:port (0 = any free port, see port) and forward to
+     *        upstreamHost:upstreamPort.
+     * \return false (with errorString set) on failure
+     */
+    bool listen(unsigned port, const char *upstreamHost, unsigned upstreamPort);
+    /// \brief Stop listening and drop all clients and everything in flight
+    void close();
+    /// \brief The port listened on
+    unsigned port() const { return port_; }
+
+    /// \brief Takes effect for everything read from now on. Stall periods start now.
+    void setImpairment(const Impairment &impairment);
+    const Impairment &currentImpairment() const { return impairment; }
+    void setSeed(unsigned seed) { rng.seed(seed); }
+
+    const Counters &counters(Direction dir) const { return counters_[dir]; }
+    /// \brief Packets read but not delivered yet
+    std::size_t inFlight() const { return queue.size(); }
+    const std::string &errorString() const { return error_; }
+
+private:
+    struct Session
+    {
+        int fd = -1;                //!< Towards the server
+        sockaddr_in client = {};    //!< UDP: where replies go
+        int clientFd = -1;          //!< TCP: the accepted connection
+        bool upConnected = false;   //!< TCP: connect to the server completed
+        std::string tx[2];          //!< TCP: waiting for the socket to take it, by Direction
+        bool readDone[2] = { false, false }; //!< TCP: the sending side of Direction closed ...
+        bool eof[2] = { false, false };      //!< ... and that has been passed on
+        std::uint64_t lastDelivery[2] = { 0, 0 };
+    };
+
+    struct Packet
+    {
+        unsigned session;
+        Direction dir;
+        std::uint64_t readAt;
+        std::string data;           //!< Empty for a TCP end of stream
+    };
+
+    Reactor &reactor;
+    Transport transport;
+    Impairment impairment;
+    std::uint64_t impairedSince; //!< When impairment was set
+    std::mt19937 rng;
+    int listenFd;
+    unsigned port_;
+    sockaddr_storage upstream;
+    socklen_t upstreamLen;
+    std::map<unsigned, Session> sessions;
+    std::map<std::uint64_t, unsigned> udpClients;   //!< Address and port -> session
+    unsigned nextSession;
+    std::multimap<std::uint64_t, Packet> queue;     //!< By delivery time, in order of arrival
+    double linkFreeAt[2];       //!< Bandwidth cap: when the last packet is done being "sent"
+    unsigned timer;             //!< 0 when not scheduled
+    Counters counters_[2];
+    std::string error_;
+
+    void acceptClient();
+    void readUdpClient();
+    void readSession(unsigned id, Direction dir);
+    void submit(unsigned id, Direction dir, const char *data, std::size_t len);
+    std::uint64_t departure(Session &session, Direction dir, std::size_t len, std::uint64_t now);
+    double sampleDelay();
+    void schedule();
+    void deliverDue();
+    void deliver(const Packet &packet, std::uint64_t now);
+    void flushTcp(unsigned id, Session &session, Direction dir);
+    void updateTcpEvents(Session &session);
+    void closeSession(unsigned id);
+};
+
+#endif
@@ -0,0 +1,444 @@
+#include "OscBridge.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "ProtocolCore.h"
+
+static const int maxLevel = 99;
+
+/* OSC is big endian, strings are NUL-terminated and padded to a multiple of 4 */
+
+static std::uint32_t readU32(const char *p)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return (std::uint32_t)u[0] << 24 | (std::uint32_t)u[1] << 16 | (std::uint32_t)u[2] << 8 | u[3];
+}
+
+static void writeU32(char *p, std::uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+/// Length of the padded string at data, 0 if it isn't terminated within len
+static std::size_t paddedLength(const char *data, std::size_t len)
+{
+    const char *nul = static_cast<const char *>(std::memchr(data, '\0', len));
+    if (!nul)
+        return 0;
+    std::size_t n = ((std::size_t)(nul - data) + 4) & ~(std::size_t)3;
+    return n <= len ? n : 0;
+}
+
+/* Targets of a Channel. The channels come in threes, group first (F, FL, FR). */
+static unsigned levelTarget(unsigned chan) { return 2 + 2*chan; }
+static bool isChannelTarget(unsigned target) { return target >= 2; }
+static unsigned targetChannel(unsigned target) { return (target - 2) / 2; }
+static bool isMuteTarget(unsigned target) { return target == 1 || (target >= 2 && target % 2 == 1); }
+static bool isGroup(unsigned chan) { return chan % 3 == 0; }
+
+OscBridge::OscBridge(OscBridgeHandler &_handler) :
+    handler(_handler), rate(40), burst(4), echoHoldMs(300),
+    queued(0), statusWanted(false), tokens(4), refilledAt(0), lastTouchAt(0),
+    haveStatus(false), status(), intLevels(false),
+    messages_(0), commands_(0), mirrored_(0)
+{
+    for (Target &t: targets)
+    {
+        t.value = 0;
+        t.shown = -1;
+        t.dirty = false;
+        t.touchedAt = 0;
+    }
+}
+
+void OscBridge::setRate(unsigned commandsPerS, unsigned burst)
+{
+    rate = commandsPerS ? commandsPerS : 1;
+    this->burst = burst ? burst : 1;
+    if (tokens > this->burst)
+        tokens = this->burst;
+}
+
+bool OscBridge::received(const char *data, std::size_t len)
+{
+    bool understood = false;
+    if (len >= 16 && std::memcmp(data, "#bundle", 8) == 0)
+    {
+        // "#bundle", time tag (ignored, everything is carried out right away), then elements
+        // each preceded by their size
+        std::size_t pos = 16;
+        while (pos + 4 <= len)
+        {
+            std::size_t size = readU32(data + pos);
+            pos += 4;
+            if (size > len - pos)
+                break;
+            understood |= received(data + pos, size);
+            pos += size;
+        }
+    }
+    else
+    {
+        understood = handleMessage(data, len);
+    }
+    tick();
+    return understood;
+}
+
+bool OscBridge::handleMessage(const char *data, std::size_t len)
+{
+    std::size_t addrLen = paddedLength(data, len);
+    if (addrLen == 0 || data[0] != '/')
+        return false;
+    const char *address = data;
+
+    // The first argument, if any
+    bool hasValue = false;
+    bool isInt = false;
+    double value = 0;
+    std::size_t tagsLen = paddedLength(data + addrLen, len - addrLen);
+    if (tagsLen > 0 && data[addrLen] == ',' && data[addrLen + 1] != '\0')
+    {
+        const char *arg = data + addrLen + tagsLen;
+        std::size_t argLen = len - addrLen - tagsLen;
+        switch (data[addrLen + 1])
+        {
+        case 'f':
+            if (argLen >= 4)
+            {
+                std::uint32_t bits = readU32(arg);
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                value = f;
+                hasValue = true;
+            }
+            break;
+        case 'i':
+            if (argLen >= 4)
+            {
+                value = (std::int32_t)readU32(arg);
+                hasValue = isInt = true;
+            }
+            break;
+        case 'd':
+            if (argLen >= 8)
+            {
+                std::uint64_t bits = (std::uint64_t)readU32(arg) << 32 | readU32(arg + 4);
+                std::memcpy(&value, &bits, sizeof(value));
+                hasValue = true;
+            }
+            break;
+        case 'T':
+        case 'F':
+            value = data[addrLen + 1] == 'T';
+            hasValue = isInt = true;
+            break;
+        }
+    }
+
+    if (std::strncmp(address, "/vc/", 4) != 0)
+        return false;
+    const char *name = address + 4;
+
+    if (std::strcmp(name, "status") == 0)
+    {
+        ++messages_;
+        mirrorAll();
+        return true;
+    }
+    if (!hasValue)
+        return false;
+
+    unsigned target;
+    if (std::strcmp(name, "master") == 0)
+    {
+        target = MasterTarget;
+    }
+    else if (std::strcmp(name, "mute") == 0)
+    {
+        target = MuteTarget;
+    }
+    else
+    {
+        // <chan> or <chan>/mute
+        char upper[8];
+        std::size_t n = 0;
+        while (name[n] && name[n] != '/' && n < sizeof(upper) - 1)
+        {
+            upper[n] = (char)std::toupper((unsigned char)name[n]);
+            ++n;
+        }
+        upper[n] = '\0';
+        Channel chan;
+        if (!channelFromName(upper, chan))
+            return false;
+        target = levelTarget(static_cast<unsigned>(chan));
+        if (std::strcmp(name + n, "/mute") == 0)
+            ++target;
+        else if (name[n] != '\0')
+            return false;
+    }
+
+    int level;
+    if (isMuteTarget(target))
+    {
+        level = value >= 0.5 ? 1 : 0;   // Buttons send 1.0 when pressed
+    }
+    else
+    {
+        intLevels = isInt;
+        if (!isInt)
+            value *= maxLevel;
+        level = value >= maxLevel ? maxLevel : value > 0 ? (int)(value + 0.5) : 0;
+    }
+
+    ++messages_;
+    set(target, level);
+    return true;
+}
+
+void OscBridge::set(unsigned target, int value)
+{
+    std::uint64_t now = monotonicMs();
+    Target &t = targets[target];
+    t.value = value;
+    t.shown = value;            // The surface shows what it just sent
+    t.touchedAt = now;
+    lastTouchAt = now;
+
+    // A group sets both its channels, what was waiting for them is out of date
+    if (isChannelTarget(target) && isGroup(targetChannel(target)))
+    {
+        unqueue(target + 2);
+        unqueue(target + 4);
+    }
+
+    if (t.dirty)
+        return;                 // Keeps its place in the queue, with the latest value
+    t.dirty = true;
+
+    // Mutes go ahead of the fader values waiting
+    unsigned pos = queued;
+    if (isMuteTarget(target))
+    {
+        pos = 0;
+        while (pos < queued && isMuteTarget(queue[pos]))
+            ++pos;
+        std::memmove(queue + pos + 1, queue + pos, (queued - pos)*sizeof(queue[0]));
+    }
+    queue[pos] = target;
+    ++queued;
+}
+
+void OscBridge::unqueue(unsigned target)
+{
+    if (!targets[target].dirty)
+        return;
+    targets[target].dirty = false;
+    for (unsigned i = 0; i < queued; ++i)
+    {
+        if (queue[i] == target)
+        {
+            std::memmove(queue + i, queue + i + 1, (queued - i - 1)*sizeof(queue[0]));
+            --queued;
+            return;
+        }
+    }
+}
+
+void OscBridge::refill(std::uint64_t now)
+{
+    if (refilledAt == 0 || now < refilledAt)
+        refilledAt = now;
+    tokens += (double)(now - refilledAt) * rate / 1000.0;
+    if (tokens > burst)
+        tokens = burst;
+    refilledAt = now;
+}
+
+void OscBridge::sendTarget(unsigned target)
+{
+    Target &t = targets[target];
+    t.dirty = false;
+
+    CommandBuffer cmd;
+    if (target == MasterTarget)
+        cmd.begin(Command::SetMaster).arg(t.value);
+    else if (target == MuteTarget)
+        cmd.begin(Command::Mute).arg(t.value);
+    else
+        cmd.begin(isMuteTarget(target) ? Command::MuteChan : Command::Set)
+            .arg(static_cast<Channel>(targetChannel(target))).arg(t.value);
+    cmd.end();
+    ++commands_;
+    handler.sendCommand(cmd);
+}
+
+std::uint64_t OscBridge::nextDeadline() const
+{
+    std::uint64_t now = monotonicMs();
+    std::uint64_t next = 0;
+    auto consider = [&next](std::uint64_t at) {
+        if (next == 0 || at < next)
+            next = at;
+    };
+
+    std::uint64_t tokenAt = now;
+    if (tokens < 1)
+        tokenAt = refilledAt + (std::uint64_t)((1 - tokens)*1000.0/rate) + 1;
+    if (queued)
+        consider(tokenAt);
+    else if (statusWanted)
+        consider(std::max(tokenAt, lastTouchAt + echoHoldMs));
+
+    // Faders to mirror once let go
+    for (unsigned i = 0; i < numTargets; ++i)
+    {
+        int value;
+        if (targets[i].touchedAt && !targets[i].dirty && statusValue(i, value) && value != targets[i].shown)
+            consider(targets[i].touchedAt + echoHoldMs);
+    }
+    return next;
+}
+
+void OscBridge::tick()
+{
+    std::uint64_t now = monotonicMs();
+    refill(now);
+    while (queued > 0 && tokens >= 1)
+    {
+        unsigned target = queue[0];
+        std::memmove(queue, queue + 1, (queued - 1)*sizeof(queue[0]));
+        --queued;
+        sendTarget(target);
+        tokens -= 1;
+        statusWanted = true;
+    }
+
+    // Once the surface has gone quiet, find out where things ended up (the server clamps, and
+    // may have been told otherwise by someone else in the meantime)
+    if (queued == 0 && statusWanted && tokens >= 1 && now >= lastTouchAt + echoHoldMs)
+    {
+        CommandBuffer cmd;
+        cmd.begin(Command::Status).end();
+        ++commands_;
+        tokens -= 1;
+        statusWanted = false;
+        handler.sendCommand(cmd);
+    }
+
+    mirrorChanged(false);
+}
+
+bool OscBridge::statusValue(unsigned target, int &value) const
+{
+    if (!haveStatus)
+        return false;
+    const ServerStatus &s = status;
+    // Indexed by Channel: level, mute (the groups are left at -1)
+    const int channels[][2] = {
+        { -1, -1 },               { s.fl_level, s.fl_mute },   { s.fr_level, s.fr_mute },
+        { -1, -1 },               { s.cen_level, s.cen_mute }, { s.sub_level, s.sub_mute },
+        { -1, -1 },               { s.rl_level, s.rl_mute },   { s.rr_level, s.rr_mute },
+    };
+
+    if (target == MasterTarget)
+    {
+        value = s.master;
+        return true;
+    }
+    if (target == MuteTarget)
+    {
+        value = s.global_mute;
+        return true;
+    }
+    unsigned chan = targetChannel(target);
+    unsigned which = isMuteTarget(target) ? 1 : 0;
+    if (!isGroup(chan))
+    {
+        value = channels[chan][which];
+        return true;
+    }
+    // A group shows its channels' value when they agree
+    if (channels[chan + 1][which] != channels[chan + 2][which])
+        return false;
+    value = channels[chan + 1][which];
+    return true;
+}
+
+bool OscBridge::held(unsigned target, std::uint64_t now) const
+{
+    const Target &t = targets[target];
+    return t.dirty || (t.touchedAt && now < t.touchedAt + echoHoldMs);
+}
+
+void OscBridge::mirror(unsigned target, int value)
+{
+    char address[32];
+    if (target == MasterTarget)
+        std::strcpy(address, "/vc/master");
+    else if (target == MuteTarget)
+        std::strcpy(address, "/vc/mute");
+    else
+    {
+        std::strcpy(address, "/vc/");
+        char *p = address + 4;
+        for (const char *c = channelName(static_cast<Channel>(targetChannel(target))); *c; ++c)
+            *p++ = (char)std::tolower((unsigned char)*c);
+        std::strcpy(p, isMuteTarget(target) ? "/mute" : "");
+    }
+
+    // Address, type tags and the argument, each padded to 4 bytes
+    char packet[48] = {};
+    std::size_t len = (std::strlen(address) + 4) & ~(std::size_t)3;
+    std::memcpy(packet, address, std::strlen(address));
+    std::uint32_t bits;
+    if (intLevels)
+    {
+        std::memcpy(packet + len, ",i", 2);
+        bits = (std::uint32_t)value;
+    }
+    else
+    {
+        std::memcpy(packet + len, ",f", 2);
+        float f = isMuteTarget(target) ? (float)value : (float)value / maxLevel;
+        std::memcpy(&bits, &f, sizeof(bits));
+    }
+    len += 4;
+    writeU32(packet + len, bits);
+    len += 4;
+
+    targets[target].shown = value;
+    ++mirrored_;
+    handler.sendToSurface(packet, len);
+}
+
+void OscBridge::mirrorChanged(bool all)
+{
+    std::uint64_t now = monotonicMs();
+    for (unsigned i = 0; i < numTargets; ++i)
+    {
+        int value;
+        if (!statusValue(i, value))
+            continue;
+        if (all || (!held(i, now) && value != targets[i].shown))
+            mirror(i, value);
+    }
+}
+
+void OscBridge::statusReceived(const ServerStatus &values)
+{
+    status = values;
+    haveStatus = true;
+    mirrorChanged(false);
+}
+
+void OscBridge::mirrorAll()
+{
+    mirrorChanged(true);
+}
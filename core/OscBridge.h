@@ -0,0 +1,129 @@
+// -*- Mode: C++ -*-
+
+#ifndef __OSCBRIDGE_H
+#define __OSCBRIDGE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Command.h"
+#include "Status.h"
+
+/**
+ * \brief What OscBridge needs from the outside world: somewhere to send commands (normally
+ *        ProtocolCore::send) and a way back to the control surface.
+ */
+class OscBridgeHandler
+{
+public:
+    virtual ~OscBridgeHandler() {}
+
+    /// \brief Send a command to the server
+    virtual void sendCommand(const CommandBuffer &cmd) =0;
+    /// \brief Send one OSC packet to the control surface
+    virtual void sendToSurface(const char *data, std::size_t len) =0;
+};
+
+/**
+ * \brief Drives the server from an OSC control surface (hardware, or a tablet app like TouchOSC),
+ *        without any I/O of its own.
+ *
+ * Addresses (channel names as in the protocol, in any case):
+ *
+ *     /vc/master <level>          /vc/mute <0/1>
+ *     /vc/<chan> <level>          /vc/<chan>/mute <0/1>
+ *     /vc/status                  (no arguments) send the whole state back
+ *
+ * A level is a float from 0 to 1 (what faders send) or an int from 0 to 99. Bundles are taken
+ * apart, anything else is ignored.
+ *
+ * Surfaces stream fader moves at 100 Hz and more, far more than the server needs (or can take
+ * over WiFi). Only the latest value of every fader is kept, and those are sent on a token bucket
+ * of setRate commands per second, oldest change first. A group fader (F, R, CENSUB) drops the
+ * waiting values of its channels. Mutes go ahead of waiting fader values.
+ *
+ * The state of the server (statusReceived) is mirrored back to the surface, as floats or ints
+ * depending on what the surface sends. A fader the surface moved within the last setEchoHold
+ * milliseconds is left alone, so that an older status doesn't yank it back while it is being
+ * moved; what it should show is sent once it has been let go.
+ */
+class OscBridge
+{
+public:
+    OscBridge(OscBridgeHandler &handler);
+
+    /// \brief At most commandsPerS commands to the server, burst in a row. Default 40/s, 4.
+    void setRate(unsigned commandsPerS, unsigned burst);
+    /// \brief How long a fader moved on the surface is not mirrored to. Default 300 ms.
+    void setEchoHold(unsigned ms) { echoHoldMs = ms; }
+
+    /// \brief Feed one datagram from the surface. Returns false if nothing in it was understood.
+    bool received(const char *data, std::size_t len);
+    /// \brief Feed a status from the server, mirrored to the surface
+    void statusReceived(const ServerStatus &status);
+    /// \brief Send the whole last status to the surface (a new surface showed up)
+    void mirrorAll();
+
+    /// \brief Time (monotonicMs) at which tick wants to be called, 0 if never
+    std::uint64_t nextDeadline() const;
+    /// \brief Send what the rate allows, mirror faders that have been let go. Harmless to call early.
+    void tick();
+
+    /// \brief OSC messages understood
+    unsigned long messages() const { return messages_; }
+    /// \brief Commands sent to the server (including status requests)
+    unsigned long commands() const { return commands_; }
+    /// \brief OSC messages sent back to the surface
+    unsigned long mirrored() const { return mirrored_; }
+
+private:
+    /* Everything the surface can set: master, global mute, then level and mute of every Channel */
+    enum : unsigned
+    {
+        MasterTarget,
+        MuteTarget,
+        FirstChannelTarget,
+        numTargets = FirstChannelTarget + 2*(static_cast<unsigned>(Channel::RR) + 1),
+    };
+
+    struct Target
+    {
+        int value;              //!< Latest value from the surface
+        int shown;              //!< What the surface shows as far as we know, -1 = don't know
+        bool dirty;             //!< value not sent yet
+        std::uint64_t touchedAt; //!< Last set by the surface (monotonicMs)
+    };
+
+    OscBridgeHandler &handler;
+    unsigned rate;
+    unsigned burst;
+    unsigned echoHoldMs;
+
+    Target targets[numTargets];
+    unsigned queue[numTargets]; //!< Dirty targets, oldest change first
+    unsigned queued;
+    bool statusWanted;          //!< Ask the server for its status once the queue is empty
+    double tokens;
+    std::uint64_t refilledAt;
+    std::uint64_t lastTouchAt;  //!< Last message from the surface
+
+    bool haveStatus;
+    ServerStatus status;
+    bool intLevels;             //!< Mirror levels as ints (the surface sends ints)
+
+    unsigned long messages_;
+    unsigned long commands_;
+    unsigned long mirrored_;
+
+    bool handleMessage(const char *data, std::size_t len);
+    void set(unsigned target, int value);
+    void unqueue(unsigned target);
+    void refill(std::uint64_t now);
+    void sendTarget(unsigned target);
+    bool statusValue(unsigned target, int &value) const;
+    bool held(unsigned target, std::uint64_t now) const;
+    void mirror(unsigned target, int value);
+    void mirrorChanged(bool all);
+};
+
+#endif
@@ -0,0 +1,656 @@
+#include "ProtocolCore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+std::uint64_t monotonicMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool startsWith(const char *line, std::size_t len, const char *prefix, std::size_t prefixLen)
+{
+    return len >= prefixLen && std::memcmp(line, prefix, prefixLen) == 0;
+}
+
+#define STARTS_WITH(line, len, s) startsWith(line, len, s, sizeof(s) - 1)
+
+/// Length of line without a trailing newline (and carriage return)
+static std::size_t chomp(const char *line, std::size_t len)
+{
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+        --len;
+    return len;
+}
+
+ProtocolCore::ProtocolCore(Transport transport, ProtocolHandler &_handler) :
+    transport_(transport), handler(_handler), state_(State::Disconnected),
+    subscribe(false), pingIntervalMs(1000), pingMisses(5), connectTimeoutMs(10000),
+    maxInFlight(0), redundantCopies(2), redundancyIntervalMs(20), reliable(false), capture(nullptr),
+    nextSeq(1), pingSentAt(0), pingRetryAt(0), srttMs(0), rttvarMs(0), rtoMs(200), retransmits_(0), status_(), statusVersion_(0)
+{
+    reset();
+}
+
+void ProtocolCore::setPing(unsigned intervalMs, unsigned misses)
+{
+    pingIntervalMs = intervalMs;
+    pingMisses = misses;
+}
+
+void ProtocolCore::setRedundancy(unsigned copies, unsigned intervalMs)
+{
+    redundantCopies = copies;
+    redundancyIntervalMs = intervalMs;
+}
+
+std::uint64_t ProtocolCore::nextDeadline() const
+{
+    std::uint64_t next = deadline;
+    for (const Resend &resend: resends)
+        if (resend.copiesLeft && (!next || resend.at < next))
+            next = resend.at;
+    for (const Unacked &entry: unacked)
+        if (!next || entry.at < next)
+            next = entry.at;
+    if (state_ == State::Connecting && transport_ == Transport::Udp && pingRetryAt < next)
+        next = pingRetryAt;
+    return next;
+}
+
+void ProtocolCore::reset()
+{
+    deadline = 0;
+    unanswered = 0;
+    trackedHead = trackedCount = 0;
+    trackingLost = false;
+    pending = 0;
+    rxlen = 0;
+    discarding = false;
+    sendQueue.clear();
+    for (Resend &resend: resends)
+        resend.copiesLeft = 0;
+    unacked.clear();
+    pingSentAt = 0;
+}
+
+void ProtocolCore::setState(State state)
+{
+    State old = state_;
+    state_ = state;
+    if (state == State::Connected && old != State::Connected)
+    {
+        recordEvent("connected");
+        handler.onConnected();
+    }
+    else if (state == State::Disconnected && old == State::Connected)
+    {
+        recordEvent("disconnected");
+        handler.onDisconnected();
+    }
+}
+
+void ProtocolCore::record(SessionCapture::Type type, const char *data, std::size_t len)
+{
+    if (capture)
+        capture->record(type, data, len);
+}
+
+void ProtocolCore::recordEvent(const char *text)
+{
+    if (capture)
+        capture->event(text);
+}
+
+void ProtocolCore::startConnect(const char *host, unsigned port)
+{
+    if (state_ != State::Disconnected)
+        return;
+
+    reset();
+    statusVersion_ = 0;
+    if (capture)
+    {
+        char event[300];
+        std::snprintf(event, sizeof(event), "connect %s %s %u",
+                      transport_ == Transport::Tcp ? "tcp" : "udp", host, port);
+        recordEvent(event);
+    }
+    state_ = State::Connecting;
+    std::uint64_t now = monotonicMs();
+    deadline = now + connectTimeoutMs;
+
+    // There is no connection to make over UDP, ping the server with a status command instead.
+    // The first datagram back means it is there.
+    if (transport_ == Transport::Udp)
+    {
+        // Start every session somewhere else, so that the server can tell a new one from
+        // resends of the last one (see setReliable)
+        nextSeq = std::random_device()() % (1u << 28) + 1;
+        pingSentAt = now;
+        pingRetryAt = now + rtoMs;
+        writeDatagram(command.begin(Command::Status).end());
+    }
+}
+
+void ProtocolCore::connectionUp()
+{
+    if (state_ != State::Connecting || transport_ != Transport::Tcp)
+        return;
+
+    deadline = 0;
+    setState(State::Connected);
+    if (subscribe)
+        sendCmd(Command::Subscribe, 1); // Get told about changes made by other clients
+    sendCmd(Command::Status);
+}
+
+void ProtocolCore::connectionDown()
+{
+    // A failed connect is reported by whoever tried to make the connection, and a disconnect we
+    // asked for has already been dealt with by disconnect
+    State old = state_;
+    reset();
+    state_ = State::Disconnected;
+    if (old == State::Connected)
+    {
+        recordEvent("disconnected");
+        handler.onDisconnected();
+    }
+}
+
+void ProtocolCore::disconnect()
+{
+    if (state_ == State::Disconnected)
+        return;
+
+    if (transport_ == Transport::Tcp && state_ == State::Connected)
+        sendCmd(Command::Byebye);
+    reset();
+    setState(State::Disconnected);
+}
+
+void ProtocolCore::tick()
+{
+    std::uint64_t now = monotonicMs();
+    sendCopies(now);
+    retransmit(now);
+    if (state_ == State::Connecting && transport_ == Transport::Udp && now >= pingRetryAt &&
+        now < deadline)
+    {
+        // The ping or its reply may have been lost, ask again (backing off)
+        pingSentAt = 0;         // The reply could be to any of them
+        pingRetryAt = now + std::min<std::uint64_t>((std::uint64_t)rtoMs << ++unanswered, maxRtoMs);
+        writeDatagram(command.begin(Command::Status).end());
+    }
+    if (deadline == 0 || now < deadline)
+        return;
+
+    if (state_ == State::Connecting)
+    {
+        reset();
+        state_ = State::Disconnected;
+        recordEvent("connect failed");
+        handler.onError(ProtocolError::ConnectFailed, transport_ == Transport::Udp ?
+                        "no reply to ping" : "timed out");
+        return;
+    }
+
+    if (state_ == State::Connected && transport_ == Transport::Udp)
+    {
+        if (unanswered > pingMisses)
+        {
+            // If we've been waiting for an answer longer than pingMisses update intervals
+            // consider us as having lost connection with the server.
+            disconnect();
+            handler.onError(ProtocolError::ConnectionLost, "no reply to pings");
+            return;
+        }
+
+        // Only time a ping while the previous ones have been answered, a reply could be to any
+        // of them
+        pingSentAt = ++unanswered == 1 ? now : 0;
+        writeDatagram(command.begin(Command::Status).end());
+        deadline = now + pingIntervalMs;
+        return;
+    }
+
+    deadline = 0;
+}
+
+void ProtocolCore::sendCmd(Command cmd)
+{
+    command.begin(cmd).end();
+    send(command);
+}
+
+void ProtocolCore::sendCmd(Command cmd, int value)
+{
+    command.begin(cmd).arg(value).end();
+    send(command);
+}
+
+void ProtocolCore::sendCmd(Command cmd, Channel chan, int value)
+{
+    command.begin(cmd).arg(chan).arg(value).end();
+    send(command);
+}
+
+void ProtocolCore::send(const CommandBuffer &cmd)
+{
+    if (&cmd != &command)
+        command = cmd;          // Kept around for when replies can't be matched to commands
+
+    if (cmd.command() == Command::Reset)
+    {
+        // A copy of an earlier mute arriving after the reset would undo it
+        for (Resend &resend: resends)
+            resend.copiesLeft = 0;
+    }
+
+    if (transport_ == Transport::Udp)
+    {
+        if (reliable && !cmd.isQuery())
+        {
+            sendReliable(cmd);
+            return;
+        }
+        if (cmd.isHighPriority())
+            scheduleCopies(cmd);
+        transmit(cmd);
+        return;
+    }
+
+    // A mute jumps the queue, but never a reset waiting in it: sent after the reset, it has to
+    // end up applied after it too
+    if ((cmd.isHighPriority() && !resetQueued()) || maxInFlight == 0 ||
+        (sendQueue.empty() && pending < maxInFlight))
+    {
+        transmit(cmd);
+        return;
+    }
+
+    // Wait for room. Values that are still waiting and are superseded by this one are dropped
+    // (and this one goes at the end, so that it still comes after anything queued in between).
+    for (auto it = sendQueue.begin(); it != sendQueue.end(); )
+    {
+        if (cmd.supersedes(*it))
+            it = sendQueue.erase(it);
+        else
+            ++it;
+    }
+    sendQueue.push_back(cmd);
+}
+
+bool ProtocolCore::resetQueued() const
+{
+    for (const CommandBuffer &queued: sendQueue)
+    {
+        if (queued.command() == Command::Reset)
+            return true;
+    }
+    return false;
+}
+
+void ProtocolCore::transmit(const CommandBuffer &cmd)
+{
+    if (transport_ == Transport::Udp)
+    {
+        // Only queries are replied to over UDP (errors aside)
+        if (cmd.isQuery())
+            ++pending;
+        writeDatagram(cmd);
+        return;
+    }
+
+    ++pending;
+    if (trackedCount < maxTracked && !trackingLost)
+        tracked[(trackedHead + trackedCount++) % maxTracked] = cmd.command();
+    else
+        trackingLost = true;
+    record(SessionCapture::Sent, cmd.data(), cmd.size());
+    handler.writeToServer(cmd.data(), cmd.size());
+}
+
+void ProtocolCore::writeDatagram(const CommandBuffer &cmd)
+{
+    record(SessionCapture::Sent, cmd.data(), cmd.size() - 1);
+    handler.writeToServer(cmd.data(), cmd.size() - 1); // Datagrams go without the newline
+}
+
+void ProtocolCore::flushQueue()
+{
+    while (!sendQueue.empty() && pending < maxInFlight && state_ == State::Connected)
+    {
+        CommandBuffer cmd = sendQueue.front();
+        sendQueue.pop_front();
+        transmit(cmd);
+    }
+}
+
+void ProtocolCore::scheduleCopies(const CommandBuffer &cmd)
+{
+    if (redundantCopies == 0)
+        return;
+
+    // Copies of an older command of the same kind could undo this one if they went on (mutechan
+    // F 1 followed by mutechan FL 0), so they stop here
+    Resend *slot = nullptr;
+    for (Resend &resend: resends)
+    {
+        if (resend.copiesLeft && resend.cmd.command() == cmd.command())
+            resend.copiesLeft = 0;
+        if (!resend.copiesLeft && !slot)
+            slot = &resend;
+    }
+    if (!slot)
+        return;                 // All taken by other kinds of commands, just send it once
+
+    slot->cmd = cmd;
+    slot->copiesLeft = redundantCopies;
+    slot->at = monotonicMs() + redundancyIntervalMs;
+}
+
+void ProtocolCore::sendCopies(std::uint64_t now)
+{
+    for (Resend &resend: resends)
+    {
+        if (!resend.copiesLeft || now < resend.at)
+            continue;
+        writeDatagram(resend.cmd);
+        --resend.copiesLeft;
+        resend.at = now + redundancyIntervalMs;
+    }
+}
+
+void ProtocolCore::sendReliable(const CommandBuffer &cmd)
+{
+    // Sending an older value again is pointless, and would undo this one should the resend be
+    // the one to arrive last: the server applies commands as they come, not in sequence order.
+    // One that only partly overlaps this one (set F against set FL) is resent for the rest only.
+    for (auto it = unacked.begin(); it != unacked.end(); )
+    {
+        if (cmd.supersedes(it->cmd))
+        {
+            it = unacked.erase(it);
+            continue;
+        }
+        cmd.narrow(it->cmd);
+        ++it;
+    }
+    if (unacked.size() == maxUnacked)
+        unacked.pop_front();    // Give up on the oldest, the server isn't answering anyway
+
+    std::uint64_t now = monotonicMs();
+    unacked.push_back(Unacked{cmd, nextSeq++, now, now + rtoMs, 1});
+    writeSequenced(unacked.back());
+}
+
+void ProtocolCore::writeSequenced(const Unacked &entry)
+{
+    // base: everything before it has been acknowledged or given up on, so the server needn't
+    // wait for it
+    std::uint32_t base = unacked.empty() ? nextSeq : unacked.front().seq;
+    char buf[32 + CommandBuffer::capacity];
+    int n = std::snprintf(buf, sizeof(buf), "@%u %u ", (unsigned)entry.seq, (unsigned)base);
+    std::size_t len = (std::size_t)n + entry.cmd.size() - 1; // Datagrams go without the newline
+    std::memcpy(buf + n, entry.cmd.data(), entry.cmd.size() - 1);
+    record(SessionCapture::Sent, buf, len);
+    handler.writeToServer(buf, len);
+}
+
+void ProtocolCore::retransmit(std::uint64_t now)
+{
+    for (auto it = unacked.begin(); it != unacked.end(); )
+    {
+        if (now < it->at)
+        {
+            ++it;
+            continue;
+        }
+        if (it->tries == maxTries)
+        {
+            it = unacked.erase(it); // The pings will tell whether the server is gone
+            continue;
+        }
+        // Back off exponentially, the timeout may be too short for the network right now
+        it->at = now + std::min<std::uint64_t>((std::uint64_t)rtoMs << it->tries, maxRtoMs);
+        ++it->tries;
+        ++retransmits_;
+        writeSequenced(*it);
+        ++it;
+    }
+}
+
+void ProtocolCore::handleAck(const char *data, std::size_t len)
+{
+    // "ACK <cum> <mask>": every command up to cum has arrived, and cum+1+i if bit i of mask is set
+    char line[64];
+    len = std::min(len, sizeof(line) - 1);
+    std::memcpy(line, data, len);
+    line[len] = '\0';
+    unsigned long cum, mask;
+    if (std::sscanf(line, "ACK %lu %lu", &cum, &mask) != 2)
+    {
+        handler.onError(ProtocolError::BadStatus, line);
+        return;
+    }
+
+    std::uint64_t now = monotonicMs();
+    for (auto it = unacked.begin(); it != unacked.end(); )
+    {
+        unsigned long seq = it->seq;
+        if (seq > cum && (seq - cum - 1 >= 32 || !(mask >> (seq - cum - 1) & 1)))
+        {
+            ++it;
+            continue;
+        }
+        if (it->tries == 1)
+            rttSample(now - it->sentAt); // The ack of a resend could be for any of the sends
+        it = unacked.erase(it);
+    }
+}
+
+void ProtocolCore::rttSample(std::uint64_t ms)
+{
+    // As TCP does it (RFC 6298)
+    if (srttMs == 0)
+    {
+        srttMs = (double)ms;
+        rttvarMs = ms/2.0;
+    }
+    else
+    {
+        rttvarMs = 0.75*rttvarMs + 0.25*std::fabs(srttMs - (double)ms);
+        srttMs = 0.875*srttMs + 0.125*(double)ms;
+    }
+    rtoMs = (unsigned)(srttMs + std::max(1.0, 4*rttvarMs) + 0.5);
+    if (rtoMs < minRtoMs)
+        rtoMs = minRtoMs;
+    else if (rtoMs > maxRtoMs)
+        rtoMs = maxRtoMs;
+}
+
+void ProtocolCore::replyReceived(Command &cmd)
+{
+    if (pending > 0)
+        --pending;
+
+    if (trackedCount > 0)
+    {
+        cmd = tracked[trackedHead];
+        trackedHead = (trackedHead + 1) % maxTracked;
+        --trackedCount;
+    }
+    else
+    {
+        cmd = command.command();
+    }
+    if (pending == 0)
+        trackingLost = false;
+}
+
+void ProtocolCore::received(const char *data, std::size_t len)
+{
+    if (transport_ == Transport::Udp)
+    {
+        handleDatagram(data, len);
+        return;
+    }
+
+    while (len > 0 && state_ != State::Disconnected)
+    {
+        const char *nl = static_cast<const char *>(std::memchr(data, '\n', len));
+        std::size_t n = nl ? (std::size_t)(nl - data) + 1 : len;
+
+        if (discarding)
+        {
+            if (nl)
+            {
+                // The server answers every command with one line, however long
+                discarding = false;
+                Command cmd;
+                replyReceived(cmd);
+                flushQueue();
+            }
+        }
+        else if (rxlen + n > rxCapacity)
+        {
+            rxlen = 0;
+            handler.onError(ProtocolError::LineTooLong, "");
+            if (nl)
+            {
+                Command cmd;
+                replyReceived(cmd);
+                flushQueue();
+            }
+            else
+            {
+                discarding = true;
+            }
+        }
+        else
+        {
+            std::memcpy(rxbuf + rxlen, data, n);
+            rxlen += n;
+            if (nl)
+            {
+                std::size_t lineLen = rxlen;
+                rxlen = 0;
+                handleLine(rxbuf, lineLen);
+            }
+        }
+
+        data += n;
+        len -= n;
+    }
+}
+
+bool ProtocolCore::handleError(const char *line, std::size_t len)
+{
+    if (!STARTS_WITH(line, len, "ERROR"))
+        return false;
+
+    std::string detail(line + 5, chomp(line, len) - 5);
+    handler.onError(ProtocolError::ServerError, detail.c_str());
+    return true;
+}
+
+void ProtocolCore::handleLine(const char *line, std::size_t len)
+{
+    record(SessionCapture::Received, line, len);
+    handler.onReply(line, len);
+
+    // Status pushed by the server because someone else changed something. Not a reply, always
+    // apply.
+    if (STARTS_WITH(line, len, "STATUS "))
+    {
+        applyStatus(line, len);
+        return;
+    }
+
+    Command cmd;
+    replyReceived(cmd);
+    flushQueue();               // Room for another one
+    if (handleError(line, len))
+        return;
+
+    // Every command is answered with the status, but only apply it if we asked for it with the
+    // status command (the GUI would otherwise fight the user over the sliders)
+    if (cmd == Command::Status)
+        applyStatus(line, len);
+    else if (cmd == Command::Stats || STARTS_WITH(line, len, "STATS "))
+        applyStats(line, len);
+}
+
+void ProtocolCore::handleDatagram(const char *data, std::size_t len)
+{
+    record(SessionCapture::Received, data, len);
+    unanswered = 0;
+    bool connecting = state_ == State::Connecting;
+    if (connecting)
+    {
+        deadline = monotonicMs() + pingIntervalMs;
+        setState(State::Connected);
+    }
+    else if (state_ != State::Connected)
+    {
+        return;
+    }
+    handler.onReply(data, len);
+
+    if (STARTS_WITH(data, len, "ACK "))
+    {
+        handleAck(data, len);
+        return;
+    }
+    if (handleError(data, len))
+        return;
+    // Pings aren't counted in pending (but a status sent from onConnected just now is)
+    if (pending > 0 && !connecting)
+        --pending;
+    if (STARTS_WITH(data, len, "STATS "))
+    {
+        applyStats(data, len);
+        return;
+    }
+    if (pingSentAt)
+    {
+        rttSample(monotonicMs() - pingSentAt);
+        pingSentAt = 0;
+    }
+    applyStatus(data, len);
+}
+
+void ProtocolCore::applyStatus(const char *line, std::size_t len)
+{
+    ServerStatus values;
+    if (!parseStatus(line, chomp(line, len), values))
+    {
+        std::string detail(line, chomp(line, len));
+        handler.onError(ProtocolError::BadStatus, detail.c_str());
+        return;
+    }
+
+    status_ = values;
+    if (++statusVersion_ == 0)
+        statusVersion_ = 1;     // 0 means no status yet
+    handler.onStatus(status_);
+}
+
+void ProtocolCore::applyStats(const char *line, std::size_t len)
+{
+    DeviceStats stats;
+    if (!parseStats(line, chomp(line, len), stats))
+    {
+        std::string detail(line, chomp(line, len));
+        handler.onError(ProtocolError::BadStatus, detail.c_str());
+        return;
+    }
+    handler.onStats(stats);
+}
@@ -0,0 +1,270 @@
+// -*- Mode: C++ -*-
+
+#ifndef __PROTOCOLCORE_H
+#define __PROTOCOLCORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "Command.h"
+#include "SessionCapture.h"
+#include "Status.h"
+
+/// \brief Milliseconds from a monotonic clock, the time base of ProtocolCore
+std::uint64_t monotonicMs();
+
+/// \brief The transports the server speaks (HTTP is for browsers)
+enum class Transport
+{
+    Tcp,    //!< Line based, one reply per command, pushed statuses when subscribed
+    Udp,    //!< One command per datagram, only status and errors are replied to
+};
+
+enum class ProtocolError
+{
+    ServerError,    //!< The server replied ERROR to a command (detail: the rest of the line)
+    BadStatus,      //!< A status line could not be parsed (detail: the line)
+    LineTooLong,    //!< A line from the server didn't fit the receive buffer and was dropped
+    ConnectFailed,  //!< Gave up on connecting (no reply to the UDP ping, TCP connect timed out)
+    ConnectionLost, //!< The UDP server stopped answering pings
+};
+
+/**
+ * \brief What ProtocolCore needs from the outside world: a way to write to the server, and
+ *        someone to tell about what happened. Everything but writeToServer is optional.
+ */
+class ProtocolHandler
+{
+public:
+    virtual ~ProtocolHandler() {}
+
+    /// \brief Send data to the server. For UDP every call is one datagram.
+    virtual void writeToServer(const char *data, std::size_t len) =0;
+
+    virtual void onConnected() {}
+    virtual void onDisconnected() {}
+    /// \brief A status was received (a reply to status, or pushed by the server)
+    virtual void onStatus(const ServerStatus &) {}
+    /// \brief The server's performance counters arrived (a reply to stats)
+    virtual void onStats(const DeviceStats &) {}
+    virtual void onError(ProtocolError, const char * /* detail */) {}
+    /// \brief Any line (TCP) or datagram (UDP) from the server, before it is acted upon
+    virtual void onReply(const char * /* line */, std::size_t /* len */) {}
+};
+
+/**
+ * \brief The client side of the server protocol, without any I/O of its own.
+ *
+ * Encodes commands, splits and parses what comes back, keeps the last status and runs the
+ * connection state machine (the connect handshake, and faking a connection on top of UDP by
+ * pinging the server with status). The owner moves bytes between the socket and the core and
+ * calls tick when nextDeadline says so. This is what both the Qt GUI (Protocol) and the
+ * command line tools (Client) are built on.
+ */
+class ProtocolCore
+{
+public:
+    enum class State
+    {
+        Disconnected,
+        Connecting,     //!< startConnect called, waiting for connectionUp (TCP) or a reply (UDP)
+        Connected,
+    };
+
+    static const std::size_t rxCapacity = 512;  //!< Longest line accepted from a TCP server
+    static const unsigned maxTracked = 32;      //!< Replies matched to their commands (TCP)
+    static const unsigned maxResends = 4;       //!< High priority commands being repeated (UDP)
+    static const unsigned maxUnacked = 16;      //!< Commands waiting for an ack (reliable UDP)
+    static const unsigned maxTries = 6;         //!< Sends of one command before giving up on it
+    static const unsigned minRtoMs = 20;        //!< Bounds of the retransmission timeout
+    static const unsigned maxRtoMs = 1000;
+
+    ProtocolCore(Transport transport, ProtocolHandler &handler);
+
+    Transport transport() const { return transport_; }
+    State state() const { return state_; }
+    bool isConnected() const { return state_ == State::Connected; }
+
+    /// \brief Send 'subscribe 1' on connect so the server pushes changes made by others (TCP)
+    void setSubscribe(bool subscribe) { this->subscribe = subscribe; }
+    /**
+     * \brief How the UDP "connection" is kept.
+     *
+     * \param intervalMs  ping the server with status this often
+     * \param misses      consider the connection lost after this many unanswered pings
+     */
+    void setPing(unsigned intervalMs, unsigned misses);
+    /**
+     * \brief TCP flow control: at most n commands sent and not yet answered. Further commands
+     *        wait in the core, where a newer value for the same channel replaces a waiting one
+     *        (see CommandBuffer::supersedes). High priority commands (mute, mutechan) are sent
+     *        right away regardless, so they never wait behind a burst of level changes, unless
+     *        a reset is waiting: they can't overtake that. 0 (the default) sends everything
+     *        right away.
+     */
+    void setMaxInFlight(unsigned n) { maxInFlight = n; }
+    /**
+     * \brief UDP: send high priority commands copies extra times, intervalMs apart, as there
+     *        is no telling whether a datagram arrived. A newer command of the same kind, or a
+     *        reset, cancels the copies still to go (an old mutechan copy must not undo a newer
+     *        one). 0 copies turns this off. Default 2 copies, 20 ms apart.
+     */
+    void setRedundancy(unsigned copies, unsigned intervalMs);
+    /**
+     * \brief UDP: number every command but the queries ("@<seq> <base> <command>") and have the
+     *        server acknowledge it ("ACK <cum> <mask>", see server.py). What isn't acknowledged
+     *        within the retransmission timeout, worked out from the measured round trip time,
+     *        is sent again. A command superseded by a newer one (CommandBuffer::supersedes,
+     *        a reset supersedes every level and mute change) is never sent again, the newer one
+     *        carries the state, and one partly overlapping a newer one is only sent again for
+     *        the rest (CommandBuffer::narrow). Replaces the copies of
+     *        setRedundancy. Off by default, as older servers don't understand it.
+     */
+    void setReliable(bool reliable) { this->reliable = reliable; }
+    /// \brief Give up connecting after this long (for UDP: waiting for the reply to the first ping)
+    void setConnectTimeout(unsigned ms) { connectTimeoutMs = ms; }
+    /**
+     * \brief Record everything sent and received (plus connects/disconnects) to capture, nullptr
+     *        to stop recording. The capture is not owned by the core.
+     */
+    void setCapture(SessionCapture *capture) { this->capture = capture; }
+
+    /**
+     * \brief Start connecting. For TCP the owner then opens the connection and calls
+     *        connectionUp/connectionDown; for UDP the first ping is sent right away and the
+     *        first datagram back completes the connection.
+     *
+     * host and port are only used for the capture.
+     */
+    void startConnect(const char *host, unsigned port);
+    /// \brief The TCP connection is up
+    void connectionUp();
+    /// \brief The TCP connection went away (or could not be made)
+    void connectionDown();
+    /// \brief Say goodbye (TCP) and go to Disconnected. The owner closes the socket.
+    void disconnect();
+
+    /// \brief Feed data from the server: any amount of a TCP stream, or one UDP datagram
+    void received(const char *data, std::size_t len);
+
+    /// \brief Time (monotonicMs) at which tick wants to be called, 0 if never
+    std::uint64_t nextDeadline() const;
+    /// \brief Handle timeouts and UDP pings. Harmless to call early.
+    void tick();
+
+    /// \brief Build and send a command without any parameters
+    void sendCmd(Command cmd);
+    /// \brief Build and send a command with an int parameter
+    void sendCmd(Command cmd, int value);
+    /// \brief Build and send a command with a channel and an int parameter
+    void sendCmd(Command cmd, Channel chan, int value);
+    /// \brief Send a command built elsewhere
+    void send(const CommandBuffer &cmd);
+
+    /// \brief Number of commands the server has yet to answer (or acknowledge), including those
+    ///        waiting to be sent
+    unsigned pendingReplies() const { return pending + (unsigned)(sendQueue.size() + unacked.size()); }
+    /// \brief Number of commands waiting to be sent (see setMaxInFlight)
+    std::size_t queued() const { return sendQueue.size(); }
+    /// \brief Whether a status has been received since connecting
+    bool hasStatus() const { return statusVersion_ != 0; }
+    /// \brief Last status received
+    const ServerStatus &status() const { return status_; }
+    /// \brief Incremented for every status received
+    unsigned statusVersion() const { return statusVersion_; }
+    /// \brief Smoothed round trip time (ms, UDP), 0 until measured
+    double roundTripTime() const { return srttMs; }
+    /// \brief Current retransmission timeout of the reliable UDP mode (ms)
+    unsigned retransmitTimeout() const { return rtoMs; }
+    /// \brief Commands sent again (reliable UDP)
+    unsigned long retransmits() const { return retransmits_; }
+
+private:
+    Transport transport_;
+    ProtocolHandler &handler;
+    State state_;
+
+    bool subscribe;
+    unsigned pingIntervalMs;
+    unsigned pingMisses;
+    unsigned connectTimeoutMs;
+    unsigned maxInFlight;
+    unsigned redundantCopies;
+    unsigned redundancyIntervalMs;
+    bool reliable;
+    SessionCapture *capture;
+
+    CommandBuffer command;  //!< Command being sent to server/last command sent to server
+    std::uint64_t deadline;
+    unsigned unanswered;    //!< UDP pings sent since the last datagram from the server
+
+    /* Commands waiting for a reply (TCP), oldest first, so that OK replies to status can be told
+       from those to other commands. If more than maxTracked are outstanding we fall back to
+       looking at the last command sent until everything has been answered. */
+    Command tracked[maxTracked];
+    unsigned trackedHead;
+    unsigned trackedCount;
+    bool trackingLost;
+    unsigned pending;
+
+    std::deque<CommandBuffer> sendQueue; //!< Waiting for room in the maxInFlight window (TCP)
+
+    struct Resend
+    {
+        CommandBuffer cmd;
+        unsigned copiesLeft;    //!< 0 = free slot
+        std::uint64_t at;       //!< When to send the next copy
+    };
+    Resend resends[maxResends]; //!< Redundant copies still to go (UDP)
+
+    struct Unacked
+    {
+        CommandBuffer cmd;
+        std::uint32_t seq;
+        std::uint64_t sentAt;   //!< First sent, for the round trip time
+        std::uint64_t at;       //!< When to send it again
+        unsigned tries;
+    };
+    std::deque<Unacked> unacked; //!< Reliable UDP commands not acknowledged yet, oldest first
+    std::uint32_t nextSeq;
+    std::uint64_t pingSentAt;   //!< The ping being waited for (UDP, 0 if none), for the round trip time
+    std::uint64_t pingRetryAt;  //!< When to ping again while connecting (UDP)
+    double srttMs;
+    double rttvarMs;
+    unsigned rtoMs;
+    unsigned long retransmits_;
+
+    char rxbuf[rxCapacity];
+    std::size_t rxlen;
+    bool discarding;        //!< Dropping the rest of a line that didn't fit rxbuf
+
+    ServerStatus status_;
+    unsigned statusVersion_;
+
+    void setState(State state);
+    void reset();
+    void record(SessionCapture::Type type, const char *data, std::size_t len);
+    void recordEvent(const char *text);
+
+    void transmit(const CommandBuffer &cmd);
+    void writeDatagram(const CommandBuffer &cmd);
+    void flushQueue();
+    bool resetQueued() const;
+    void scheduleCopies(const CommandBuffer &cmd);
+    void sendCopies(std::uint64_t now);
+    void sendReliable(const CommandBuffer &cmd);
+    void writeSequenced(const Unacked &entry);
+    void retransmit(std::uint64_t now);
+    void handleAck(const char *data, std::size_t len);
+    void rttSample(std::uint64_t ms);
+    void replyReceived(Command &cmd);
+    void handleLine(const char *line, std::size_t len);
+    void handleDatagram(const char *data, std::size_t len);
+    bool handleError(const char *line, std::size_t len);
+    void applyStatus(const char *line, std::size_t len);
+    void applyStats(const char *line, std::size_t len);
+};
+
+#endif
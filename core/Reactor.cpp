@@ -0,0 +1,200 @@
+#include "Reactor.h"
+#include "ProtocolCore.h"       // monotonicMs
+
+#include <poll.h>
+
+#if defined(__linux__) && !defined(VC_REACTOR_POLL)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#ifdef USE_EPOLL
+static unsigned toEpoll(unsigned events)
+{
+    return ((events & Reactor::Read) ? (unsigned)EPOLLIN : 0u) |
+        ((events & Reactor::Write) ? (unsigned)EPOLLOUT : 0u);
+}
+#endif
+
+Reactor::Reactor() :
+    epfd(-1), nextTimerId(1), stopped(false)
+{
+#ifdef USE_EPOLL
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+Reactor::~Reactor()
+{
+#ifdef USE_EPOLL
+    if (epfd >= 0)
+        ::close(epfd);
+#endif
+}
+
+bool Reactor::add(int fd, unsigned events, FdCallback callback)
+{
+#ifdef USE_EPOLL
+    if (epfd >= 0)
+    {
+        epoll_event ev = {};
+        ev.events = toEpoll(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            return false;
+    }
+#endif
+    fds[fd] = std::make_pair(events, std::move(callback));
+    return true;
+}
+
+bool Reactor::modify(int fd, unsigned events)
+{
+    auto it = fds.find(fd);
+    if (it == fds.end())
+        return false;
+    if (it->second.first == events)
+        return true;
+#ifdef USE_EPOLL
+    if (epfd >= 0)
+    {
+        epoll_event ev = {};
+        ev.events = toEpoll(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != 0)
+            return false;
+    }
+#endif
+    it->second.first = events;
+    return true;
+}
+
+void Reactor::remove(int fd)
+{
+    if (fds.erase(fd) == 0)
+        return;
+#ifdef USE_EPOLL
+    if (epfd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+unsigned Reactor::addTimer(unsigned ms, TimerCallback callback)
+{
+    unsigned id = nextTimerId++;
+    if (nextTimerId == 0)
+        nextTimerId = 1;
+    timers.insert(std::make_pair(monotonicMs() + ms, Timer{id, std::move(callback)}));
+    return id;
+}
+
+void Reactor::cancelTimer(unsigned id)
+{
+    for (auto it = timers.begin(); it != timers.end(); ++it)
+    {
+        if (it->second.id == id)
+        {
+            timers.erase(it);
+            return;
+        }
+    }
+}
+
+int Reactor::timeoutMs(int maxWaitMs) const
+{
+    if (timers.empty())
+        return maxWaitMs;
+    std::uint64_t now = monotonicMs();
+    std::uint64_t first = timers.begin()->first;
+    int wait = first > now ? (int)(first - now) : 0;
+    return (maxWaitMs < 0 || wait < maxWaitMs) ? wait : maxWaitMs;
+}
+
+void Reactor::runTimers()
+{
+    std::uint64_t now = monotonicMs();
+    while (!timers.empty() && timers.begin()->first <= now)
+    {
+        // Take it out first, the callback may well add (or cancel) timers
+        TimerCallback callback = std::move(timers.begin()->second.callback);
+        timers.erase(timers.begin());
+        callback();
+    }
+}
+
+void Reactor::dispatch(int fd, unsigned events)
+{
+    // The descriptor may have been removed by an earlier callback this round
+    auto it = fds.find(fd);
+    if (it == fds.end())
+        return;
+    unsigned wanted = it->second.first | Error;
+    if (!(events & wanted))
+        return;
+    FdCallback callback = it->second.second;   // Copy: the callback may remove fd
+    callback(fd, events & wanted);
+}
+
+bool Reactor::runOnce(int maxWaitMs)
+{
+    if (fds.empty() && timers.empty())
+        return false;
+
+    int timeout = timeoutMs(maxWaitMs);
+
+#ifdef USE_EPOLL
+    if (epfd >= 0)
+    {
+        epoll_event events[16];
+        int n = epoll_wait(epfd, events, 16, timeout);
+        for (int i = 0; i < n; ++i)
+        {
+            unsigned ev = 0;
+            if (events[i].events & EPOLLIN)
+                ev |= Read;
+            if (events[i].events & EPOLLOUT)
+                ev |= Write;
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+                ev |= Error;
+            dispatch(events[i].data.fd, ev);
+        }
+        runTimers();
+        return true;
+    }
+#endif
+
+    std::vector<pollfd> pfds;
+    pfds.reserve(fds.size());
+    for (auto &entry: fds)
+    {
+        pollfd p = {};
+        p.fd = entry.first;
+        p.events = ((entry.second.first & Read) ? POLLIN : 0) | ((entry.second.first & Write) ? POLLOUT : 0);
+        pfds.push_back(p);
+    }
+    int n = ::poll(pfds.data(), pfds.size(), timeout);
+    for (std::size_t i = 0; n > 0 && i < pfds.size(); ++i)
+    {
+        if (!pfds[i].revents)
+            continue;
+        --n;
+        unsigned ev = 0;
+        if (pfds[i].revents & POLLIN)
+            ev |= Read;
+        if (pfds[i].revents & POLLOUT)
+            ev |= Write;
+        if (pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            ev |= Error;
+        dispatch(pfds[i].fd, ev);
+    }
+    runTimers();
+    return true;
+}
+
+void Reactor::run()
+{
+    stopped = false;
+    while (!stopped && runOnce())
+        ;
+}
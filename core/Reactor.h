@@ -0,0 +1,73 @@
+// -*- Mode: C++ -*-
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+/**
+ * \brief A minimal event loop for the command line tools: file descriptors and one-shot timers.
+ *
+ * Uses epoll on Linux and poll(2) everywhere else (define VC_REACTOR_POLL to use poll on Linux
+ * as well). Callbacks may add and remove descriptors and timers, including their own.
+ */
+class Reactor
+{
+public:
+    enum Events : unsigned
+    {
+        Read  = 1,
+        Write = 2,
+        Error = 4,      //!< Error or hangup. Always reported, no need to ask for it.
+    };
+
+    typedef std::function<void(int fd, unsigned events)> FdCallback;
+    typedef std::function<void()> TimerCallback;
+
+    Reactor();
+    ~Reactor();
+
+    /// \brief Watch fd for events (Read|Write). False if fd can't be watched.
+    bool add(int fd, unsigned events, FdCallback callback);
+    /// \brief Change the events fd is watched for
+    bool modify(int fd, unsigned events);
+    /// \brief Stop watching fd. Does not close it.
+    void remove(int fd);
+
+    /// \brief Call callback once, ms milliseconds from now. Returns an id for cancelTimer.
+    unsigned addTimer(unsigned ms, TimerCallback callback);
+    void cancelTimer(unsigned id);
+
+    /**
+     * \brief Wait for and dispatch one round of events, and any timers that are due.
+     *
+     * \param maxWaitMs  wait at most this long, -1 to wait for as long as it takes
+     * \return false if there is nothing left to wait for (no descriptors, no timers)
+     */
+    bool runOnce(int maxWaitMs = -1);
+    /// \brief runOnce until stop is called or there is nothing left to wait for
+    void run();
+    void stop() { stopped = true; }
+
+private:
+    struct Timer
+    {
+        unsigned id;
+        TimerCallback callback;
+    };
+
+    int epfd;                                   //!< -1 when using poll
+    std::map<int, std::pair<unsigned, FdCallback>> fds;
+    std::multimap<std::uint64_t, Timer> timers; //!< By deadline (monotonicMs)
+    unsigned nextTimerId;
+    bool stopped;
+
+    int timeoutMs(int maxWaitMs) const;
+    void runTimers();
+    void dispatch(int fd, unsigned events);
+};
+
+#endif
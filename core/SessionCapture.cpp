@@ -0,0 +1,118 @@
+#include "SessionCapture.h"
+
+#include <cstring>
+
+static const char magic[] = "VCCAP1\n";
+static const std::size_t magicLen = sizeof(magic) - 1;
+
+SessionCapture::SessionCapture() :
+    file(nullptr)
+{
+}
+
+SessionCapture::~SessionCapture()
+{
+    close();
+}
+
+bool SessionCapture::open(const char *path, const char *description)
+{
+    close();
+    file = std::fopen(path, "ab");
+    if (!file)
+        return false;
+
+    // "ab" always writes at the end, so this tells us whether the file is new
+    std::fseek(file, 0, SEEK_END);
+    if (std::ftell(file) == 0)
+        std::fwrite(magic, 1, magicLen, file);
+
+    start = std::chrono::steady_clock::now();
+    record(Session, description, std::strlen(description));
+    return true;
+}
+
+void SessionCapture::close()
+{
+    if (file)
+        std::fclose(file);
+    file = nullptr;
+}
+
+void SessionCapture::record(Type type, const char *data, std::size_t len)
+{
+    if (!file)
+        return;
+
+    if (len > maxData)
+        len = maxData;
+    std::uint64_t t = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    header[0] = type;
+    header[1] = len & 0xff;
+    header[2] = (len >> 8) & 0xff;
+    for (int i = 0; i < 8; ++i)
+        header[3 + i] = (t >> (8*i)) & 0xff;
+
+    std::fwrite(header, 1, headerSize, file);
+    std::fwrite(data, 1, len, file);
+    // Flush every record, a capture is most interesting when the program didn't exit nicely
+    std::fflush(file);
+}
+
+void SessionCapture::event(const char *text)
+{
+    record(Event, text, std::strlen(text));
+}
+
+//// SessionCapture::Reader ////
+
+SessionCapture::Reader::Reader() :
+    file(nullptr)
+{
+}
+
+SessionCapture::Reader::~Reader()
+{
+    if (file)
+        std::fclose(file);
+}
+
+bool SessionCapture::Reader::open(const char *path)
+{
+    if (file)
+        std::fclose(file);
+    file = std::fopen(path, "rb");
+    if (!file)
+        return false;
+
+    char buf[magicLen];
+    if (std::fread(buf, 1, magicLen, file) != magicLen || std::memcmp(buf, magic, magicLen) != 0)
+    {
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool SessionCapture::Reader::next(Record &rec)
+{
+    if (!file)
+        return false;
+
+    unsigned char header[headerSize];
+    if (std::fread(header, 1, headerSize, file) != headerSize)
+        return false;
+
+    std::size_t len = header[1] | (header[2] << 8);
+    rec.type = static_cast<Type>(header[0]);
+    rec.timeUs = 0;
+    for (int i = 7; i >= 0; --i)
+        rec.timeUs = (rec.timeUs << 8) | header[3 + i];
+    rec.data.resize(len);
+    if (len > 0 && std::fread(&rec.data[0], 1, len, file) != len)
+        return false;
+    return true;
+}
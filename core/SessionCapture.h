@@ -0,0 +1,95 @@
+// -*- Mode: C++ -*-
+
+#ifndef __SESSIONCAPTURE_H
+#define __SESSIONCAPTURE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/**
+ * \brief Records everything a Protocol sends and receives to an append-only file, so that
+ *        sessions can be replayed later (see tools/vc-replay).
+ *
+ * Plain C++ (no Qt) so the replay tool can read the files with the same code.
+ *
+ * File format: the magic "VCCAP1\n", followed by records of
+ *   type (1 byte, one of Type)
+ *   length of data (2 bytes, little endian)
+ *   time (8 bytes, little endian, microseconds since the session record, from a monotonic clock)
+ *   data (length bytes, exactly as sent/received)
+ *
+ * Every open starts a new session with a Session record (data is a free form description), so
+ * one file can hold any number of sessions.
+ */
+class SessionCapture
+{
+public:
+    enum Type : unsigned char
+    {
+        Session  = 'S', //!< Start of a session
+        Sent     = '>', //!< Data sent to the server
+        Received = '<', //!< Data received from the server (a line for TCP, a datagram for UDP)
+        Event    = '!', //!< Connect/disconnect etc. as text, e.g. "connect tcp host 1128"
+    };
+
+    struct Record
+    {
+        Type type;
+        std::uint64_t timeUs;
+        std::string data;
+    };
+
+    static const std::size_t headerSize = 11;  //!< Bytes in front of the data of each record
+    static const std::size_t maxData = 0xffff; //!< Longer data is truncated
+
+    SessionCapture();
+    ~SessionCapture();
+
+    /**
+     * \brief Open (or create) path for appending and start a new session.
+     *
+     * \param path         file to append to
+     * \param description  stored in the Session record
+     * \return false if the file could not be opened
+     */
+    bool open(const char *path, const char *description);
+    void close();
+    bool isOpen() const { return file != nullptr; }
+
+    /// \brief Append a record stamped with the current time
+    void record(Type type, const char *data, std::size_t len);
+    /// \brief Append an Event record
+    void event(const char *text);
+
+    /**
+     * \brief Reads back a capture file written by SessionCapture.
+     */
+    class Reader
+    {
+    public:
+        Reader();
+        ~Reader();
+
+        /// \brief Open path for reading, false if it can't be opened or isn't a capture file
+        bool open(const char *path);
+        /**
+         * \brief Read the next record.
+         * \return false at the end of the file. A truncated last record (the program recording
+         *         it died) is treated as the end of the file.
+         */
+        bool next(Record &rec);
+
+    private:
+        std::FILE *file;
+    };
+
+private:
+    std::FILE *file;
+    std::chrono::steady_clock::time_point start;
+    unsigned char header[headerSize];
+};
+
+#endif
@@ -0,0 +1,63 @@
+// -*- Mode: C++ -*-
+
+#ifndef __SPSCQUEUE_H
+#define __SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * \brief Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * A ring of N slots (N a power of two) with a head index only the consumer writes and a tail
+ * index only the producer writes, each on its own cache line so that the two threads don't keep
+ * taking the line from each other. push and pop never block and never allocate.
+ */
+template <typename T, std::size_t N>
+class SpscQueue
+{
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+    SpscQueue() : head(0), tail(0) {}
+
+    /// \brief Producer: append value. False (and nothing done) if the queue is full.
+    bool push(const T &value)
+    {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        slots[t & (N - 1)] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// \brief Consumer: take the oldest value. False if the queue is empty.
+    bool pop(T &value)
+    {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        value = slots[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// \brief Either side: whether the queue looked empty at the time of the call
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    // Padding instead of alignas: C++11 new doesn't honour over-alignment
+    static const std::size_t cacheLine = 64;
+
+    std::atomic<std::size_t> head;  //!< Next slot to pop, written by the consumer only
+    char headPad[cacheLine - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> tail;  //!< Next slot to push, written by the producer only
+    char tailPad[cacheLine - sizeof(std::atomic<std::size_t>)];
+    T slots[N];
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "Status.h"
+
+#include <cstdio>
+#include <cstring>
+
+bool operator==(const ServerStatus &a, const ServerStatus &b)
+{
+    return std::memcmp(&a, &b, sizeof(ServerStatus)) == 0;
+}
+
+/* Cursor over the line being parsed. Every step skips leading whitespace and fails (returns
+   false) if the expected thing isn't there. */
+class StatusParser
+{
+public:
+    StatusParser(const char *line, std::size_t len) : p(line), end(line + len) {}
+
+    bool prefix(const char *word)
+    {
+        std::size_t n = std::strlen(word);
+        if ((std::size_t)(end - p) >= n && std::memcmp(p, word, n) == 0)
+        {
+            p += n;
+            return true;
+        }
+        return false;
+    }
+
+    bool expect(const char *word)
+    {
+        skipSpace();
+        return prefix(word);
+    }
+
+    bool number(int &value)
+    {
+        skipSpace();
+        bool neg = p < end && *p == '-';
+        if (neg)
+            ++p;
+        if (p == end || *p < '0' || *p > '9')
+            return false;
+        int v = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+            v = v*10 + (*p++ - '0');
+        value = neg ? -v : v;
+        return true;
+    }
+
+    /// "<n>: (a, b, c, d);"
+    bool pot(const char *label, int &a, int &b, int &c, int &d)
+    {
+        return expect(label) && expect("(") &&
+            number(a) && expect(",") && number(b) && expect(",") &&
+            number(c) && expect(",") && number(d) && expect(")") && expect(";");
+    }
+
+private:
+    void skipSpace()
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+    }
+
+    const char *p;
+    const char *end;
+};
+
+bool parseStatus(const char *line, std::size_t len, ServerStatus &status)
+{
+    StatusParser parser(line, len);
+    ServerStatus v;
+
+    // Replies to commands start with OK, status pushed by the server (see subscribe) with STATUS
+    parser.prefix("OK ") || parser.prefix("STATUS ");
+
+    if (!parser.pot("0:", v.fl_level, v.fr_level, v.fl_mute, v.fr_mute) ||
+        !parser.pot("1:", v.sub_level, v.cen_level, v.sub_mute, v.cen_mute) ||
+        !parser.pot("2:", v.rl_level, v.rr_level, v.rl_mute, v.rr_mute) ||
+        !parser.expect("Master:") || !parser.number(v.master) ||
+        !parser.expect("Mute:") || !parser.number(v.global_mute))
+        return false;
+
+    status = v;
+    return true;
+}
+
+/* "<key>=<n>" or "<key>=<n>/<m>" */
+struct StatsField
+{
+    const char *key;
+    unsigned long DeviceStats::*first;
+    unsigned long DeviceStats::*second;
+};
+
+static const StatsField statsFields[] = {
+    { "up",      &DeviceStats::uptimeS,      nullptr },
+    { "loops",   &DeviceStats::loops,        nullptr },
+    { "loop_us", &DeviceStats::loopAvgUs,    &DeviceStats::loopMaxUs },
+    { "cmds",    &DeviceStats::commands,     nullptr },
+    { "cps",     &DeviceStats::commandsPerS, nullptr },
+    { "pushes",  &DeviceStats::pushes,       nullptr },
+    { "push_us", &DeviceStats::pushAvgUs,    &DeviceStats::pushMaxUs },
+    { "gc",      &DeviceStats::gcRuns,       nullptr },
+    { "free",    &DeviceStats::freeHeap,     &DeviceStats::freeHeapMin },
+    { "partial", &DeviceStats::partial,      nullptr },
+};
+
+static unsigned long parseUnsigned(const char *&p, const char *end)
+{
+    unsigned long v = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        v = v*10 + (unsigned long)(*p++ - '0');
+    return v;
+}
+
+bool parseStats(const char *line, std::size_t len, DeviceStats &stats)
+{
+    const char *p = line;
+    const char *end = line + len;
+    if (len < 6 || std::memcmp(p, "STATS ", 6) != 0)
+        return false;
+    p += 6;
+
+    DeviceStats v = DeviceStats();
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            ++p;
+        const char *key = p;
+        while (p < end && *p != '=' && *p != ' ')
+            ++p;
+        if (p == end || *p != '=')
+            break;
+        std::size_t keyLen = (std::size_t)(p++ - key);
+
+        const StatsField *field = nullptr;
+        for (const StatsField &f: statsFields)
+        {
+            if (std::strlen(f.key) == keyLen && std::memcmp(f.key, key, keyLen) == 0)
+                field = &f;
+        }
+
+        unsigned long a = parseUnsigned(p, end), b = 0;
+        if (p < end && *p == '/')
+            b = parseUnsigned(++p, end);
+        while (p < end && *p != ' ')    // Whatever a newer server may have put there
+            ++p;
+        if (!field)
+            continue;
+        v.*(field->first) = a;
+        if (field->second)
+            v.*(field->second) = b;
+    }
+
+    stats = v;
+    return true;
+}
+
+std::size_t formatStatus(const ServerStatus &s, char *buf, std::size_t size)
+{
+    int n = std::snprintf(buf, size, "0: (%d,%d,%d,%d); 1: (%d,%d,%d,%d); 2: (%d,%d,%d,%d); Master: %d Mute: %d",
+                          s.fl_level, s.fr_level, s.fl_mute, s.fr_mute,
+                          s.sub_level, s.cen_level, s.sub_mute, s.cen_mute,
+                          s.rl_level, s.rr_level, s.rl_mute, s.rr_mute,
+                          s.master, s.global_mute);
+    if (n < 0)
+        return 0;
+    return (std::size_t)n < size ? (std::size_t)n : (size ? size - 1 : 0);
+}
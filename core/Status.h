@@ -0,0 +1,79 @@
+// -*- Mode: C++ -*-
+
+#ifndef __STATUS_H
+#define __STATUS_H
+
+#include <cstddef>
+
+/**
+ * \brief State of the volume controller as reported by the server.
+ *
+ * Note: the server reports the CEN/SUB pot as L = SUB and R = CEN.
+ */
+struct ServerStatus
+{
+    int fl_level; int fr_level; int fl_mute; int fr_mute;
+    int sub_level; int cen_level; int sub_mute; int cen_mute;
+    int rl_level; int rr_level; int rl_mute; int rr_mute;
+    int master; int global_mute;
+};
+
+bool operator==(const ServerStatus &a, const ServerStatus &b);
+inline bool operator!=(const ServerStatus &a, const ServerStatus &b) { return !(a == b); }
+
+/**
+ * \brief Parse a status line from the server.
+ *
+ * Accepts replies ("OK 0: (...) ..."), pushed statuses ("STATUS 0: (...) ...") and the bare
+ * body. Whitespace is allowed anywhere between the fields (the server pads levels to two
+ * characters).
+ *
+ * \param line    the line, does not have to be NUL-terminated
+ * \param len     length of line
+ * \param [out] status  the parsed values. Left alone on failure.
+ * \return false if the line isn't a well-formed status
+ */
+bool parseStatus(const char *line, std::size_t len, ServerStatus &status);
+
+/**
+ * \brief Format status the way the server does (the body, without "OK " and newline), so that
+ *        parseStatus reads it back. For keeping a status around as text.
+ *
+ * \return the length of the formatted status, truncated to size - 1 if buf is too small
+ */
+std::size_t formatStatus(const ServerStatus &status, char *buf, std::size_t size);
+
+/**
+ * \brief Performance counters of the server, the reply to the stats command
+ *        ("STATS up=... loops=... loop_us=avg/max ...", see server.py)
+ *
+ * Averages are moving averages. A counter the server didn't report is left at 0.
+ */
+struct DeviceStats
+{
+    unsigned long uptimeS;      //!< up: seconds since the server started
+    unsigned long loops;        //!< loops: server loop iterations
+    unsigned long loopAvgUs;    //!< loop_us: time spent per iteration
+    unsigned long loopMaxUs;
+    unsigned long commands;     //!< cmds: commands handled, all transports
+    unsigned long commandsPerS; //!< cps: commands during the last full second
+    unsigned long pushes;       //!< pushes: writes to the pots
+    unsigned long pushAvgUs;    //!< push_us: time per write to the pots
+    unsigned long pushMaxUs;
+    unsigned long gcRuns;       //!< gc: garbage collections seen
+    unsigned long freeHeap;     //!< free: free heap now, and the lowest seen (bytes)
+    unsigned long freeHeapMin;
+    unsigned long partial;      //!< partial: 1 if the server had to leave counters out to fit
+                                //!< the reply (those read as 0)
+};
+
+/**
+ * \brief Parse a reply to the stats command. Unknown counters are skipped, so a newer server
+ *        that reports more of them can still be read.
+ *
+ * \param [out] stats  the parsed values. Left alone on failure.
+ * \return false if the line isn't a stats reply
+ */
+bool parseStats(const char *line, std::size_t len, DeviceStats &stats);
+
+#endif
@@ -0,0 +1,550 @@
+"""IR remote control support.
+
+The receiver module (a TSOP38238 or similar, output low while it sees
+the carrier) is connected to a GPIO. Every edge on that pin triggers
+an IRQ which only records the time and new pin level in a fixed size
+ring buffer (IRReceiver). Decoding (NECDecoder, RC5Decoder) happens
+later, from the server loop (see IRVolumeServer), so the IRQ never
+allocates and the network handling is never held up by more than the
+cost of draining the ring.
+
+Decoding works on (mark, duration) pairs, mark being True while the
+carrier was present. Traces recorded on Linux with the LIRC tool mode2
+("pulse 9000", "space 4500" lines) can be fed in with decode_trace,
+and benchmark generates random frames to check the decoders and
+measure their throughput without any hardware.
+
+"""
+
+import sys
+import uarray as array
+import utime as time
+from server import VolumeServer
+
+# Protocol ids, as returned by the decoders
+NEC = 1
+RC5 = 2
+
+TOLERANCE = 30                  # percent of the nominal duration
+
+def near(us, nominal):
+    return abs(us - nominal)*100 <= nominal*TOLERANCE
+
+
+class NECDecoder(object):
+    """NEC protocol: 9 ms leader mark, then a 4.5 ms space followed by 32
+    bits (address, ~address, command, ~command, LSB first) or a 2.25 ms
+    space for a repeat code sent while the key is held. Each bit is a
+    560 us mark followed by a 560 us (0) or 1690 us (1) space. The
+    frame ends with a final 560 us mark.
+
+    Extended NEC (16 bit address, no inverted address byte) is
+    accepted too. The command has to check out against its inverse.
+
+    """
+    LEADER_MARK = 9000
+    LEADER_SPACE = 4500
+    REPEAT_SPACE = 2250
+    BIT_MARK = 560
+    ZERO_SPACE = 560
+    ONE_SPACE = 1690
+
+    IDLE, LEAD_SPACE, BIT_MARK_WAIT, BIT_SPACE_WAIT, REPEAT_MARK_WAIT = range(5)
+
+    def __init__(self):
+        self.data = bytearray(4)
+        self.state = self.IDLE
+        self.nbits = 0
+        self.address = 0
+        self.command = 0
+        self.repeat = False
+        self.errors = 0         # frames that broke off or failed the checks
+
+    def _fail(self, mark, us):
+        if self.state != self.LEAD_SPACE and self.state != self.IDLE:
+            self.errors += 1
+        self.state = self.IDLE
+        # Whatever broke the frame off might be the start of the next one
+        if mark and near(us, self.LEADER_MARK):
+            self.state = self.LEAD_SPACE
+        return 0
+
+    def feed(self, mark, us):
+        """Feed the next mark/space. Returns NEC when a frame or repeat code
+        is complete (see address, command, repeat), else 0."""
+        state = self.state
+        if state == self.IDLE:
+            if mark and near(us, self.LEADER_MARK):
+                self.state = self.LEAD_SPACE
+            return 0
+        if state == self.LEAD_SPACE:
+            if mark:
+                return self._fail(mark, us)
+            if near(us, self.LEADER_SPACE):
+                data = self.data
+                data[0] = data[1] = data[2] = data[3] = 0
+                self.nbits = 0
+                self.state = self.BIT_MARK_WAIT
+            elif near(us, self.REPEAT_SPACE):
+                self.state = self.REPEAT_MARK_WAIT
+            else:
+                self.state = self.IDLE
+            return 0
+        if state == self.BIT_MARK_WAIT:
+            if not mark or not near(us, self.BIT_MARK):
+                return self._fail(mark, us)
+            if self.nbits < 32:
+                self.state = self.BIT_SPACE_WAIT
+                return 0
+            self.state = self.IDLE
+            data = self.data
+            if data[2] ^ data[3] != 0xff:
+                self.errors += 1
+                return 0
+            if data[0] ^ data[1] == 0xff:
+                self.address = data[0]
+            else:
+                self.address = data[0] | (data[1] << 8)
+            self.command = data[2]
+            self.repeat = False
+            return NEC
+        if state == self.BIT_SPACE_WAIT:
+            if mark:
+                return self._fail(mark, us)
+            if near(us, self.ONE_SPACE):
+                self.data[self.nbits >> 3] |= 1 << (self.nbits & 7)
+            elif not near(us, self.ZERO_SPACE):
+                return self._fail(mark, us)
+            self.nbits += 1
+            self.state = self.BIT_MARK_WAIT
+            return 0
+        # REPEAT_MARK_WAIT
+        if not mark or not near(us, self.BIT_MARK):
+            return self._fail(mark, us)
+        self.state = self.IDLE
+        self.repeat = True
+        return NEC
+
+
+class RC5Decoder(object):
+    """Philips RC5: 14 Manchester coded bits of 2*889 us, MSB first: two
+    start bits, a toggle bit (flipped on every new key press), 5 address
+    bits and 6 command bits. A 1 is a space followed by a mark, so the
+    first half of the first start bit can't be seen. The second start
+    bit doubles as inverted bit 6 of the command (extended RC5).
+
+    Every mark/space is one or two half bits long, the decoder just
+    collects half bits (1 = mark) until it has all 28.
+
+    """
+    HALF_BIT = 889
+    NHALF = 28
+
+    def __init__(self):
+        self.halves = 0
+        self.nhalf = 0
+        self.address = 0
+        self.command = 0
+        self.toggle = 0
+        self.errors = 0
+
+    def _reset(self):
+        # Don't count the odd NEC mark that happens to look like a start
+        # bit
+        if self.nhalf >= self.NHALF // 2:
+            self.errors += 1
+        self.nhalf = 0
+
+    def feed(self, mark, us):
+        """Feed the next mark/space. Returns RC5 when a frame is complete
+        (see address, command, toggle), else 0."""
+        if near(us, self.HALF_BIT):
+            n = 1
+        elif near(us, 2*self.HALF_BIT):
+            n = 2
+        else:
+            n = 0
+
+        if self.nhalf == 0:
+            # Waiting for the mark ending the first start bit
+            if not mark or n == 0:
+                return 0
+            self.halves = 0
+            self.nhalf = 1          # the invisible space half
+        elif n == 0:
+            # The space after a frame ending in a 0 swallows its last
+            # half bit
+            if not mark and self.nhalf == self.NHALF - 1:
+                self.halves <<= 1
+                self.nhalf = self.NHALF
+                return self._decode()
+            self._reset()
+            return 0
+
+        for i in range(n):
+            self.halves = (self.halves << 1) | (1 if mark else 0)
+        self.nhalf += n
+        if self.nhalf > self.NHALF:
+            self._reset()
+            return 0
+        if self.nhalf == self.NHALF:
+            return self._decode()
+        return 0
+
+    def _decode(self):
+        halves = self.halves
+        self.nhalf = 0
+        value = 0
+        for i in range(self.NHALF - 2, -1, -2):
+            pair = (halves >> i) & 0b11
+            if pair == 0b01:
+                value = (value << 1) | 1
+            elif pair == 0b10:
+                value <<= 1
+            else:
+                self.errors += 1    # not Manchester coded
+                return 0
+        self.command = (value & 0x3f) | (0 if value & 0x1000 else 0x40)
+        self.address = (value >> 6) & 0x1f
+        self.toggle = (value >> 11) & 1
+        return RC5
+
+
+class IRReceiver(object):
+    """Collects edges from an IR receiver module and decodes them.
+
+    The IRQ handler only stores ticks_us() and the pin level in
+    preallocated arrays and bumps the head index, so it neither
+    allocates nor takes long. Everything else is done by poll, called
+    from the main loop. When the ring overflows (poll not called for a
+    long time) new edges are dropped and counted in overflows.
+
+    """
+
+    # A space this long ends any frame (longer than any mark/space
+    # inside a NEC or RC5 frame)
+    IDLE_US = 12000
+    # Repeats (NEC repeat codes, RC5 frames with the same toggle bit)
+    # are only honoured this soon after the previous frame
+    REPEAT_TIMEOUT_US = 200000
+
+    def __init__(self, pin=None, ring_size=64, on_code=None):
+        """pin is the GPIO number (or a machine.Pin) of the receiver
+        output, None to not attach to any pin (for feeding recorded
+        traces). ring_size has to be a power of two. on_code(protocol,
+        address, command, repeat) is called for every decoded code."""
+        if ring_size & (ring_size - 1):
+            raise ValueError("ring_size must be a power of two")
+        self.times = array.array('i', [0]*ring_size)
+        self.levels = bytearray(ring_size)
+        self.mask = ring_size - 1
+        self.head = 0           # written by the IRQ only
+        self.tail = 0           # written by poll only
+        self.overflows = 0
+
+        self.last_time = 0      # time of the last edge handled by poll
+        self.last_level = 1     # receiver output idles high
+        self.idle = True        # no frame in progress
+
+        self.nec = NECDecoder()
+        self.rc5 = RC5Decoder()
+        self.on_code = on_code
+        self.codes = 0
+        self.last_code_us = 0
+        self.last_protocol = 0
+        self.last_address = -1
+        self.last_command = -1
+        self.last_toggle = -1
+
+        # Bound methods are allocated when looked up, so keep a single
+        # one around for the IRQ
+        self._irq_ref = self._irq
+        self.pin = None
+        if pin is not None:
+            import machine
+            try:
+                import micropython
+                micropython.alloc_emergency_exception_buf(100)
+            except (ImportError, AttributeError):
+                pass
+            if isinstance(pin, int):
+                pin = machine.Pin(pin, machine.Pin.IN)
+            self.pin = pin
+            pin.irq(trigger=machine.Pin.IRQ_RISING | machine.Pin.IRQ_FALLING,
+                    handler=self._irq_ref)
+
+    def deinit(self):
+        if self.pin is not None:
+            self.pin.irq(handler=None)
+            self.pin = None
+
+    def _irq(self, pin):
+        t = time.ticks_us()
+        head = self.head
+        nxt = (head + 1) & self.mask
+        if nxt == self.tail:
+            self.overflows += 1
+            return
+        self.times[head] = t
+        self.levels[head] = pin.value()
+        self.head = nxt
+
+    def push(self, t, level):
+        """Store an edge at time t (ticks_us) where the output went to
+        level, like the IRQ does. Used when replaying traces."""
+        head = self.head
+        nxt = (head + 1) & self.mask
+        if nxt == self.tail:
+            self.overflows += 1
+            return
+        self.times[head] = t
+        self.levels[head] = level
+        self.head = nxt
+
+    def poll(self, now=None):
+        """Decode the edges collected since the last call. now (ticks_us)
+        is used to end a frame after a long enough quiet period,
+        defaults to the current time. Returns the number of codes
+        decoded."""
+        codes = self.codes
+        while self.tail != self.head:
+            tail = self.tail
+            t = self.times[tail]
+            level = self.levels[tail]
+            self.tail = (tail + 1) & self.mask
+            if level == self.last_level:
+                continue        # missed an edge (overflow), or a glitch
+            us = time.ticks_diff(t, self.last_time)
+            if not self.idle or self.last_level == 0:
+                self.feed(self.last_level == 0, us)
+            self.idle = False
+            self.last_time = t
+            self.last_level = level
+
+        if not self.idle and self.last_level:
+            if now is None:
+                now = time.ticks_us()
+            us = time.ticks_diff(now, self.last_time)
+            if us >= self.IDLE_US:
+                self.feed(False, us)
+                self.idle = True
+        return self.codes - codes
+
+    def feed(self, mark, us):
+        """Feed one mark/space to the decoders"""
+        if self.nec.feed(mark, us):
+            nec = self.nec
+            self._code(NEC, nec.address, nec.command, nec.repeat, -1)
+        if self.rc5.feed(mark, us):
+            rc5 = self.rc5
+            self._code(RC5, rc5.address, rc5.command, False, rc5.toggle)
+
+    def _code(self, protocol, address, command, repeat, toggle):
+        # Timed by the edges rather than the clock, so replayed traces
+        # behave the same
+        now = self.last_time
+        recent = (self.last_protocol != 0 and
+                  time.ticks_diff(now, self.last_code_us) < self.REPEAT_TIMEOUT_US)
+        if protocol == RC5:
+            # A held key sends the same frame over and over
+            repeat = (recent and self.last_protocol == RC5 and toggle == self.last_toggle and
+                      address == self.last_address and command == self.last_command)
+        elif repeat and not (recent and self.last_protocol == NEC):
+            return              # repeat code for a frame we missed
+        self.last_code_us = now
+        self.last_protocol = protocol
+        self.last_address = address
+        self.last_command = command
+        self.last_toggle = toggle
+        self.codes += 1
+        if self.on_code:
+            self.on_code(protocol, address, command, repeat)
+
+
+# Maps (protocol, address, command) to (command line, act on repeats).
+# The command lines are run through VolumeServer.process_cmd, except
+# for b'mute' which toggles mute. The defaults are the standard RC5 TV
+# codes, unknown codes are printed so other remotes are easy to add.
+DEFAULT_KEYMAP = {
+    (RC5, 0, 16): (b'incmaster 1', True),  # volume up
+    (RC5, 0, 17): (b'incmaster -1', True), # volume down
+    (RC5, 0, 13): (b'mute', False),        # mute
+    (RC5, 0, 32): (b'inc F 1', True),      # program up
+    (RC5, 0, 33): (b'inc F -1', True),     # program down
+}
+
+class IRVolumeServer(VolumeServer):
+    """Runs IR remote commands against a VolumeController. Has no socket
+    of its own, meant to be run in a MultiVolumeServer next to the
+    network servers (see server.start_server)."""
+
+    # How often to check for edges while waiting in poll. Edges come
+    # in from an IRQ, so they don't wake poll up by themselves.
+    POLL_MS = 20
+
+    def __init__(self, pin, vc=None, keymap=None, ring_size=64):
+        super().__init__(vc)
+        self.keymap = keymap or DEFAULT_KEYMAP
+        self.receiver = IRReceiver(pin, ring_size, on_code=self._on_code)
+
+    def _poll_timeout(self, timeout):
+        timeout = super()._poll_timeout(timeout)
+        if timeout is None or timeout < 0:
+            return self.POLL_MS
+        return min(timeout, self.POLL_MS)
+
+    def housekeeping(self):
+        self.receiver.poll()
+
+    def server_deinit(self):
+        self.receiver.deinit()
+        super().server_deinit()
+
+    def _on_code(self, protocol, address, command, repeat):
+        entry = self.keymap.get((protocol, address, command))
+        if entry is None:
+            if not repeat:
+                print("{}: unmapped code: protocol {} address {} command {}".format(
+                    self.__qualname__, protocol, address, command))
+            return
+        line, on_repeat = entry
+        if repeat and not on_repeat:
+            return
+        try:
+            if line == b'mute':
+                if self.vc.mute_state:
+                    self.vc.unmute()
+                else:
+                    self.vc.mute()
+            else:
+                self.process_cmd(line)
+        except Exception as e:
+            sys.print_exception(e)
+
+
+# ---Testing without hardware---
+
+def encode_nec(address, command, out=None):
+    """Append the marks/spaces of a NEC frame to out (a list of signed
+    durations, positive for marks) and return it."""
+    out = out if out is not None else []
+    out.append(NECDecoder.LEADER_MARK)
+    out.append(-NECDecoder.LEADER_SPACE)
+    if address > 0xff:
+        data = (address & 0xffff) | (command << 16) | ((command ^ 0xff) << 24)
+    else:
+        data = address | ((address ^ 0xff) << 8) | (command << 16) | ((command ^ 0xff) << 24)
+    for i in range(32):
+        out.append(NECDecoder.BIT_MARK)
+        out.append(-(NECDecoder.ONE_SPACE if (data >> i) & 1 else NECDecoder.ZERO_SPACE))
+    out.append(NECDecoder.BIT_MARK)
+    return out
+
+def encode_nec_repeat(out=None):
+    out = out if out is not None else []
+    out.append(NECDecoder.LEADER_MARK)
+    out.append(-NECDecoder.REPEAT_SPACE)
+    out.append(NECDecoder.BIT_MARK)
+    return out
+
+def encode_rc5(address, command, toggle, out=None):
+    """Append the marks/spaces of an RC5 frame to out, see encode_nec"""
+    out = out if out is not None else []
+    value = ((0 if command & 0x40 else 1) << 12 | 1 << 13 | (toggle & 1) << 11 |
+             (address & 0x1f) << 6 | (command & 0x3f))
+    # Half bits (True = mark), a 1 is space then mark
+    halves = []
+    for i in range(13, -1, -1):
+        bit = (value >> i) & 1
+        halves.append(not bit)
+        halves.append(bool(bit))
+    # The leading space can't be seen, and equal neighbours merge
+    # into one longer mark/space
+    prev = None
+    for mark in halves[1:]:
+        us = RC5Decoder.HALF_BIT if mark else -RC5Decoder.HALF_BIT
+        if mark == prev:
+            out[-1] += us
+        else:
+            out.append(us)
+        prev = mark
+    return out
+
+def load_trace(filename):
+    """Read a trace as printed by the LIRC mode2 tool ("pulse N"/"space N"
+    lines, others ignored) into a list of signed durations."""
+    trace = []
+    with open(filename) as f:
+        for line in f:
+            words = line.split()
+            if len(words) == 2 and words[0] in ('pulse', 'space'):
+                us = int(words[1])
+                trace.append(us if words[0] == 'pulse' else -us)
+    return trace
+
+def replay(trace, receiver, start=0):
+    """Push the edges of trace into the ring of receiver, as if they had
+    come from the IRQ, polling it whenever the ring fills up. Returns
+    the time (ticks_us) of the last edge."""
+    t = start
+    for us in trace:
+        # The output is low (0) during marks
+        receiver.push(t, 0 if us > 0 else 1)
+        t = time.ticks_add(t, abs(us))
+        if ((receiver.head + 2) & receiver.mask) == receiver.tail:
+            receiver.poll(t)
+    receiver.push(t, 1)
+    receiver.poll(t)
+    receiver.poll(time.ticks_add(t, IRReceiver.IDLE_US))
+    return t
+
+def decode_trace(trace):
+    """Decode a trace (a list of signed durations or the name of a mode2
+    file) and print the codes found. Returns them as a list of
+    (protocol, address, command, repeat) tuples."""
+    if isinstance(trace, str):
+        trace = load_trace(trace)
+    codes = []
+    receiver = IRReceiver(on_code=lambda *code: codes.append(code))
+    replay(trace, receiver)
+    for code in codes:
+        print("{} address {} command {}{}".format(
+            'NEC' if code[0] == NEC else 'RC5', code[1], code[2], ' (repeat)' if code[3] else ''))
+    return codes
+
+def benchmark(n=500, jitter=100):
+    """Decode n random NEC and RC5 frames, each mark/space off by up to
+    jitter us, and print how many came out wrong and how long decoding
+    took. Returns the number of errors."""
+    import urandom as random
+
+    expected = []
+    trace = []
+    for i in range(n):
+        if random.getrandbits(1):
+            address, command = random.getrandbits(8), random.getrandbits(8)
+            expected.append((NEC, address, command, False))
+            encode_nec(address, command, trace)
+        else:
+            address, command = random.getrandbits(5), random.getrandbits(7)
+            expected.append((RC5, address, command, False))
+            encode_rc5(address, command, i & 1, trace)
+        trace.append(-40000)    # gap between frames
+    for i in range(len(trace)):
+        delta = random.getrandbits(8) % (2*jitter + 1) - jitter
+        trace[i] += delta if trace[i] > 0 else -delta
+
+    codes = []
+    receiver = IRReceiver(ring_size=256, on_code=lambda *code: codes.append(code))
+    start = time.ticks_us()
+    replay(trace, receiver)
+    host_us = time.ticks_diff(time.ticks_us(), start)
+
+    errors = abs(len(codes) - len(expected))
+    for got, want in zip(codes, expected):
+        if got != want:
+            errors += 1
+    print("{} frames, {} edges, {} decoded, {} errors ({} NEC, {} RC5 frames broken off), {} overflows".format(
+        n, len(trace), len(codes), errors, receiver.nec.errors, receiver.rc5.errors, receiver.overflows))
+    print("host time: {} us ({} us/edge)".format(host_us, host_us // len(trace)))
+    return errors
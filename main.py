@@ -1,3 +1,3 @@
 import server
 
-server.start_tcpserver()
+server.start_server()
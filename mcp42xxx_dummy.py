@@ -1,21 +1,205 @@
-"""Implements a dummy MCP42XXX class so the server can be tested on
-unix MicroPython.
+"""Implements a software model of a daisy chain of MCP42XXX so the
+server can be tested on unix MicroPython.
+
+The real driver (mcp42xxx.MCP42XXX) is used as is, but with its SPI
+bus, pins and clock replaced by model objects. Every byte set_chain
+sends is clocked into a model of the chained shift registers and
+decoded per chip when CS goes high, just like the real chips do. This
+way we can check that the frames the driver emits actually give the
+wiper and shutdown states we expect (see check_levels), and estimate
+how long the real bus would be busy (see ChainModel.bus_time_us and
+benchmark) without any hardware.
 
 """
 
+import sys
+import utime as time
+
+try:
+    import machine
+except ImportError:
+    # No machine module at all on this port. The driver only needs it
+    # in __init__, which the model never calls.
+    class machine(object):
+        pass
+    sys.modules['machine'] = machine
+
+import mcp42xxx
+
 # ---PINOUT---
 # HSCLK = D5
 # HMISO = D6 (unused)
 # HMOSI = D7
-CS_PIN = 15                     # GPIO15 = D8
-SHDN_PIN = 4                    # GPIO4 = D2
-RS_PIN = 5                      # GPIO5 = D1
+CS_PIN = mcp42xxx.CS_PIN
+SHDN_PIN = mcp42xxx.SHDN_PIN
+RS_PIN = mcp42xxx.RS_PIN
+
+MIDSCALE = 0x80                 # wiper value after power on or RS
+
+class ChainModel(object):
+    """Model of daisyCount chained MCP42XXX.
+
+    While CS is low every byte clocked in enters the shift register of
+    the first chip (the one closest to the MCU) and pushes the
+    register contents one byte further down the chain. When CS goes
+    high each chip executes the 16 bits sitting in its register, but
+    only if a multiple of 16 bits were clocked in (otherwise all
+    chips ignore the frame, like the real ones).
+
+    The SHDN pin puts every pot in hardware shutdown while low. Taking
+    it high again also clears software shutdown (the shdn command) on
+    all pots, which is why VolumeController.unmute has to resend
+    everything. A NOP command also brings the pots of the chip
+    receiving it out of software shutdown (the glitch push_levels
+    avoids by never sending NOPs); set nop_clears_shdn to False to
+    model chips without that behaviour.
+
+    """
+
+    def __init__(self, daisyCount, baudrate, nop_clears_shdn=True):
+        self.daisyCount = daisyCount
+        self.baudrate = baudrate
+        self.nop_clears_shdn = nop_clears_shdn
+
+        self.register = bytearray(2*daisyCount) # oldest byte first
+        self.wipers = [[MIDSCALE, MIDSCALE] for _ in range(daisyCount)]
+        self.sw_shdn = [[False, False] for _ in range(daisyCount)]
+        self.shdn_pin = True    # active low
+        self.cs = True          # active low
+        self.clocked = 0        # bytes clocked in since CS went low
+
+        # Statistics
+        self.frames = 0         # frames executed
+        self.bad_frames = 0     # frames ignored because of a bad bit count
+        self.commands = 0       # commands executed (over all chips)
+        self.bus_time_us = 0    # modelled time the bus has been busy
+
+    def cs_low(self):
+        self.cs = False
+        self.clocked = 0
+
+    def clock(self, data):
+        if self.cs:
+            return              # chips ignore the bus when not selected
+        n = len(self.register)
+        for b in data:
+            self.register[0:n - 1] = self.register[1:n]
+            self.register[n - 1] = b
+        self.clocked += len(data)
+        self.bus_time_us += len(data)*8*1000000 // self.baudrate
+
+    def cs_high(self):
+        if self.cs:
+            return
+        self.cs = True
+        if self.clocked == 0:
+            return
+        if self.clocked % 2:
+            self.bad_frames += 1
+            return
+        self.frames += 1
+        n = len(self.register)
+        for chip in range(self.daisyCount):
+            # The last two bytes clocked in are in the first chip
+            self.execute(chip, self.register[n - 2 - 2*chip], self.register[n - 1 - 2*chip])
+
+    def execute(self, chip, cmd, data):
+        """Execute one command on one chip (see the protocol description in
+        mcp42xxx.py)"""
+        self.commands += 1
+        action = (cmd >> 4) & 0b11
+        pots = cmd & 0b11
+        if action == 0b01:
+            for pot in range(2):
+                if pots & (1 << pot):
+                    self.wipers[chip][pot] = data
+                    self.sw_shdn[chip][pot] = False
+        elif action == 0b10:
+            for pot in range(2):
+                if pots & (1 << pot):
+                    self.sw_shdn[chip][pot] = True
+        elif self.nop_clears_shdn:
+            self.sw_shdn[chip][0] = self.sw_shdn[chip][1] = False
+
+    def set_shdn_pin(self, value):
+        if value and not self.shdn_pin:
+            for chip in range(self.daisyCount):
+                self.sw_shdn[chip][0] = self.sw_shdn[chip][1] = False
+        self.shdn_pin = bool(value)
+
+    def reset(self):
+        """RS pin pulsed low: wipers to midscale, shutdown cleared"""
+        for chip in range(self.daisyCount):
+            self.wipers[chip][0] = self.wipers[chip][1] = MIDSCALE
+            self.sw_shdn[chip][0] = self.sw_shdn[chip][1] = False
+
+    def output(self, chip, pot):
+        """Effective state of a pot: its wiper value, or None if it is in
+        (software or hardware) shutdown."""
+        if not self.shdn_pin or self.sw_shdn[chip][pot]:
+            return None
+        return self.wipers[chip][pot]
+
+
+class ModelSPI(object):
+    def __init__(self, model):
+        self.model = model
 
-class MCP42XXX(object):
-    P0 = 0b01                   # Potentiometer 0
-    P1 = 0b10                   # Potentiometer 1
-    BOTH = 0b11                 # Both potentiometers
-    MAX_VALUE = 255
+    def write(self, data):
+        self.model.clock(data)
+
+
+class ModelPin(object):
+    def __init__(self, on_low=None, on_high=None):
+        self.on_low = on_low
+        self.on_high = on_high
+        self.state = 1
+
+    def low(self):
+        self.state = 0
+        if self.on_low:
+            self.on_low()
+
+    def high(self):
+        self.state = 1
+        if self.on_high:
+            self.on_high()
+
+    def value(self, v=None):
+        if v is None:
+            return self.state
+        if v:
+            self.high()
+        else:
+            self.low()
+
+
+class ModelClock(object):
+    """Stands in for utime in the driver. Sleeping adds to the modelled
+    bus time instead of actually sleeping, so the CS hold time is
+    accounted for without slowing down tests."""
+
+    def __init__(self):
+        self.model = None
+
+    def sleep_ms(self, ms):
+        if self.model:
+            self.model.bus_time_us += ms*1000
+
+    def sleep_us(self, us):
+        if self.model:
+            self.model.bus_time_us += us
+
+    def sleep(self, s):
+        if self.model:
+            self.model.bus_time_us += int(s*1000000)
+
+# All delays in the driver go through its time module
+mcp42xxx.time = ModelClock()
+
+
+class MCP42XXX(mcp42xxx.MCP42XXX):
+    """The real driver, talking to a ChainModel (self.model)"""
 
     def __init__(self,
                  daisyCount=1,
@@ -23,23 +207,75 @@ class MCP42XXX(object):
                  cs_pin=CS_PIN,
                  shdn_pin=SHDN_PIN,
                  rs_pin=RS_PIN):
-        pass
+        self.model = ChainModel(daisyCount, baudrate)
+        mcp42xxx.time.model = self.model
+        self.spi = ModelSPI(self.model)
+        self.cs   = ModelPin(on_low=self.model.cs_low, on_high=self.model.cs_high)
+        self.shdn = ModelPin(on_low=lambda: self.model.set_shdn_pin(0),
+                             on_high=lambda: self.model.set_shdn_pin(1))
+        self.rs   = ModelPin(on_low=self.model.reset)
+        self.daisyCount = daisyCount
 
 
-    def set_chain(self, values, channels=None):
-        pass
+def check_levels(vc):
+    """Check that the modelled chips are in the state the
+    VolumeController vc wants them in. Returns a list of mismatches as
+    (chip, pot, expected, actual) tuples, empty if all is well.
+    Expected is None for a pot that should be silent (in shutdown)."""
+    from volume_control import g_logarithmic_mapping
 
-    def set(self, nr, value, channel=BOTH):
-        pass
-    
-    def reset(self):
-        """Toggles reset pin to reset all MCP42XXX:s on reset line"""
-        pass
+    model = vc.pot.model
+    mismatches = []
+    for chip in range(vc.NUMPOTS):
+        for pot in range(2):
+            if vc.mute_state or vc.mutes[chip][pot]:
+                expected = None
+            else:
+                expected = (g_logarithmic_mapping[vc.levels[chip][pot]] *
+                            g_logarithmic_mapping[vc.master] // MCP42XXX.MAX_VALUE)
+            actual = model.output(chip, pot)
+            if actual != expected:
+                mismatches.append((chip, pot, expected, actual))
+    return mismatches
 
-    def shdn_all(self):
-        """Sets shutdown pin low make all MCP42XXX:s enter shutdown mode"""
-        pass
 
-    def unshdn_all(self):
-        """Sets shutdown pin high to make all MCP42XXX:s enter normal mode"""
-        pass
+def benchmark(vc=None, n=1000):
+    """Change random levels/mutes n times through a VolumeController,
+    checking the modelled chip state after every change. Prints the
+    host time spent and the modelled bus time, from which the maximum
+    number of updates per second on real hardware can be estimated.
+    Returns the number of mismatches found."""
+    from volume_control import VolumeController
+    import urandom as random
+
+    vc = vc or VolumeController()
+    model = vc.pot.model
+    frames0, bus0, errors = model.frames, model.bus_time_us, 0
+    start = time.ticks_us()
+    for i in range(n):
+        op = random.getrandbits(2)
+        chip = random.getrandbits(8) % vc.NUMPOTS
+        if op == 0:
+            vc.set_master(random.getrandbits(8) % (vc.MAX_LEVEL + 1))
+        elif op == 1:
+            vc.set_mute(chip, random.getrandbits(1), random.getrandbits(1))
+        elif op == 2 and random.getrandbits(3) == 0:
+            if vc.mute_state:
+                vc.unmute()
+            else:
+                vc.mute()
+        else:
+            vc.set_volume(chip, vc.LR, random.getrandbits(8) % (vc.MAX_LEVEL + 1))
+        mismatches = check_levels(vc)
+        if mismatches:
+            errors += 1
+            print("mismatch after update {}: {}".format(i, mismatches))
+    host_us = time.ticks_diff(time.ticks_us(), start)
+    bus_us = model.bus_time_us - bus0
+    frames = model.frames - frames0
+
+    print("{} updates, {} frames ({} bad), {} mismatches".format(n, frames, model.bad_frames, errors))
+    print("host time: {} us ({} us/update, includes checking)".format(host_us, host_us // n))
+    print("modelled bus time: {} us ({} us/update) at {} baud".format(bus_us, bus_us // n, model.baudrate))
+    print("bus limited max: {} updates/s".format(n*1000000 // bus_us if bus_us else 0))
+    return errors
@@ -9,40 +9,57 @@
 #include <QHostAddress>
 #include <QTimer>
 
-class Protocol : public QObject
+#include "Command.h"
+#include "ProtocolCore.h"
+#include "SessionCapture.h"
+#include "Status.h"
+
+/**
+ * \brief Qt face of ProtocolCore (see core/). The core does all the protocol work, the
+ *        sub-classes only move bytes between it and a Qt socket and turn its callbacks into
+ *        signals.
+ */
+class Protocol : public QObject, protected ProtocolHandler
 {
     Q_OBJECT
 
 public:
+    typedef ::ServerStatus ServerStatus;
 
-    struct ServerStatus
-    {
-        int fl_level; int fr_level; int fl_mute; int fr_mute;
-        int sub_level; int cen_level; int sub_mute; int cen_mute;
-        int rl_level; int rr_level; int rl_mute; int rr_mute;
-        int master; int global_mute;
-    };
-
     /**
-     *  \brief Helper method to construct and send a command without any parameters. Stores sent
-     *         command in object member command.
+     * \brief Build and send a command without any parameters
+     */
+    void sendCmd(Command cmd) { core.sendCmd(cmd); scheduleTick(); }
+    /**
+     * \brief Build and send a command with an int parameter
      */
-    void sendCmd(const char *cmd);
+    void sendCmd(Command cmd, int value) { core.sendCmd(cmd, value); scheduleTick(); }
     /**
-     * \brief Helper method to construct and send a command with an int parameter. Stores sent
-     *        command in object member command.
+     * \brief Build and send a command with a channel and an int parameter
      */
-    void sendCmd(const char *cmd, int level);
+    void sendCmd(Command cmd, Channel chan, int value) { core.sendCmd(cmd, chan, value); scheduleTick(); }
     /**
-     * \brief Helper method to construct and send a command with a channel and level parameter.
-     *        Stores sent command in object member command.
+     * \brief Send an already built command (see ProtocolThread)
      */
-    void sendCmd(const char *cmd, const char *chan, int level);
+    void send(const CommandBuffer &cmd) { core.send(cmd); scheduleTick(); }
 
     /**
-     * Send data to server
+     * \brief Record everything sent and received (plus connects/disconnects) to capture, nullptr
+     *        to stop recording. The capture is not owned by the Protocol.
      */
-    virtual void sendMsg(const char *data) =0;
+    void setCapture(SessionCapture *capture) { core.setCapture(capture); }
+
+    /**
+     * \brief UDP: have the server acknowledge commands and resend those that get lost (see
+     *        ProtocolCore::setReliable)
+     */
+    void setReliable(bool reliable) { core.setReliable(reliable); }
+
+    bool isConnected() const { return core.isConnected(); }
+    /// \brief Link metrics of the core, see ProtocolCore
+    double roundTripTime() const { return core.roundTripTime(); }
+    unsigned pendingReplies() const { return core.pendingReplies(); }
+    unsigned long retransmits() const { return core.retransmits(); }
 
 public slots:
     virtual void serverConnect(const QString &host, quint16 port) =0;
@@ -56,21 +73,35 @@ signals:
     void disconnected();
     void error(const QString &msg);
     void statusUpdate(const ServerStatus &values);
-    
+    /// \brief Reply to Command::Stats
+    void statsUpdate(const DeviceStats &stats);
+
 protected:
-    char command[128]; //!< Stores command to send to server/last message sent to server
+    ProtocolCore core;
+
+    Protocol(Transport transport);
 
-    /// Called by sub-classes. Sets up the socket/signal connections that are the same for both sub-classes. 
+    /// Called by sub-classes. Sets up the socket/signal connections that are the same for both sub-classes.
     void socketSetup(QAbstractSocket *socket);
 
-    /// Parse and apply status message from server
-    void parseStatusMessage(const char *status);
+    /// (Re)start tickTimer for the next deadline of the core, if any
+    void scheduleTick();
+
+    // ProtocolHandler
+    void onConnected() override;
+    void onDisconnected() override;
+    void onStatus(const ServerStatus &values) override;
+    void onStats(const DeviceStats &stats) override;
+    void onError(ProtocolError err, const char *detail) override;
+
+private:
+    QTimer *tickTimer; //!< Calls core.tick (connect timeouts, UDP pings)
 };
 
 class TcpProtocol : public Protocol
 {
     Q_OBJECT
-    
+
 public:
     TcpProtocol();
 
@@ -79,7 +110,9 @@ public slots:
     void serverDisconnect() override;
 
     void receiveStatusMessage() override;
-    void sendMsg(const char *data) override;
+
+protected:
+    void writeToServer(const char *data, std::size_t len) override;
 
 private:
     QTcpSocket *socket;
@@ -101,28 +134,21 @@ public:
      *                                   updateInterval * pingMissesBeforeDisconnect ms
      */
     UdpProtocol(int updateInterval=1000, unsigned pingMissesBeforeDisconnect=5);
-    
+
 public slots:
     void serverConnect(const QString &host, quint16 port) override;
     void serverDisconnect() override;
 
     void receiveStatusMessage() override;
-    void sendMsg(const char *data) override;
 
-private slots:
-    void pingServer(); //!< Called by statusUpdateTimer
+protected:
+    void writeToServer(const char *data, std::size_t len) override;
 
 private:
     QHostAddress host;
     quint16 port;
-    bool isConnected;
     QUdpSocket *socket;
-    QTimer *statusUpdateTimer; //!< Used to update status periodically
-
-    const unsigned pingMissesBeforeDisconnect;
-    unsigned waitingForAnswer; //!< Incremented by pingServer and reset by receiveStatusMessage. Consider us
-                               //!as having lost connection with server if we end up in pingServer
-                               //!and this is larger than pingMissesBeforeDisconnect.
+    int lookupId; //!< Pending host lookup, -1 if none
 };
 
 #endif
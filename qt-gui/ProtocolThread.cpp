@@ -0,0 +1,140 @@
+#include "ProtocolThread.h"
+
+#include <QMetaObject>
+
+static const int OVERFLOW_RETRY_MS = 5;
+
+ProtocolThread::ProtocolThread(Protocol *_protocol, QObject *parent) :
+    QObject(parent), protocol(_protocol), wakePending(false), statusNotified(false),
+    connected_(false), rtt(0), pending(0), resent(0)
+{
+    qRegisterMetaType<DeviceStats>();
+
+    overflowTimer = new QTimer(this);
+    overflowTimer->setSingleShot(true);
+    overflowTimer->setInterval(OVERFLOW_RETRY_MS);
+    connect(overflowTimer, &QTimer::timeout, this, &ProtocolThread::flushOverflow);
+
+    // protocol as the context: these run in the network thread
+    connect(this, &ProtocolThread::commandsQueued, protocol, [this]() { this->drainCommands(); });
+    connect(this, &ProtocolThread::connectRequested, protocol, &Protocol::serverConnect);
+    connect(this, &ProtocolThread::disconnectRequested, protocol, &Protocol::serverDisconnect);
+
+    connect(protocol, &Protocol::statusUpdate, protocol, [this](const Protocol::ServerStatus &values) {
+            status.publish(values);
+            if (!statusNotified.exchange(true, std::memory_order_acq_rel))
+                emit statusAvailable();
+        });
+    connect(protocol, &Protocol::connected, protocol, [this]() { this->publishLinkState(); });
+    connect(protocol, &Protocol::disconnected, protocol, [this]() { this->publishLinkState(); });
+    connect(protocol, &Protocol::statsUpdate, protocol, [this]() { this->publishLinkState(); });
+
+    // this as the context: queued to the GUI thread
+    connect(protocol, &Protocol::connected, this, &ProtocolThread::connected);
+    connect(protocol, &Protocol::disconnected, this, [this]() {
+            // Whatever status is still in the slot came before the disconnect: it's not live
+            // any more, and leaving it there would keep statusAvailable from being emitted again
+            Protocol::ServerStatus stale;
+            this->takeStatus(stale);
+            emit disconnected();
+        });
+    connect(protocol, &Protocol::error, this, &ProtocolThread::error);
+    connect(protocol, &Protocol::statsUpdate, this, &ProtocolThread::statsUpdate);
+
+    thread.setObjectName("network");
+    protocol->moveToThread(&thread);
+    connect(&thread, &QThread::finished, protocol, &QObject::deleteLater);
+    thread.start();
+}
+
+ProtocolThread::~ProtocolThread()
+{
+    stop();
+}
+
+void ProtocolThread::sendCmd(Command cmd)
+{
+    command.begin(cmd).end();
+    enqueue(command);
+}
+
+void ProtocolThread::sendCmd(Command cmd, int value)
+{
+    command.begin(cmd).arg(value).end();
+    enqueue(command);
+}
+
+void ProtocolThread::sendCmd(Command cmd, Channel chan, int value)
+{
+    command.begin(cmd).arg(chan).arg(value).end();
+    enqueue(command);
+}
+
+void ProtocolThread::enqueue(const CommandBuffer &cmd)
+{
+    // Keep the order: nothing goes into the queue while older commands wait in overflow
+    if (!overflow.empty() || !commands.push(cmd))
+    {
+        overflow.push_back(cmd);
+        if (!overflowTimer->isActive())
+            overflowTimer->start();
+    }
+    // acq_rel: if the network thread has already cleared the flag, it also sees the push
+    if (!wakePending.exchange(true, std::memory_order_acq_rel))
+        emit commandsQueued();
+}
+
+void ProtocolThread::flushOverflow()
+{
+    while (!overflow.empty() && commands.push(overflow.front()))
+        overflow.pop_front();
+    if (!overflow.empty())
+        overflowTimer->start();
+    if (!wakePending.exchange(true, std::memory_order_acq_rel))
+        emit commandsQueued();
+}
+
+void ProtocolThread::drainCommands()
+{
+    // Clear the flag before looking at the queue, so that anything pushed after the last pop
+    // below wakes us up again
+    wakePending.exchange(false, std::memory_order_acq_rel);
+    CommandBuffer cmd;
+    while (commands.pop(cmd))
+        protocol->send(cmd);
+}
+
+void ProtocolThread::publishLinkState()
+{
+    connected_.store(protocol->isConnected(), std::memory_order_relaxed);
+    rtt.store(protocol->roundTripTime(), std::memory_order_relaxed);
+    pending.store(protocol->pendingReplies(), std::memory_order_relaxed);
+    resent.store(protocol->retransmits(), std::memory_order_relaxed);
+}
+
+bool ProtocolThread::takeStatus(Protocol::ServerStatus &values)
+{
+    // Re-arm first: a status published after this gets its own statusAvailable
+    statusNotified.store(false, std::memory_order_release);
+    return status.take(values);
+}
+
+void ProtocolThread::serverConnect(const QString &host, quint16 port)
+{
+    emit connectRequested(host, port);
+}
+
+void ProtocolThread::serverDisconnect()
+{
+    emit disconnectRequested();
+}
+
+void ProtocolThread::stop()
+{
+    if (!thread.isRunning())
+        return;
+    // Sends byebye before the sockets go
+    QMetaObject::invokeMethod(protocol, "serverDisconnect", Qt::BlockingQueuedConnection);
+    thread.quit();
+    thread.wait();
+}
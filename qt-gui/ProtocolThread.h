@@ -0,0 +1,115 @@
+// -*- Mode: C++ -*-
+
+#ifndef __PROTOCOLTHREAD_H
+#define __PROTOCOLTHREAD_H
+
+#include <atomic>
+#include <deque>
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+
+#include "Command.h"
+#include "LatestValue.h"
+#include "Protocol.h"
+#include "SpscQueue.h"
+#include "Status.h"
+
+Q_DECLARE_METATYPE(DeviceStats)
+
+/**
+ * \brief Runs a Protocol on a thread of its own, so that socket I/O, logging and status parsing
+ *        never hold up the GUI, and the GUI's face of it.
+ *
+ * Lives in the GUI thread and is only to be used from there. Commands go to the network thread
+ * through a lock-free queue, and wake it up with one queued signal per batch rather than one per
+ * command. Statuses come back through a LatestValue slot: the network thread overwrites it with
+ * every status it gets, and statusAvailable is emitted only when the slot goes from taken to
+ * filled, so a burst of statuses costs the GUI one event and one takeStatus per frame, however
+ * long the burst. The rest (connected, disconnected, errors, stats) are rare and come as queued
+ * signals.
+ */
+class ProtocolThread : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * \brief Take over protocol (set up, but not connected yet) and start the network thread.
+     *        The protocol is deleted along with the thread.
+     */
+    explicit ProtocolThread(Protocol *protocol, QObject *parent = nullptr);
+    /// \brief Calls stop
+    ~ProtocolThread();
+
+    /// \brief Build a command without any parameters and hand it to the network thread
+    void sendCmd(Command cmd);
+    /// \brief Build a command with an int parameter and hand it to the network thread
+    void sendCmd(Command cmd, int value);
+    /// \brief Build a command with a channel and an int parameter and hand it to the network thread
+    void sendCmd(Command cmd, Channel chan, int value);
+
+    /**
+     * \brief Get the latest status received since the last call, if there is one (otherwise
+     *        returns false and leaves values alone). Re-arms statusAvailable.
+     */
+    bool takeStatus(Protocol::ServerStatus &values);
+
+    /// \brief As last reported by the network thread
+    bool isConnected() const { return connected_.load(std::memory_order_relaxed); }
+    /// \brief Link metrics of the core (see ProtocolCore), as of the last stats reply
+    double roundTripTime() const { return rtt.load(std::memory_order_relaxed); }
+    unsigned pendingReplies() const { return pending.load(std::memory_order_relaxed); }
+    unsigned long retransmits() const { return resent.load(std::memory_order_relaxed); }
+
+public slots:
+    void serverConnect(const QString &host, quint16 port);
+    void serverDisconnect();
+    /// \brief Disconnect (waiting for the network thread to do so) and stop the thread
+    void stop();
+
+signals:
+    void connected();
+    void disconnected();
+    void error(const QString &msg);
+    /// \brief A status is waiting in the slot, see takeStatus. Not emitted again until it is taken.
+    void statusAvailable();
+    /// \brief Reply to Command::Stats
+    void statsUpdate(const DeviceStats &stats);
+
+    // To the network thread (queued, as the protocol lives there)
+    void commandsQueued();
+    void connectRequested(const QString &host, quint16 port);
+    void disconnectRequested();
+
+private:
+    /// Commands that fit in the queue are never waited for, and a full queue only means the
+    /// network thread is stuck: the rest wait in overflow (GUI side) until there is room again
+    static const std::size_t QUEUE_SIZE = 256;
+
+    QThread thread;
+    Protocol *protocol;     //!< Lives in thread
+
+    SpscQueue<CommandBuffer, QUEUE_SIZE> commands;   //!< GUI -> network thread
+    std::atomic<bool> wakePending;  //!< commandsQueued emitted, the network thread not at it yet
+    std::deque<CommandBuffer> overflow;
+    QTimer *overflowTimer;          //!< Retries overflow while it isn't empty
+
+    LatestValue<Protocol::ServerStatus> status;     //!< Network thread -> GUI
+    std::atomic<bool> statusNotified; //!< statusAvailable emitted, status not taken yet
+
+    std::atomic<bool> connected_;
+    std::atomic<double> rtt;
+    std::atomic<unsigned> pending;
+    std::atomic<unsigned long> resent;
+
+    CommandBuffer command;          //!< Built by sendCmd
+
+    void enqueue(const CommandBuffer &cmd);
+    void flushOverflow();
+    void drainCommands();           //!< Network thread: send everything in the queue
+    void publishLinkState();        //!< Network thread
+};
+
+#endif
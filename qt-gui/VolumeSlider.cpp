@@ -1,8 +1,11 @@
 #include "VolumeSlider.h"
 
 #include <Qt>
+#include <climits>
 #include <QGridLayout>
 #include <QLabel>
+#include <QKeyEvent>
+#include <QWheelEvent>
 
 // use later if using a stackedlayout with simple slider and double slider switcheable?
 #include <QSignalBlocker>
@@ -19,6 +22,31 @@ static QSlider *sliderSettings(QSlider *slider)
     return slider;
 }
 
+/* Translate key and wheel events on a slider into a signed number of steps. Returns 0 for events
+   that aren't steps (those are left to the slider). High resolution wheels send fractions of a
+   notch, those are gathered up in wheelRemainder. */
+static int sliderSteps(QEvent *event, int &wheelRemainder)
+{
+    if (event->type() == QEvent::KeyPress) {
+        switch (static_cast<QKeyEvent*>(event)->key()) {
+        case Qt::Key_Up:
+        case Qt::Key_Right:    return 1;
+        case Qt::Key_Down:
+        case Qt::Key_Left:     return -1;
+        case Qt::Key_PageUp:   return 10;
+        case Qt::Key_PageDown: return -10;
+        default:               return 0;
+        }
+    } else if (event->type() == QEvent::Wheel) {
+        wheelRemainder += static_cast<QWheelEvent*>(event)->angleDelta().y();
+        int steps = wheelRemainder / QWheelEvent::DefaultDeltasPerStep;
+        wheelRemainder %= QWheelEvent::DefaultDeltasPerStep;
+        // Swallow the event even when it didn't amount to a step, or the slider moves by itself
+        return steps ? steps : INT_MIN;
+    }
+    return 0;
+}
+
 LRVolumeSlider::LRVolumeSlider(const QString &title,
                                QWidget *parent) :
     LRVolumeSlider(title, parent, "L", "R")
@@ -29,12 +57,15 @@ LRVolumeSlider::LRVolumeSlider(const QString &title,
                                QWidget *parent,
                                const QString &lLabelString,
                                const QString &rLabelString) :
-    QGroupBox(title, parent)
+    QGroupBox(title, parent),
+    wheelRemainder(0)
 {
     QGridLayout *layout = new QGridLayout(this);
 
     lSlider = sliderSettings(new QSlider(Qt::Vertical, this));
     rSlider = sliderSettings(new QSlider(Qt::Vertical, this));
+    lSlider->installEventFilter(this);
+    rSlider->installEventFilter(this);
 
     QLabel *lLabel = new QLabel(lLabelString);
     QLabel *rLabel = new QLabel(rLabelString);
@@ -93,6 +124,32 @@ void LRVolumeSlider::value(int &lValue, int &rValue) const
     rValue = rSlider->value();
 }
 
+void LRVolumeSlider::muteState(bool &lTicked, bool &rTicked) const
+{
+    lTicked = lMuteBox->isChecked();
+    rTicked = rMuteBox->isChecked();
+}
+
+bool LRVolumeSlider::eventFilter(QObject *watched, QEvent *event)
+{
+    if ((watched != lSlider && watched != rSlider) || !this->isEnabled())
+        return QGroupBox::eventFilter(watched, event);
+
+    int steps = sliderSteps(event, wheelRemainder);
+    if (steps == 0)
+        return QGroupBox::eventFilter(watched, event);
+    if (steps == INT_MIN)
+        return true;
+
+    if (this->lockBox->isChecked())
+        emit stepped(steps, steps);
+    else if (watched == lSlider)
+        emit stepped(steps, 0);
+    else
+        emit stepped(0, steps);
+    return true;
+}
+
 void LRVolumeSlider::emitValueChanged()
 {
     emit valueChanged(this->lSlider->value(), this->rSlider->value());
@@ -134,11 +191,13 @@ void LRVolumeSlider::setMuteBoxes(bool lTicked, bool rTicked)
 }
 
 VolumeSlider::VolumeSlider(const QString &title, QWidget *parent) :
-    QGroupBox(title, parent)
+    QGroupBox(title, parent),
+    wheelRemainder(0)
 {
     QGridLayout *layout = new QGridLayout(this);
 
     slider = sliderSettings(new QSlider(this));
+    slider->installEventFilter(this);
     muteBox = new QCheckBox(tr("Mute"), this);
 
     layout->addWidget(slider, 0, 0, Qt::AlignHCenter);
@@ -157,6 +216,24 @@ int VolumeSlider::value() const
     return slider->value();
 }
 
+bool VolumeSlider::muteState() const
+{
+    return muteBox->isChecked();
+}
+
+bool VolumeSlider::eventFilter(QObject *watched, QEvent *event)
+{
+    if (watched != slider || !this->isEnabled())
+        return QGroupBox::eventFilter(watched, event);
+
+    int steps = sliderSteps(event, wheelRemainder);
+    if (steps == 0)
+        return QGroupBox::eventFilter(watched, event);
+    if (steps != INT_MIN)
+        emit stepped(steps);
+    return true;
+}
+
 void VolumeSlider::setValue(int newValue)
 {
     slider->setValue(newValue);
@@ -46,9 +46,26 @@ public:
      */
     void value(int &lValue, int &rValue) const;
 
+    /**
+     * \brief Get ticked state of mute checkboxes
+     *
+     * \param [out] lTicked  store state of left checkbox here
+     * \param [out] rTicked  store state of right checkbox here
+     */
+    void muteState(bool &lTicked, bool &rTicked) const;
+
 signals:
     void valueChanged(int lValue, int rValue);
     void muteStateChanged(bool lState, bool rState);
+    /**
+     * \brief Emitted instead of valueChanged when the sliders are moved with the arrow keys,
+     *        page up/down or the scroll wheel. The sliders themselves are not moved, the new
+     *        values come back from the server as a status.
+     *
+     * \param lStep  signed number of steps for the left channel
+     * \param rStep  signed number of steps for the right channel
+     */
+    void stepped(int lStep, int rStep);
 
 public slots:
     // These two slots are a bit of an ugly hack that can be used to force the valueChanged
@@ -60,7 +77,11 @@ public slots:
     /// \brief Set value of sliders. Will force-untick lockBox if lTick != rTick 
     void setMuteBoxes(bool lTicked, bool rTicked);
 
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
 private:
+    int wheelRemainder; //!< Scroll wheel delta not yet amounting to a whole step
     QSlider *lSlider;
     QSlider *rSlider;
     QCheckBox *lMuteBox;
@@ -79,10 +100,14 @@ public:
     VolumeSlider(const QString &title, QWidget *parent);
 
     int value() const;
+    /// \brief Get ticked state of mute checkbox
+    bool muteState() const;
 
 signals:
     void valueChanged(int newValue);
     void muteStateChanged(bool state);
+    /// \brief Slider moved by keys or scroll wheel, see LRVolumeSlider::stepped
+    void stepped(int step);
 
 public slots:
     /// \brief set value of slider
@@ -90,7 +115,11 @@ public slots:
     /// \brief set ticked state of mute checkbox
     void setMuteBox(bool ticked);
 
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
 private:
+    int wheelRemainder; //!< Scroll wheel delta not yet amounting to a whole step
     QSlider *slider;
     QCheckBox *muteBox;
 };
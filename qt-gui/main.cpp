@@ -2,11 +2,65 @@
 #include <QApplication>
 #include <QCommandLineParser>
 #include <QCommandLineOption>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <cstdio>
+#include <ctime>
 
 #include "window.h"
 
+/**
+ * Feed count statuses to window at one per intervalMs (like a fast polling UDP client, or
+ * several clients changing things), processing events in between so that everything gets
+ * painted. Done once applying every status right away (the old behaviour) and once through the
+ * frame-coalesced Window::setSliders. Prints the CPU time each took.
+ */
+static void benchmarkStatus(QApplication &app, Window *window, int count, int intervalMs)
+{
+    for (int coalesced = 0; coalesced < 2; ++coalesced)
+    {
+        Protocol::ServerStatus values = {
+            50, 50, 0, 0,
+            50, 50, 0, 0,
+            50, 50, 0, 0,
+            50, 0
+        };
+
+        app.processEvents();
+        std::clock_t cpuStart = std::clock();
+        QElapsedTimer wall;
+        wall.start();
+        for (int i = 0; i < count; ++i)
+        {
+            // Someone dragging the master slider, the rest unchanged
+            values.master = (i/2) % 100;
+            if (coalesced)
+                window->setSliders(values);
+            else
+                window->applyStatus(values, true);
+
+            do
+            {
+                app.processEvents(QEventLoop::AllEvents);
+                QThread::usleep(100);
+            } while (wall.elapsed() < (qint64)(i + 1)*intervalMs);
+        }
+        app.processEvents();
+        double cpuMs = 1000.0*(std::clock() - cpuStart)/CLOCKS_PER_SEC;
+
+        printf("%s: %d statuses in %lld ms, %.1f ms CPU (%.1f us/status)\n",
+               coalesced ? "coalesced" : "immediate", count, (long long)wall.elapsed(),
+               cpuMs, 1000.0*cpuMs/count);
+    }
+}
+
+
 int main(int argc, char **argv)
 {
+    QElapsedTimer startupClock; // For --startup-timing. Started before Qt is set up, it's part of startup too.
+    startupClock.start();
+
     QApplication app(argc, argv);
     QApplication::setApplicationName(argv[0]);
     QApplication::setApplicationVersion("0.2");
@@ -36,6 +90,32 @@ int main(int argc, char **argv)
         QApplication::translate("main", "How often to ping server for status updates (UDP protocol only)"),
         "ms", "2000");
     parser.addOption(updateIntervalOpt);
+    QCommandLineOption reliableOpt(
+        "reliable",
+        QApplication::translate("main", "Have the server acknowledge commands, resend lost ones (UDP protocol only)"));
+    parser.addOption(reliableOpt);
+    QCommandLineOption benchStatusOpt(
+        "bench-status",
+        QApplication::translate("main", "Benchmark applying <count> statuses to the GUI, then quit"),
+        "count");
+    parser.addOption(benchStatusOpt);
+    QCommandLineOption captureOpt(
+        "capture",
+        QApplication::translate("main", "Append everything sent to and received from the server to <file> (replay with vc-replay)"),
+        "file");
+    parser.addOption(captureOpt);
+    QCommandLineOption startupTimingOpt(
+        "startup-timing",
+        QApplication::translate("main", "Print how long startup takes, up to the first usable frame (live state shown)"));
+    parser.addOption(startupTimingOpt);
+    QCommandLineOption benchStartupOpt(
+        "bench-startup",
+        QApplication::translate("main", "Like --startup-timing, but quit once the first usable frame has been painted"));
+    parser.addOption(benchStartupOpt);
+    QCommandLineOption statsOpt(
+        "stats",
+        QApplication::translate("main", "Show the server's performance counters next to the link's (F2 toggles)"));
+    parser.addOption(statsOpt);
 
     parser.process(app);
 
@@ -55,22 +135,52 @@ int main(int argc, char **argv)
         protocol = new UdpProtocol(updateInterval);
     else
         protocol = new TcpProtocol();
+    protocol->setReliable(parser.isSet(reliableOpt));
+
+    SessionCapture capture;
+    if (parser.isSet(captureOpt))
+    {
+        QString description = QString("%1 %2").arg(QApplication::applicationName(), QApplication::applicationVersion());
+        if (!capture.open(parser.value(captureOpt).toLocal8Bit().constData(), description.toUtf8().constData()))
+            qFatal("Could not open capture file.");
+        protocol->setCapture(&capture);
+    }
+
+    if (args.length() > 2)
+        qFatal("Too many positional arguments.");
 
     bool portOk = true;
-    Window *window;
-    window = (args.length() == 0) ? new Window(protocol)                                           :
-             (args.length() == 1) ? new Window(protocol, args.at(0))                               :
-             (args.length() == 2) ? new Window(protocol, args.at(0), args.at(1).toUShort(&portOk)) : NULL;
+    quint16 port = (args.length() == 2) ? args.at(1).toUShort(&portOk) : 0;
 
     // TODO: stricter requirements here (check range) + toUShort feels ungood
     // when we actually are dealing with a quint16
     if (!portOk)
         qFatal("Port must be a positive integer.");
 
-    if (window == NULL)
-        qFatal("Too many positional arguments.");
+    // Socket I/O, logging and status parsing on a thread of their own, off the GUI thread.
+    // Stopped (disconnecting first) when main returns.
+    ProtocolThread network(protocol);
+
+    // After network, so that it goes first: saves the last live state and disconnects
+    Window window(&network);
+    if (parser.isSet(startupTimingOpt) || parser.isSet(benchStartupOpt))
+        window.traceStartup(&startupClock, parser.isSet(benchStartupOpt));
+
+    // Shows the last known state of the host right away, and connects in the background
+    if (args.length() == 2)
+        window.connectTo(args.at(0), port);
+    else if (args.length() == 1)
+        window.connectTo(args.at(0), Window::DEFAULT_PORT);
+
+    if (parser.isSet(statsOpt))
+        window.showStats(true);
+    window.show();
 
-    window->show();
+    if (parser.isSet(benchStatusOpt))
+    {
+        benchmarkStatus(app, &window, parser.value(benchStatusOpt).toInt(), 2);
+        return 0;
+    }
 
     return app.exec();
 }
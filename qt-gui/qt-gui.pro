@@ -4,7 +4,8 @@
 
 TEMPLATE = app
 TARGET = esp8266-vc-qt-gui
-INCLUDEPATH += .
+INCLUDEPATH += . ../core
+VPATH += ../core
 
 CONFIG += debug_and_release
 CONFIG += c++11
@@ -14,5 +15,9 @@ QT += widgets
 QT += network
 
 # Input
-HEADERS = window.h VolumeSlider.h ConnectionBox.h Protocol.h
-SOURCES = main.cpp window.cpp VolumeSlider.cpp ConnectionBox.cpp Protocol.cpp
+HEADERS = window.h VolumeSlider.h ConnectionBox.h Protocol.h ProtocolThread.h
+SOURCES = main.cpp window.cpp VolumeSlider.cpp ConnectionBox.cpp Protocol.cpp ProtocolThread.cpp
+
+# Protocol library shared with the command line tools (see ../core)
+HEADERS += Command.h Status.h SessionCapture.h ProtocolCore.h SpscQueue.h LatestValue.h
+SOURCES += Command.cpp Status.cpp SessionCapture.cpp ProtocolCore.cpp
@@ -9,11 +9,36 @@
 #include <QMessageBox>
 #include <QHBoxLayout>
 #include <QVBoxLayout>
+#include <QGuiApplication>
+#include <QScreen>
+#include <QKeyEvent>
+#include <QWheelEvent>
+#include <QPaintEvent>
+#include <QSettings>
+#include <QFontDatabase>
 
-static const quint16 DEFAULT_PORT = 1128;
+static const int STEP_MERGE_MS = 30; //!< How long to gather up steps before sending them
+static const int SAVE_STATUS_MS = 2000; //!< How long a status has to stay put before it is saved
+static const int STATS_INTERVAL_MS = 1000; //!< How often to ask the server for stats while they are shown
 
-Window::Window(Protocol *_protocol) :
-    protocol(_protocol)
+/// Where the last known status of each host is kept between runs
+static QString statusKey(const QString &hostLabel)
+{
+    return QString("lastStatus/%1").arg(hostLabel);
+}
+
+Window::Window(ProtocolThread *_protocol) :
+    pendingMasterSteps(0),
+    wheelRemainder(0),
+    statusPending(false),
+    protocol(_protocol),
+    stale(false),
+    haveLiveStatus(false),
+    liveStatus(),
+    startupClock(nullptr),
+    quitWhenUsable(false),
+    firstFramePainted(false),
+    awaitingUsableFrame(false)
 {
     using namespace std::placeholders;
 
@@ -25,6 +50,11 @@ Window::Window(Protocol *_protocol) :
 
     connectionBox = new ConnectionBox();
 
+    statsLabel = new QLabel(this);
+    statsLabel->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    statsLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
+    statsLabel->hide();
+
     QVBoxLayout *vLayout = new QVBoxLayout(this);
 
     QHBoxLayout *sliderLayout = new QHBoxLayout();
@@ -35,85 +65,292 @@ Window::Window(Protocol *_protocol) :
 
     vLayout->addWidget(connectionBox, Qt::AlignRight);
     vLayout->addLayout(sliderLayout);
+    vLayout->addWidget(statsLabel);
 
     this->setLayout(vLayout);
 
-    auto setVol = [this](const char *bothChan, // TODO: Make this into a traditional private slot? + use QSignalMapper
-                         const char *lChan,
-                         const char *rChan,
+    auto setVol = [this](Channel bothChan, // TODO: Make this into a traditional private slot? + use QSignalMapper
+                         Channel lChan,
+                         Channel rChan,
                          int lValue, int rValue) {
         // Optimize when both channels same value
         if (lValue == rValue) {
-            this->protocol->sendCmd("set", bothChan, lValue);
+            this->protocol->sendCmd(Command::Set, bothChan, lValue);
         } else {
-            this->protocol->sendCmd("set", lChan, lValue);
-            this->protocol->sendCmd("set", rChan, rValue);
+            this->protocol->sendCmd(Command::Set, lChan, lValue);
+            this->protocol->sendCmd(Command::Set, rChan, rValue);
         }
     };
-    connect(frontSlider,  &LRVolumeSlider::valueChanged, std::bind(setVol, "F",      "FL",  "FR",  _1, _2));
-    connect(censubSlider, &LRVolumeSlider::valueChanged, std::bind(setVol, "CENSUB", "CEN", "SUB", _1, _2));
-    connect(rearSlider,   &LRVolumeSlider::valueChanged, std::bind(setVol, "R",      "RL",  "RR",  _1, _2));
+    connect(frontSlider,  &LRVolumeSlider::valueChanged, std::bind(setVol, Channel::F,      Channel::FL,  Channel::FR,  _1, _2));
+    connect(censubSlider, &LRVolumeSlider::valueChanged, std::bind(setVol, Channel::CenSub, Channel::Cen, Channel::Sub, _1, _2));
+    connect(rearSlider,   &LRVolumeSlider::valueChanged, std::bind(setVol, Channel::R,      Channel::RL,  Channel::RR,  _1, _2));
 
-    auto setMute = [this](const char *bothChan,
-                          const char *lChan,
-                          const char *rChan,
+    auto setMute = [this](Channel bothChan,
+                          Channel lChan,
+                          Channel rChan,
                           bool lState, bool rState) {
         // Optimize for both channels, same value
         if (lState == rState) {
-            this->protocol->sendCmd("mutechan", bothChan, (int)lState);
+            this->protocol->sendCmd(Command::MuteChan, bothChan, (int)lState);
         } else {
-            this->protocol->sendCmd("mutechan", lChan, (int)lState);
-            this->protocol->sendCmd("mutechan", rChan, (int)rState);
+            this->protocol->sendCmd(Command::MuteChan, lChan, (int)lState);
+            this->protocol->sendCmd(Command::MuteChan, rChan, (int)rState);
         }
     };
-    connect(frontSlider,  &LRVolumeSlider::muteStateChanged, std::bind(setMute, "F",      "FL",  "FR",  _1, _2));
-    connect(censubSlider, &LRVolumeSlider::muteStateChanged, std::bind(setMute, "CENSUB", "CEN", "SUB", _1, _2));
-    connect(rearSlider,   &LRVolumeSlider::muteStateChanged, std::bind(setMute, "R",      "RL",  "RR",  _1, _2));
+    connect(frontSlider,  &LRVolumeSlider::muteStateChanged, std::bind(setMute, Channel::F,      Channel::FL,  Channel::FR,  _1, _2));
+    connect(censubSlider, &LRVolumeSlider::muteStateChanged, std::bind(setMute, Channel::CenSub, Channel::Cen, Channel::Sub, _1, _2));
+    connect(rearSlider,   &LRVolumeSlider::muteStateChanged, std::bind(setMute, Channel::R,      Channel::RL,  Channel::RR,  _1, _2));
 
-    connect(masterSlider, &VolumeSlider::valueChanged, [this](int level) { this->protocol->sendCmd("setmaster", level); });
-    connect(masterSlider, &VolumeSlider::muteStateChanged, [this](bool state) { this->protocol->sendCmd("mute", (int)state); });
+    // Keys and scroll wheel send relative steps instead of absolute levels, so that they work from
+    // whatever the level is on the server rather than what we last heard it was
+    auto step = [this](Channel bothChan,
+                       Channel lChan,
+                       Channel rChan,
+                       int lStep, int rStep) {
+        if (lStep == rStep) {
+            this->queueStep(bothChan, lStep);
+        } else {
+            if (lStep)
+                this->queueStep(lChan, lStep);
+            if (rStep)
+                this->queueStep(rChan, rStep);
+        }
+    };
+    connect(frontSlider,  &LRVolumeSlider::stepped, std::bind(step, Channel::F,      Channel::FL,  Channel::FR,  _1, _2));
+    connect(censubSlider, &LRVolumeSlider::stepped, std::bind(step, Channel::CenSub, Channel::Cen, Channel::Sub, _1, _2));
+    connect(rearSlider,   &LRVolumeSlider::stepped, std::bind(step, Channel::R,      Channel::RL,  Channel::RR,  _1, _2));
+    connect(masterSlider, &VolumeSlider::stepped, [this](int steps) { this->queueMasterStep(steps); });
+
+    connect(masterSlider, &VolumeSlider::valueChanged, [this](int level) { this->protocol->sendCmd(Command::SetMaster, level); });
+    connect(masterSlider, &VolumeSlider::muteStateChanged, [this](bool state) { this->protocol->sendCmd(Command::Mute, (int)state); });
 
     // Sliders disabled by default
     this->sliderDisable();
 
     // Set up ConnectionBox
     connectionBox->setValues("", DEFAULT_PORT);
-    connect(connectionBox, &ConnectionBox::connect,    protocol, &Protocol::serverConnect);
-    connect(connectionBox, &ConnectionBox::disconnect, protocol, &Protocol::serverDisconnect);
-
-    // Set up protocol (but don't connect to server just yet)
-    connect(protocol, &Protocol::disconnected, this, &Window::sliderDisable);
-    connect(protocol, &Protocol::connected,    this, &Window::sliderEnable);
-    connect(protocol, &Protocol::disconnected, connectionBox, &ConnectionBox::setDisconnected);
-    connect(protocol, &Protocol::connected,    connectionBox, &ConnectionBox::setConnected);
-    connect(protocol, &Protocol::disconnected, []() { qDebug() << "Disconnected"; });
-    connect(protocol, &Protocol::connected,    []() { qDebug() << "Connected"; });
-    connect(protocol, &Protocol::error, [this](const QString &errorString) {
+    connect(connectionBox, &ConnectionBox::connect,    this,     &Window::showCachedStatus);
+    connect(connectionBox, &ConnectionBox::connect,    protocol, &ProtocolThread::serverConnect);
+    connect(connectionBox, &ConnectionBox::disconnect, protocol, &ProtocolThread::serverDisconnect);
+
+    // Set up protocol (but don't connect to server just yet). The sliders are enabled by the
+    // first status after connecting (see applyPendingStatus), not by connecting as such, so that
+    // they never show anything but the live state while enabled.
+    connect(protocol, &ProtocolThread::disconnected, this, &Window::sliderDisable);
+    connect(protocol, &ProtocolThread::disconnected, this, &Window::connectionLost);
+    connect(protocol, &ProtocolThread::connected,    [this]() { this->startupMilestone("connected"); });
+    connect(protocol, &ProtocolThread::disconnected, connectionBox, &ConnectionBox::setDisconnected);
+    connect(protocol, &ProtocolThread::connected,    connectionBox, &ConnectionBox::setConnected);
+    connect(protocol, &ProtocolThread::disconnected, []() { qDebug() << "Disconnected"; });
+    connect(protocol, &ProtocolThread::connected,    []() { qDebug() << "Connected"; });
+    connect(protocol, &ProtocolThread::error, [this](const QString &errorString) {
             this->error(errorString);
             this->connectionBox->setDisconnected(); // Need to reset connectionBox on failure during connection and such
         });
-    connect(protocol, &Protocol::statusUpdate, this, &Window::setSliders);
+    // The status itself waits in the protocol's slot, taken by applyPendingStatus on the next frame
+    connect(protocol, &ProtocolThread::statusAvailable, [this]() {
+            if (!this->statusTimer->isActive())
+                this->statusTimer->start();
+        });
+    connect(protocol, &ProtocolThread::statsUpdate, this, &Window::updateStats);
+    connect(protocol, &ProtocolThread::error, [this](const QString &) {
+            // Most likely an older server that doesn't know stats. Don't keep asking it.
+            if (this->statsRequestClock.isValid())
+                this->showStats(false);
+        });
+
+    // Apply incoming statuses at most once per display frame
+    qreal refreshRate = QGuiApplication::primaryScreen() ? QGuiApplication::primaryScreen()->refreshRate() : 60.0;
+    statusTimer = new QTimer(this);
+    statusTimer->setSingleShot(true);
+    statusTimer->setInterval(qMax(1, qRound(1000.0 / (refreshRate > 0 ? refreshRate : 60.0))));
+    connect(statusTimer, &QTimer::timeout, this, &Window::applyPendingStatus);
+
+    stepTimer = new QTimer(this);
+    stepTimer->setSingleShot(true);
+    stepTimer->setInterval(STEP_MERGE_MS);
+    connect(stepTimer, &QTimer::timeout, this, &Window::flushSteps);
+
+    saveTimer = new QTimer(this);
+    saveTimer->setSingleShot(true);
+    saveTimer->setInterval(SAVE_STATUS_MS);
+    connect(saveTimer, &QTimer::timeout, this, &Window::saveStatus);
+
+    statsTimer = new QTimer(this);
+    statsTimer->setInterval(STATS_INTERVAL_MS);
+    connect(statsTimer, &QTimer::timeout, this, &Window::requestStats);
 }
 
-Window::Window(Protocol *_protocol, const QString &host) :
+Window::Window(ProtocolThread *_protocol, const QString &host) :
     Window(_protocol, host, DEFAULT_PORT)
 {
 }
 
-Window::Window(Protocol *_protocol, const QString &host, quint16 port) :
+Window::Window(ProtocolThread *_protocol, const QString &host, quint16 port) :
     Window(_protocol)
 {
-    connectionBox->setValues(host, port);
-    connectionBox->click();
+    connectTo(host, port);
 }
 
 Window::~Window()
 {
-    // Not really neccesary since sockets are closed on destruction (which Qt automates).
-    // Although we might want to be nice and send "byebye" to the server?
+    saveStatus(); // Changes since saveTimer last fired
+    // Be nice and send "byebye" to the server (the protocol thread is stopped after this)
     protocol->serverDisconnect();
 }
 
+void Window::connectTo(const QString &host, quint16 port)
+{
+    connectionBox->setValues(host, port);
+    connectionBox->click(); // Shows the cached status and starts connecting, see showCachedStatus
+}
+
+void Window::traceStartup(const QElapsedTimer *clock, bool _quitWhenUsable)
+{
+    startupClock = clock;
+    quitWhenUsable = _quitWhenUsable;
+    startupMilestone("window created");
+}
+
+void Window::startupMilestone(const char *what)
+{
+    if (!startupClock)
+        return;
+    printf("startup: %-20s %7.1f ms\n", what, startupClock->nsecsElapsed()/1e6);
+    fflush(stdout);
+}
+
+void Window::paintEvent(QPaintEvent *event)
+{
+    QWidget::paintEvent(event);
+    if (!startupClock)
+        return;
+
+    if (!firstFramePainted)
+    {
+        firstFramePainted = true;
+        startupMilestone("first frame");
+    }
+    if (awaitingUsableFrame)
+    {
+        awaitingUsableFrame = false;
+        startupMilestone("first usable frame");
+        startupClock = nullptr;
+        if (quitWhenUsable)
+            QMetaObject::invokeMethod(qApp, "quit", Qt::QueuedConnection);
+    }
+}
+
+void Window::showCachedStatus(const QString &host, quint16 port)
+{
+    // A status from the previous host still to be applied must not end up live (and saved) as
+    // this host's
+    statusTimer->stop();
+    statusPending = false;
+    Protocol::ServerStatus previous;
+    protocol->takeStatus(previous);
+    pendingStatus = Protocol::ServerStatus();
+
+    saveStatus(); // Whatever we were connected to before
+    hostLabel = QString("%1:%2").arg(host).arg(port);
+    haveLiveStatus = false;
+    sliderDisable();
+
+    QSettings settings("esp8266-volume-control", "qt-gui");
+    QByteArray cached = settings.value(statusKey(hostLabel)).toString().toLatin1();
+    Protocol::ServerStatus values;
+    if (cached.isEmpty() || !parseStatus(cached.constData(), cached.size(), values))
+    {
+        setStale(false);
+        return;
+    }
+
+    applyStatus(values, true);
+    setStale(true);
+    startupMilestone("cached state shown");
+}
+
+void Window::saveStatus()
+{
+    saveTimer->stop();
+    if (!haveLiveStatus || hostLabel.isEmpty())
+        return;
+
+    char text[128];
+    formatStatus(liveStatus, text, sizeof(text));
+    QSettings settings("esp8266-volume-control", "qt-gui");
+    settings.setValue(statusKey(hostLabel), QString::fromLatin1(text));
+}
+
+void Window::connectionLost()
+{
+    statusTimer->stop(); // A status still to be applied isn't live any more
+    statusPending = false;
+    saveStatus();
+    if (haveLiveStatus)
+        setStale(true); // What's shown is now just the last known state
+    haveLiveStatus = false;
+}
+
+void Window::showStats(bool show)
+{
+    statsLabel->setVisible(show);
+    if (!show) {
+        statsTimer->stop();
+        return;
+    }
+    statsLabel->setText(tr("Waiting for stats..."));
+    statsRequestClock.invalidate();
+    requestStats();
+    statsTimer->start();
+}
+
+void Window::requestStats()
+{
+    // One request out at a time, unless it got lost (UDP)
+    if (!protocol->isConnected() ||
+        (statsRequestClock.isValid() && statsRequestClock.elapsed() < 5*STATS_INTERVAL_MS))
+        return;
+    statsRequestClock.start();
+    protocol->sendCmd(Command::Stats);
+}
+
+void Window::updateStats(const DeviceStats &s)
+{
+    qint64 requestMs = statsRequestClock.isValid() ? statsRequestClock.elapsed() : -1;
+    statsRequestClock.invalidate();
+    if (statsLabel->isHidden())
+        return;
+
+    QString device = tr("server: up %1 s, loop %2/%3 us, %4 cmd/s (%5 total), push %6/%7 us, gc %8, free %9 (min %10)")
+        .arg(s.uptimeS).arg(s.loopAvgUs).arg(s.loopMaxUs).arg(s.commandsPerS).arg(s.commands)
+        .arg(s.pushAvgUs).arg(s.pushMaxUs).arg(s.gcRuns).arg(s.freeHeap).arg(s.freeHeapMin);
+    if (s.partial)
+        device += tr(" (partial)");
+    QString link = tr("link: stats %1 ms, rtt %2 ms, %3 pending, %4 resent")
+        .arg(requestMs).arg(protocol->roundTripTime(), 0, 'f', 1)
+        .arg(protocol->pendingReplies()).arg(protocol->retransmits());
+    statsLabel->setText(device + "\n" + link);
+}
+
+void Window::setStale(bool _stale)
+{
+    stale = _stale;
+    if (hostLabel.isEmpty())
+        setWindowTitle(QApplication::applicationName());
+    else if (stale)
+        setWindowTitle(tr("%1 - last known state, not connected").arg(hostLabel));
+    else
+        setWindowTitle(hostLabel);
+
+    // Disabled sliders are greyed out already, say why on hover
+    QString tip = stale ? tr("Last known state of %1").arg(hostLabel) : QString();
+    masterSlider->setToolTip(tip);
+    frontSlider->setToolTip(tip);
+    censubSlider->setToolTip(tip);
+    rearSlider->setToolTip(tip);
+}
+
 void Window::error(const QString& message)
 {
     QMessageBox mbox(
@@ -176,6 +413,54 @@ void Window::sliderEnable()
 }
 
 void Window::setSliders(const Protocol::ServerStatus &values)
+{
+    // Bursts of statuses (fast polling, several clients) would otherwise have us re-layout and
+    // repaint for every single one. Just remember the latest and apply it on the next frame.
+    pendingStatus = values;
+    statusPending = true;
+    if (!statusTimer->isActive())
+        statusTimer->start();
+}
+
+void Window::applyPendingStatus()
+{
+    // The latest from the network thread, if any (otherwise the one given to setSliders). Nothing
+    // at all if the slot was emptied in the meantime (disconnected).
+    bool fresh = protocol->takeStatus(pendingStatus) || statusPending;
+    statusPending = false;
+    if (!fresh)
+        return;
+    applyStatus(pendingStatus);
+
+    liveStatus = pendingStatus;
+    saveTimer->start();
+    if (!haveLiveStatus)
+    {
+        // First status since connecting: swap the cached state for the live one
+        haveLiveStatus = true;
+        setStale(false);
+        sliderEnable();
+        startupMilestone("first live status");
+        awaitingUsableFrame = true;
+        update();
+    }
+}
+
+/* Update an LRVolumeSlider, but only touch it if something actually changed */
+static void applyLR(LRVolumeSlider *slider, int lValue, int rValue, bool lMute, bool rMute, bool force)
+{
+    int lCur, rCur;
+    bool lMuteCur, rMuteCur;
+    slider->value(lCur, rCur);
+    slider->muteState(lMuteCur, rMuteCur);
+
+    if (force || lCur != lValue || rCur != rValue)
+        slider->setValues(lValue, rValue);
+    if (force || lMuteCur != lMute || rMuteCur != rMute)
+        slider->setMuteBoxes(lMute, rMute);
+}
+
+void Window::applyStatus(const Protocol::ServerStatus &values, bool force)
 {
     // We're just adjusting our sliders to server reality, don't send any signals
     QSignalBlocker
@@ -184,12 +469,94 @@ void Window::setSliders(const Protocol::ServerStatus &values)
         rearBlock(rearSlider),
         masterBlock(masterSlider);
 
-    frontSlider->setValues(values.fl_level, values.fr_level);
-    frontSlider->setMuteBoxes(values.fl_mute, values.fr_mute);
-    censubSlider->setValues(values.cen_level, values.sub_level); // NOTE: Argument order!
-    censubSlider->setMuteBoxes(values.cen_mute, values.sub_mute);
-    rearSlider->setValues(values.rl_level, values.rr_level);
-    rearSlider->setMuteBoxes(values.rl_mute, values.rr_mute);
-    masterSlider->setValue(values.master);
-    masterSlider->setMuteBox(values.global_mute);
+    applyLR(frontSlider, values.fl_level, values.fr_level, values.fl_mute, values.fr_mute, force);
+    applyLR(censubSlider, values.cen_level, values.sub_level, values.cen_mute, values.sub_mute, force); // NOTE: Argument order!
+    applyLR(rearSlider, values.rl_level, values.rr_level, values.rl_mute, values.rr_mute, force);
+    if (force || masterSlider->value() != values.master)
+        masterSlider->setValue(values.master);
+    if (force || masterSlider->muteState() != (bool)values.global_mute)
+        masterSlider->setMuteBox(values.global_mute);
+}
+
+void Window::queueStep(Channel chan, int step)
+{
+    pendingSteps[chan] += step;
+    if (!stepTimer->isActive())
+        stepTimer->start();
+}
+
+void Window::queueMasterStep(int step)
+{
+    pendingMasterSteps += step;
+    if (!stepTimer->isActive())
+        stepTimer->start();
+}
+
+void Window::flushSteps()
+{
+    bool sent = false;
+    for (auto it = pendingSteps.constBegin(); it != pendingSteps.constEnd(); ++it) {
+        if (it.value() == 0)
+            continue;           // Steps cancelled each other out
+        protocol->sendCmd(Command::Inc, it.key(), it.value());
+        sent = true;
+    }
+    if (pendingMasterSteps != 0) {
+        protocol->sendCmd(Command::IncMaster, pendingMasterSteps);
+        sent = true;
+    }
+    pendingSteps.clear();
+    pendingMasterSteps = 0;
+
+    // We don't know the resulting levels (the server clamps and accelerates), ask for them
+    if (sent)
+        protocol->sendCmd(Command::Status);
+}
+
+void Window::keyPressEvent(QKeyEvent *event)
+{
+    if (event->key() == Qt::Key_F2 && !event->isAutoRepeat()) {
+        showStats(statsLabel->isHidden());
+        return;
+    }
+
+    if (!masterSlider->isEnabled()) {
+        QWidget::keyPressEvent(event);
+        return;
+    }
+
+    // Media keys and +/- control master from anywhere in the window. Keys on a focused slider
+    // are already handled by the slider (see VolumeSlider::stepped).
+    switch (event->key()) {
+    case Qt::Key_VolumeUp:
+    case Qt::Key_Plus:
+        queueMasterStep(1);
+        break;
+    case Qt::Key_VolumeDown:
+    case Qt::Key_Minus:
+        queueMasterStep(-1);
+        break;
+    case Qt::Key_VolumeMute:
+        if (!event->isAutoRepeat())
+            masterSlider->setMuteBox(!masterSlider->muteState()); // Sends mute via muteStateChanged
+        break;
+    default:
+        QWidget::keyPressEvent(event);
+    }
+}
+
+void Window::wheelEvent(QWheelEvent *event)
+{
+    // Scrolling outside of the sliders steps master
+    if (!masterSlider->isEnabled()) {
+        QWidget::wheelEvent(event);
+        return;
+    }
+
+    wheelRemainder += event->angleDelta().y();
+    int steps = wheelRemainder / QWheelEvent::DefaultDeltasPerStep;
+    wheelRemainder %= QWheelEvent::DefaultDeltasPerStep;
+    if (steps)
+        queueMasterStep(steps);
+    event->accept();
 }
@@ -4,22 +4,38 @@
 #define __WINDOW_H
 
 #include <QWidget>
+#include <QTimer>
+#include <QMap>
+#include <QElapsedTimer>
+#include <QLabel>
 
 #include "VolumeSlider.h"
 #include "ConnectionBox.h"
-#include "Protocol.h"
+#include "ProtocolThread.h"
 
 class Window : public QWidget
 {
     Q_OBJECT
 
 public:
-    Window(Protocol *protocol);
-    Window(Protocol *protocol, const QString &host);
-    Window(Protocol *protocol, const QString &host, quint16 port);
+    static const quint16 DEFAULT_PORT = 1128;
+
+    Window(ProtocolThread *protocol);
+    Window(ProtocolThread *protocol, const QString &host);
+    Window(ProtocolThread *protocol, const QString &host, quint16 port);
     virtual ~Window();
 
+    /**
+     * \brief Print startup milestones (first frame, connected, first usable frame...) to stdout,
+     *        timed by clock (started when the program was). If quitWhenUsable, quit once the
+     *        first usable frame has been painted.
+     */
+    void traceStartup(const QElapsedTimer *clock, bool quitWhenUsable);
+
 public slots:
+    /// \brief Show the last known state of host, then connect to it in the background
+    void connectTo(const QString &host, quint16 port);
+
     void error(const QString &message);
     void error(const QString &message, const QString &details);
     void fatalError(const QString &details);
@@ -28,13 +44,79 @@ public slots:
     /// \brief Enables volume sliders
     void sliderEnable();
 
-    /// Set all sliders at once
+    /**
+     * \brief Set all sliders at once. Coalesced to at most one update per display frame, only
+     *        the latest status received during a frame gets applied.
+     */
     void setSliders(const Protocol::ServerStatus &values);
 
+    /**
+     * \brief Apply a status to the sliders right away. Widgets already showing the right values
+     *        are left alone, unless force is set.
+     */
+    void applyStatus(const Protocol::ServerStatus &values, bool force = false);
+
+    /**
+     * \brief Step a channel up or down. Steps coming in close together are merged and sent as a
+     *        single relative command.
+     */
+    void queueStep(Channel chan, int step);
+    /// \brief Step master up or down, see queueStep
+    void queueMasterStep(int step);
+
+    /**
+     * \brief Show (or hide) the performance counters of the server next to those of the link,
+     *        polled once a second while shown. Toggled with F2.
+     */
+    void showStats(bool show);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+    void keyPressEvent(QKeyEvent *event) override;
+    void wheelEvent(QWheelEvent *event) override;
+
+private slots:
+    void applyPendingStatus(); //!< Called by statusTimer
+    void flushSteps();         //!< Called by stepTimer
+    void saveStatus();         //!< Remember the last live status of the current host (see showCachedStatus)
+    /// \brief Apply the last status saved for host, greyed out as stale (called when connecting)
+    void showCachedStatus(const QString &host, quint16 port);
+    void connectionLost();     //!< Called when the protocol disconnects
+    void requestStats();       //!< Called by statsTimer
+    void updateStats(const DeviceStats &stats);
+
 private:
     ConnectionBox *connectionBox;
 
-    Protocol *protocol;
+    QTimer *stepTimer;                    //!< Started by the first queued step, sends them all when fired
+    QMap<Channel, int> pendingSteps;      //!< Channel -> merged steps not yet sent
+    int pendingMasterSteps;               //!< Merged master steps not yet sent
+    int wheelRemainder;                   //!< Scroll wheel delta not yet amounting to a whole step
+
+    QTimer *statusTimer;                  //!< Fires once per display frame while statuses come in
+    Protocol::ServerStatus pendingStatus; //!< Latest status received, applied by statusTimer
+    bool statusPending;                   //!< pendingStatus set by setSliders, not applied yet
+
+    ProtocolThread *protocol;
+
+    QString hostLabel;                    //!< "host:port" of the current server, empty if none yet
+    bool stale;                           //!< Sliders show the last known state, not the live one
+    bool haveLiveStatus;                  //!< A live status has been applied since connecting
+    Protocol::ServerStatus liveStatus;    //!< Last live status applied, saved by saveStatus
+    QTimer *saveTimer;                    //!< Saves liveStatus a while after it last changed
+
+    QLabel *statsLabel;                   //!< Server and link counters, see showStats
+    QTimer *statsTimer;                   //!< Polls the server for stats while statsLabel is shown
+    QElapsedTimer statsRequestClock;      //!< Started when stats is sent, for its round trip time
+
+    const QElapsedTimer *startupClock;    //!< Set by traceStartup, cleared once usable
+    bool quitWhenUsable;
+    bool firstFramePainted;
+    bool awaitingUsableFrame;             //!< Live state is up, next paint is the first usable frame
+    void startupMilestone(const char *what);
+
+    /// \brief Grey out the sliders and mark the window as showing cached state, or undo that
+    void setStale(bool stale);
 
     VolumeSlider *masterSlider;
     LRVolumeSlider *frontSlider;
@@ -1,58 +1,239 @@
 import sys
+import gc
 import usocket as socket
 import uerrno as errno
 import uselect as select
+import utime as time
 from volume_control import VolumeController
 
+try:
+    from micropython import const
+except ImportError:             # CPython
+    def const(x):
+        return x
+
+# Per-command debug prints ("got cmd" and the like). Printing costs
+# serial time on every command. With DEBUG = const(0) the compiler
+# (mpy-cross too) drops them from the code altogether.
+DEBUG = const(0)
+
 READ_ONLY = select.POLLIN | select.POLLHUP | select.POLLERR
 READ_WRITE = READ_ONLY | select.POLLOUT
 
+RXBUF_SIZE = 256
+
+# ---Command parsing helpers---
+#
+#  These work on (buf, start, end) triples directly, so that commands
+#  can be parsed straight out of a receive buffer without slicing or
+#  decoding it into strings first. Keywords are looked up by a hash of
+#  their bytes and then compared byte by byte.
+
+def token_hash(buf, start, end):
+    h = 0
+    for i in range(start, end):
+        h = (h*31 + buf[i]) & 0x3fffffff # stay within small int range
+    return h
+
+def token_eq(buf, start, end, name):
+    if end - start != len(name):
+        return False
+    for i in range(len(name)):
+        if buf[start + i] != name[i]:
+            return False
+    return True
+
+def parse_int(buf, start, end):
+    """Parse a (possibly negative) decimal integer in buf[start:end]"""
+    neg = buf[start] == 0x2d    # '-'
+    if neg:
+        start += 1
+    if start == end:
+        raise ValueError("bad integer")
+    value = 0
+    for i in range(start, end):
+        c = buf[i] - 0x30
+        if c < 0 or c > 9:
+            raise ValueError("bad integer")
+        value = value*10 + c
+    return -value if neg else value
+
+def make_token_table(entries):
+    """Build a lookup table keyed by token_hash from entries, an
+       iterable of tuples whose first element is the keyword."""
+    table = {}
+    for entry in entries:
+        name = entry[0]
+        key = token_hash(name, 0, len(name))
+        if key in table:
+            raise Exception("hash collision for {}".format(name))
+        table[key] = entry
+    return table
+
+def new_accel_run():
+    """The step run of a client that hasn't stepped anything yet:
+       [what, step, ticks_ms of the step, repeats] (see
+       VolumeServer._accelerate)"""
+    return [None, 0, 0, 0]
+
+_chan_table = make_token_table((bytes(name, 'ascii'), chan)
+                               for name, chan in VolumeController._chan_table.items())
+
+
+class ServerStats(object):
+    """Performance counters of the server loop, cheap enough to be
+       always on: a handful of integer updates per loop iteration and
+       one per command. Averages are moving averages (over the last 16
+       or so), so that nothing grows without bounds. The servers of a
+       MultiVolumeServer share one. See VolumeServer.stats_line."""
+
+    def __init__(self):
+        self.up_s = 0
+        self._up_ms = 0
+        self._last = time.ticks_ms()
+        self.loops = 0          # loop iterations
+        self.loop_avg_us = 0    # time spent in one (waiting in poll not counted)
+        self.loop_max_us = 0
+        self.commands = 0       # commands carried out
+        self.cps = 0            # commands/s over the last second or so
+        self._cps_ms = 0
+        self._cps_commands = 0
+        self.gc_runs = 0        # garbage collections seen
+        self.free = gc.mem_free()
+        self.free_min = self.free
+
+    def tick(self):
+        """Advance the uptime and the commands/s figure"""
+        now = time.ticks_ms()
+        elapsed = time.ticks_diff(now, self._last)
+        self._last = now
+        self._up_ms += elapsed
+        if self._up_ms >= 1000:
+            self.up_s += self._up_ms // 1000
+            self._up_ms %= 1000
+        self._cps_ms += elapsed
+        if self._cps_ms >= 1000:
+            self.cps = (self.commands - self._cps_commands)*1000 // self._cps_ms
+            self._cps_ms = 0
+            self._cps_commands = self.commands
+
+    def loop_done(self, start_us):
+        """Account for a loop iteration that started at start_us"""
+        us = time.ticks_diff(time.ticks_us(), start_us)
+        self.loops += 1
+        self.loop_avg_us += (us - self.loop_avg_us) >> 4
+        if us > self.loop_max_us:
+            self.loop_max_us = us
+        # MicroPython only ever gets memory back by collecting, so more
+        # free heap than last time means a collection ran in between
+        free = gc.mem_free()
+        if free > self.free:
+            self.gc_runs += 1
+        elif free < self.free_min:
+            self.free_min = free
+        self.free = free
+        self.tick()
+
+
 class VolumeServer(object):
     """Base class for the volume controller servers. Implements the
        commands used in the protocol.
     """
 
+    # Step acceleration for inc/incmaster (see _accelerate)
+    ACCEL_WINDOW_MS = 150
+    ACCEL_REPEATS = 4
+    ACCEL_MAX = 4
+
+    # Set to True to print how much heap handling each request used
+    # (measured with gc.mem_free() before and after)
+    heap_debug = False
+
+    # Apply everything that arrived in one loop iteration before
+    # pushing the levels to the pots once (see server_onestep). False
+    # pushes after every command, as before (see benchmark).
+    batch = True
+
     def __init__(self, vc=None):
         self.vc = vc or VolumeController()
+        self.stats = ServerStats()
+        self._tok_start = [0]*self.MAX_TOKENS
+        self._tok_end = [0]*self.MAX_TOKENS
+        # Step run (see _accelerate) of the client whose command is
+        # being carried out. Servers point it at that client's own.
+        self._accel = new_accel_run()
+
+    def _heap_mark(self):
+        return gc.mem_free() if self.heap_debug else 0
+
+    def _heap_report(self, mark, what):
+        if self.heap_debug:
+            print("{}: {} used {} bytes of heap".format(self.__qualname__, what, mark - gc.mem_free()))
 
     def _cmd_set(self, chan, level):
         """Command to set a channel.
            Usage: set <chan> <0-99>"""
-        schan, lr = self.vc.get_chan(chan)
-        self.vc.set_volume(schan, lr, int(level))
+        schan, lr = chan
+        self.vc.set_volume(schan, lr, level)
 
     def _cmd_setmaster(self, level):
         """Command to set master level.
            Usage: setmaster <0-99>"""
-        self.vc.set_master(int(level))
+        self.vc.set_master(level)
 
     def _cmd_mutechan(self, chan, state):
         """Command to mute/unmute a single channel
-           Usage: mute <chan> <0/1>"""
-        schan, lr = self.vc.get_chan(chan)
-        self.vc.set_mute(schan, lr, bool(int(state)))
+           Usage: mutechan <chan> <0/1>"""
+        schan, lr = chan
+        self.vc.set_mute(schan, lr, bool(state))
+
+    def _accelerate(self, what, step):
+        """Scale up a single step (+1 or -1) if it continues a run of
+           same-direction single steps of what (a channel tuple, or None
+           for master) that the same client sent less than
+           ACCEL_WINDOW_MS apart, i.e. a key being held down or a
+           scroll wheel being spun. The factor grows by one every
+           ACCEL_REPEATS steps, up to ACCEL_MAX. Larger steps are
+           carried out as they are and leave the run alone: the client
+           has picked the size itself (the GUI adds up the steps of
+           STEP_MERGE_MS, scaling those up again would compound)."""
+        if step != 1 and step != -1:
+            return step
+        run = self._accel
+        now = time.ticks_ms()
+        if (what == run[0] and step == run[1] and
+            time.ticks_diff(now, run[2]) < self.ACCEL_WINDOW_MS):
+            run[3] += 1
+        else:
+            run[3] = 0
+        run[0] = what
+        run[1] = step
+        run[2] = now
+        return step*min(1 + run[3] // self.ACCEL_REPEATS, self.ACCEL_MAX)
 
     def _cmd_inc(self, chan, step=1):
-        schan, lr = self.vc.get_chan(chan)
-        level = self.vc.get_volume(schan, lr)
-        if level < self.vc.MAX_LEVEL:
-            self.vc.set_volume(schan, lr, level + int(step))
+        """Command to step a channel up or down, clamping at the ends of
+           the range. Single steps repeated quickly are accelerated.
+           Usage: inc <chan> [<step>]   (step may be negative)"""
+        if step:
+            schan, lr = chan
+            self.vc.step_volume(schan, lr, self._accelerate(chan, step))
 
     def _cmd_incmaster(self, step=1):
-        level = self.vc.get_master()
-        if level < self.vc.MAX_LEVEL:
-            self.vc.set_master(level + int(step))
+        """Command to step master up or down, see inc.
+           Usage: incmaster [<step>]"""
+        if step:
+            self.vc.step_master(self._accelerate(None, step))
 
     def _cmd_mute(self, state):
         """Command to mute/unmute all channels.
            Usage: mute <0/1>"""
-        state = bool(int(state))
-        if state == False:
+        if not state:
             self.vc.unmute()
         else:
             self.vc.mute()
 
-    def _cmd_reset(self, state):
+    def _cmd_reset(self):
         """Command to reset VolumeController.
            Usage: reset"""
         self.vc.reset()
@@ -63,25 +244,174 @@ class VolumeServer(object):
         """
         pass
 
-    # Used by _process_cmd
+    def _cmd_byebye(self):
+        """End the connection. Handled by the connection oriented servers
+           (see the return value of process_cmd)."""
+        pass
+
+    def _cmd_subscribe(self, state):
+        """Ask to be sent status updates whenever the state changes, no
+           matter which client (or transport) changed it. Applied to
+           the sending client by the connection oriented servers.
+           Usage: subscribe <0/1>"""
+        self.subscribe_state = bool(state)
+
+    def _cmd_stats(self):
+        """Ask for the performance counters (see stats_line). Replied to
+           with those instead of the status, over every transport.
+           Usage: stats"""
+        pass
+
+    def stats_line(self, limit=None):
+        """The reply to stats, without a newline:
+
+           STATS up=<s> loops=<n> loop_us=<avg>/<max> cmds=<n> cps=<n>
+           pushes=<n> push_us=<avg>/<max> gc=<n> free=<bytes>/<min>
+
+           (on one line) with the uptime, loop iterations and the time
+           spent in one, commands carried out and commands/s, pushes to
+           the pots and the time one takes, garbage collections and
+           free heap. If the line would be longer than limit, whole
+           counters are left out from the end and it ends in partial=1
+           instead. Allocates, it's not on the fast path.
+        """
+        st = self.stats
+        vc = self.vc
+        st.tick()
+        fields = ("up={}".format(st.up_s), "loops={}".format(st.loops),
+                  "loop_us={}/{}".format(st.loop_avg_us, st.loop_max_us),
+                  "cmds={}".format(st.commands), "cps={}".format(st.cps),
+                  "pushes={}".format(vc.pushes),
+                  "push_us={}/{}".format(vc.push_avg_us, vc.push_max_us),
+                  "gc={}".format(st.gc_runs), "free={}/{}".format(st.free, st.free_min))
+        line = "STATS " + " ".join(fields)
+        if limit is not None and len(line) > limit:
+            n = len(fields)
+            while n > 0 and len("STATS " + " ".join(fields[:n]) + " partial=1") > limit:
+                n -= 1
+            line = "STATS " + " ".join(fields[:n] + ("partial=1",))
+        return bytes(line, 'ascii')
+
+    # Used by process_cmd. Entries are (name, handler, argument types,
+    # number of required arguments). Argument types are 'C' for a
+    # channel name (passed to the handler as a (<pot ID>, <L/R>) tuple)
+    # and 'I' for an integer.
     # TODO: make it easier for subclasses to redefine this?
-    _dispatch_table = {'set': _cmd_set,
-                       'setmaster': _cmd_setmaster,
-                       'inc': _cmd_inc,
-                       'incmaster': _cmd_incmaster,
-                       'status': _cmd_status,
-                       'mute': _cmd_mute,
-                       'mutechan': _cmd_mutechan,
-                       'reset': _cmd_reset}
-
-    def process_cmd(self, line):
-        line = line.strip()
-        if line:
-            banana = line.split()
-            cmd, args = banana[0], banana[1:]
-            self._dispatch_table[cmd](self, *args)
-
-    def server_init(self, timeout=None):
+    _commands = ((b'set',       _cmd_set,       'CI', 2),
+                 (b'setmaster', _cmd_setmaster, 'I',  1),
+                 (b'inc',       _cmd_inc,       'CI', 1),
+                 (b'incmaster', _cmd_incmaster, 'I',  0),
+                 (b'status',    _cmd_status,    '',   0),
+                 (b'mute',      _cmd_mute,      'I',  1),
+                 (b'mutechan',  _cmd_mutechan,  'CI', 2),
+                 (b'reset',     _cmd_reset,     '',   0),
+                 (b'byebye',    _cmd_byebye,    '',   0),
+                 (b'subscribe', _cmd_subscribe, 'I',  1),
+                 (b'stats',     _cmd_stats,     '',   0))
+
+    MAX_TOKENS = 4              # command + max number of arguments
+
+    def _tokenize(self, buf, start, end):
+        """Split buf[start:end] on whitespace. Token boundaries are stored
+           in self._tok_start/self._tok_end, returns the number of
+           tokens found."""
+        ntok = 0
+        i = start
+        while i < end:
+            while i < end and buf[i] <= 0x20: # skip whitespace/control chars
+                i += 1
+            if i == end:
+                break
+            if ntok == self.MAX_TOKENS:
+                raise TypeError("too many tokens")
+            self._tok_start[ntok] = i
+            while i < end and buf[i] > 0x20:
+                i += 1
+            self._tok_end[ntok] = i
+            ntok += 1
+        return ntok
+
+    def _arg(self, buf, n, argtype):
+        start = self._tok_start[n]
+        end = self._tok_end[n]
+        if argtype == 'I':
+            return parse_int(buf, start, end)
+        entry = _chan_table.get(token_hash(buf, start, end))
+        if entry is None or not token_eq(buf, start, end, entry[0]):
+            raise ValueError("bad channel")
+        return entry[1]
+
+    def process_cmd(self, buf, start=0, end=None):
+        """Parse and execute the command in buf[start:end]. buf can be
+           anything indexable as bytes (bytes, bytearray, memoryview).
+           The command is parsed in place, no strings are created on
+           the way.
+
+           Returns the name (bytes) of the command that was executed,
+           or None if the line was empty.
+
+           Raises KeyError for unknown commands, TypeError for the
+           wrong amount of arguments and ValueError for bad arguments.
+        """
+        if end is None:
+            end = len(buf)
+        ntok = self._tokenize(buf, start, end)
+        if ntok == 0:
+            return None
+
+        entry = _cmd_table.get(token_hash(buf, self._tok_start[0], self._tok_end[0]))
+        if entry is None or not token_eq(buf, self._tok_start[0], self._tok_end[0], entry[0]):
+            raise KeyError("no such command")
+        name, fn, argtypes, nreq = entry
+        nargs = ntok - 1
+        if nargs < nreq or nargs > len(argtypes):
+            raise TypeError("wrong amount of args")
+
+        # Call with a fixed number of arguments instead of building a
+        # tuple for *args
+        if nargs == 0:
+            fn(self)
+        elif nargs == 1:
+            fn(self, self._arg(buf, 1, argtypes[0]))
+        else:
+            fn(self, self._arg(buf, 1, argtypes[0]), self._arg(buf, 2, argtypes[1]))
+        self.stats.commands += 1
+        return name
+
+    # Commands carried out ahead of everything else received in the
+    # same loop iteration (see handle_priority), so that silencing the
+    # speakers never waits behind a burst of level changes
+    _priority_commands = (b'mute', b'mutechan')
+    # Commands that change the mute state themselves. A mute is never
+    # carried out ahead of one of these: sent after a reset, it has to
+    # end up applied after it too.
+    _barrier_commands = (b'reset',)
+
+    def _command_in(self, buf, start, end, names):
+        """Whether the command name in buf[start:end] is one of names"""
+        if end is None:
+            end = len(buf)
+        while start < end and buf[start] <= 0x20:
+            start += 1
+        i = start
+        while i < end and buf[i] > 0x20:
+            i += 1
+        for name in names:
+            if token_eq(buf, start, i, name):
+                return True
+        return False
+
+    def is_priority(self, buf, start=0, end=None):
+        """Whether buf[start:end] holds a high priority command. Only
+           the command name is looked at."""
+        return self._command_in(buf, start, end, self._priority_commands)
+
+    def is_barrier(self, buf, start=0, end=None):
+        """Whether buf[start:end] holds a command that high priority
+           commands received after it must not overtake"""
+        return self._command_in(buf, start, end, self._barrier_commands)
+
+    def server_init(self, timeout=None, poll=None):
         """Init the server.
 
         If timeout=None server_onestep will poll in blocking (regular)
@@ -90,19 +420,75 @@ class VolumeServer(object):
         there is one). If timeout > 0 server_onestep can timeout, and
         return without having taken any action.
 
+        poll is the poll object to register our sockets with. If None
+        a new one is created. Passing one in lets several servers
+        share a single event loop (see MultiVolumeServer).
+
         """
+        self.timeout = timeout
+        self.poll = poll or select.poll()
+
+    def handle(self, obj, event):
+        """Handle a poll event. Returns False if obj isn't one of ours."""
+        # This function is meant to be overriden in subclasses
+        return False
+
+    def handle_priority(self, obj, event):
+        """Called for every poll event before any of them are handled.
+           Servers that can peek at what arrived carry out high
+           priority commands (see is_priority) here, and leave
+           everything else (including replying in order) to handle.
+           Returns False if obj isn't one of ours."""
+        # This function is meant to be overriden in subclasses
+        return False
+
+    def housekeeping(self):
+        """Work done once per loop iteration, after all events have been
+           handled (timeouts, pushing state changes to clients etc.)"""
         # This function is meant to be overriden in subclasses
         pass
 
     def server_onestep(self):
         """Do one round of servery stuff (loop body). """
-        # This function is meant to be overriden in subclasses
-        pass
+        events = self.poll.poll(self._poll_timeout(self.timeout))
+        start = time.ticks_us()
+        # Read and apply everything first, then push the levels once:
+        # a burst of slider moves only matters for where it ends up.
+        # Replies go out after that (from housekeeping), so they never
+        # get ahead of the pots.
+        if self.batch:
+            self.vc.hold()
+        try:
+            # Mutes first, whichever client (or transport) they came from
+            for res in events:
+                self.handle_priority(res[0], res[1])
+            self.vc.flush()
+            for res in events:
+                #print("{}: poll: '{}'".format(self.__qualname__, res)) # DEBUG
+                self.handle(res[0], res[1]) # can't use deconstruction because length of res can vary throughout implementations
+        finally:
+            self.vc.release()
+        self.housekeeping()
+        self.stats.loop_done(start)
 
     def server_deinit(self):
         """Tie up any loose ends and close the server socket."""
         # This function is meant to be overriden in subclasses
-        pass
+        self.poll = None
+        # Don't lose the last changes to the write-behind delay
+        if self.vc.store.dirty:
+            self.vc.store.flush(self.vc)
+
+    def _poll_timeout(self, timeout):
+        """Shorten the poll timeout (ms, None = block) so that we wake up in
+           time for any background work the VolumeController has
+           pending (see VolumeController.idle)."""
+        idle = self.vc.idle_timeout()
+        if idle is None:
+            return timeout
+        if timeout is None or timeout < 0:
+            return idle
+        return min(timeout, idle)
 
     def server_loop(self):
         """Run a foreground, blocking, server loop"""
@@ -112,46 +498,102 @@ class VolumeServer(object):
         try:
             while True:
                 self.server_onestep()
+                self.vc.idle()
         finally:
             self.server_deinit()
 
 
-class TCPVolumeServer(VolumeServer):
-    """Implements a row-based (commands are delineated with newline)
-       textual TCP protocol with persistent connections.
-
-       The protocol is composed of plaintext ASCII commands delimited
-       by newlines. Arguments are separated by whitespace. The first
-       argument is the command to run while the following ones are its
-       arguments.
-
-       Unique features:
-          + Always responds with a status message to any command.
-          + Send 'byebye\n' to end connection (or just close your socket)
+_cmd_table = make_token_table(VolumeServer._commands)
+
+
+class TCPClient(object):
+    """Per-client state of the connection oriented servers: a receive
+       buffer holding any partial request, and a send queue that is
+       drained as the socket becomes writable."""
+
+    def __init__(self, sock, addr, rxbuf_size, txbuf_size):
+        self.sock = sock
+        self.addr = addr
+        self.rxbuf = bytearray(rxbuf_size)
+        self.rxview = memoryview(self.rxbuf)
+        self.rxlen = 0
+        self.txbuf = bytearray(txbuf_size)
+        self.txview = memoryview(self.txbuf)
+        self.txstart = 0        # first byte not yet sent
+        self.txend = 0          # end of queued data
+        self.stalled_since = None # ticks_ms when we last had queued data but could not send
+        self.closing = False    # close once the send queue is drained
+        self.discarding = False # skipping the rest of a too long line
+        self.eof = False        # the client closed its end (seen by StreamVolumeServer._read)
+        self.mask = READ_ONLY
+        self.subscribed = False # push state changes to this client
+        self.seen_version = -1  # VolumeController.version last sent to the client
+        self.longpoll = None    # HTTP: ticks_ms deadline of a pending long-poll
+        self.longpoll_close = False # HTTP: close the connection after the long-poll reply
+        self.accel = new_accel_run() # inc/incmaster steps of this client
+        self.backlog = False    # requests left in rxbuf for lack of room to reply (see StreamVolumeServer._client)
+
+    def tx_pending(self):
+        return self.txend - self.txstart
+
+    def tx_room(self):
+        return len(self.txbuf) - self.tx_pending()
+
+    def queue(self, data):
+        """Append data to the send queue. Callers check tx_room first."""
+        n = len(data)
+        if self.txend + n > len(self.txbuf):
+            # Move pending data to the front to make room
+            pending = self.tx_pending()
+            self.txview[0:pending] = self.txbuf[self.txstart:self.txend]
+            self.txstart = 0
+            self.txend = pending
+        self.txview[self.txend:self.txend + n] = data
+        self.txend += n
+
+
+class StreamVolumeServer(VolumeServer):
+    """Base class of the connection oriented (TCP) servers.
+
+       All client sockets are non-blocking. Each client has its own
+       receive buffer and send queue, so one slow client can never
+       stall the others: a client that doesn't read its replies just
+       stops getting its requests read once its send queue is full.
+       Subclasses implement the actual protocol in _process.
 
     """
 
-    def __init__(self, port, bindaddr="0.0.0.0", client_timeout=5.0):
-        """Create a TCPVolumeServer bound to port and bindaddr. client_timeout
-           is the amount of seconds to wait in client connections
-           before we deem the connection dead. Since client
-           communication is blocking (but listening for connecting
-           clients isn't) this needs to be a non-zero floating point
-           value, so that the server loop cannot be stalled by an
-           unresponsive client.
+    # A reply never gets longer than this. Reading from a client is
+    # paused while its send queue has less room than this. Enough for
+    # a stats line with every counter at 10 digits (187 bytes).
+    MAX_REPLY = 192
+
+    def __init__(self, port, bindaddr="0.0.0.0", client_timeout=5.0,
+                 rxbuf_size=RXBUF_SIZE, txbuf_size=512, vc=None):
+        """Create a server bound to port and bindaddr. client_timeout is
+           the amount of seconds a client may keep replies queued
+           without reading any of them before we deem the connection
+           dead. rxbuf_size/txbuf_size are the sizes of the per-client
+           receive buffer and send queue (the latter bounds how much
+           can be queued for a client that isn't reading).
         """
-        super().__init__()
+        super().__init__(vc)
         self.port = port
         self.bindaddr = bindaddr
-        self.client_timeout = client_timeout
-
-    def server_init(self, timeout=None):
-        self.timeout = timeout
+        self.client_timeout_ms = int(client_timeout*1000)
+        self.rxbuf_size = rxbuf_size
+        self.txbuf_size = max(txbuf_size, self.MAX_REPLY)
+        # Longest time spent handling a single client event (us).
+        # This is the bound on how long one client can delay the
+        # others.
+        self.max_client_us = 0
+
+    def server_init(self, timeout=None, poll=None):
+        super().server_init(timeout, poll)
         addr = socket.getaddrinfo(self.bindaddr, self.port)[0][-1]
         self.s = socket.socket()
         self.s.setblocking(False)        # non-blocking because we use polling
 
-        self.poll = select.poll()
         self.poll.register(self.s, READ_ONLY)
         # Keep a set of all clients so we can disconnect them properly
         # in case of a fatal error. We can't use set() because sockets
@@ -163,105 +605,346 @@ class TCPVolumeServer(VolumeServer):
 
         print("{}: listening on {} (timeout={})".format(self.__qualname__, addr, self.timeout))
 
-    def server_onestep(self):
-        for res in self.poll.poll(self.timeout):
-            #print("{}: poll: '{}'".format(self.__qualname__, res)) # DEBUG
-            obj = res[0]; event = res[1] # can't use deconstruction because length of res can vary throughout implementations
-
-            if id(obj) == id(self.s):
-                if event == select.POLLIN:
-                    cl, addr = self.s.accept()
-                    self.__add_client(cl, addr)
-                else:
-                    raise Exception("Unhandled poll combo: {} {}".format(obj, event))
+    def _poll_timeout(self, timeout):
+        # Wake up in time to kill stalled clients
+        for cl in self.clientset:
+            if cl.stalled_since is not None:
+                if timeout is None or timeout < 0 or timeout > self.client_timeout_ms:
+                    timeout = self.client_timeout_ms
+                break
+        return super()._poll_timeout(timeout)
+
+    def handle(self, obj, event):
+        if id(obj) == id(self.s):
+            if event == select.POLLIN:
+                sock, addr = self.s.accept()
+                self._add_client(sock, addr)
             else:
-                cl = obj
-                try:
-                    ret = self.__client(cl, event)
-                    if ret == False:
-                        print("{}: client {} disconnected".format(self.__qualname__, cl)) # DEBUG (remove later)
-                        self.__remove_client(cl)
-                except OSError as e:
-                    # TODO: Do we need to handle errno.ECONNRESET specially?
-                    # TODO: seems like we might need to handle NameError? (or is my code just buggy?)
-                    if e.errno == errno.ETIMEDOUT:
-                        print("ERROR: communication with client {} timed out. Killing client.".format(cl))
-                        sys.print_exception(e)
-                        self.__remove_client(cl)
-                    else:
-                        print("ERROR: Got", e)
-                        sys.print_exception(e)
+                raise Exception("Unhandled poll combo: {} {}".format(obj, event))
+            return True
+
+        cl = self._find_client(obj)
+        if cl is None:
+            return False
+        start = time.ticks_us()
+        mark = self._heap_mark()
+        try:
+            ret = self._client(cl, event)
+        except OSError as e:
+            # TODO: Do we need to handle errno.ECONNRESET specially?
+            print("ERROR: Got", e)
+            sys.print_exception(e)
+            ret = False
+        self._heap_report(mark, "request")
+        if ret == False:
+            if DEBUG:
+                print("{}: client {} disconnected".format(self.__qualname__, cl.addr))
+            self._remove_client(cl)
+        else:
+            self._update_mask(cl)
+        elapsed = time.ticks_diff(time.ticks_us(), start)
+        if elapsed > self.max_client_us:
+            self.max_client_us = elapsed
+            if DEBUG:
+                print("{}: new max time for one client event: {} us".format(self.__qualname__, elapsed))
+        return True
+
+    def housekeeping(self):
+        for i in range(len(self.clientset) - 1, -1, -1):
+            cl = self.clientset[i]
+            if cl.tx_pending():
+                self._push(cl)  # replies held back by handle
+        self._kill_stalled_clients()
 
     def server_deinit(self):
         for cl in self.clientset:
-            cl.close()
+            cl.sock.close()
         self.s.close()
 
         self.clientset = None
         self.s = None
-        self.poll = None
+        super().server_deinit()
 
-    def __add_client(self, cl, addr):
+    def _find_client(self, sock):
+        for cl in self.clientset:
+            if id(cl.sock) == id(sock):
+                return cl
+        return None
+
+    def _add_client(self, sock, addr):
         """Handles accepting a new client"""
-        # TODO: store addr (associated with cl) for nicer debug printouts etc
-        cl.setblocking(True) # Needed for reliable writing?
-        if sys.platform != 'linux':
-            # linux port of micropython doesn't support settimeout,
-            # but we want to be able to run the server on linux when debugging
-            cl.settimeout(self.client_timeout)
+        sock.setblocking(False)
         print('{}: client connected from {}'.format(self.__qualname__, addr))
-        self.poll.register(cl, READ_ONLY)
+        cl = TCPClient(sock, addr, self.rxbuf_size, self.txbuf_size)
+        self.poll.register(sock, cl.mask)
         self.clientset.append(cl)
 
-    def __remove_client(self, cl):
+    def handle_priority(self, obj, event):
+        cl = None if id(obj) == id(self.s) else self._find_client(obj)
+        if cl is None:
+            return False
+        if (event & select.POLLIN and not event & (select.POLLHUP | select.POLLERR) and
+            not cl.closing):
+            try:
+                self._read(cl)
+            except OSError:
+                return True     # _client runs into it again and deals with it
+            self._process_priority(cl)
+        return True
+
+    def _remove_client(self, cl):
         """Handles when a client disconnects"""
-        self.poll.unregister(cl)
+        self.poll.unregister(cl.sock)
         self.clientset.remove(cl)
-        cl.close()
-
-    def __client(self, cl, event):
-        """Handles a single message (receive, execute, reply) from a client.
+        cl.sock.close()
+
+    def _kill_stalled_clients(self):
+        now = time.ticks_ms()
+        for i in range(len(self.clientset) - 1, -1, -1): # backwards, since we remove while iterating
+            cl = self.clientset[i]
+            if (cl.stalled_since is not None and
+                time.ticks_diff(now, cl.stalled_since) > self.client_timeout_ms):
+                print("ERROR: client {} hasn't read its replies for {} ms. Killing client.".format(cl.addr, self.client_timeout_ms))
+                self._remove_client(cl)
+
+    def _has_room(self, cl):
+        """Whether there is room to queue the reply to another request"""
+        return cl.tx_room() >= self.MAX_REPLY
+
+    def _update_mask(self, cl):
+        """Only poll for what the client can make progress on. Reads are
+           paused while the send queue is too full to take another
+           reply (backpressure)."""
+        mask = READ_ONLY
+        if cl.closing or not self._has_room(cl) or cl.rxlen == len(cl.rxbuf):
+            mask = select.POLLHUP | select.POLLERR
+        if cl.tx_pending() or (cl.backlog and not cl.closing and self._has_room(cl)):
+            mask |= select.POLLOUT # the latter only to get back to the backlog
+        if mask != cl.mask:
+            cl.mask = mask
+            self.poll.modify(cl.sock, mask)
+
+    def _client(self, cl, event):
+        """Handles a poll event for a client: sends as much of its send
+           queue as the socket takes, reads whatever is available and
+           hands it to _process. Never blocks.
            Returns False for client disconnection, True otherwise.
         """
 
-        # TODO: handle POLLERR?
-        if event == select.POLLHUP:
-            print("{},{}: got POLLHUP".format(self.__qualname__, cl)) # DEBUG
+        if event & (select.POLLHUP | select.POLLERR):
+            if DEBUG:
+                print("{},{}: got POLLHUP/POLLERR".format(self.__qualname__, cl.addr))
             return False
 
-        def send_string(string):
-            val = bytearray(string)
-            val.extend(b'\n')
-            cl.write(val)
-
-        def send_error_msg(msg):
-            print("ERROR:",msg)
-            send_string("ERROR " + msg)
+        if event & select.POLLOUT:
+            self._flush(cl)
 
-        line = cl.readline().decode('ascii') # TODO: don't decode bytestring for efficiency
-        print("{},{}: got cmd '{}'".format(self.__qualname__, cl, line.rstrip())) # DEBUG (remove later)
-
-        if not line or line == '\r\n' or line == '\n':
+        if event & select.POLLIN and not cl.closing:
+            self._read(cl)
+        if cl.eof:
             return False
-        if line[:6] == 'byebye': # TODO: use bytestring + memoryview
-            send_string("CYA")
+
+        while True:
+            rxlen = cl.rxlen
+            self._process(cl)
+            if cl.tx_pending() and not self.batch:
+                self._flush(cl) # try right away, saves a round through poll
+            # _process stops when the send queue fills up. If the flush
+            # made room again go on with the requests still buffered,
+            # there won't be another POLLIN for them. When batching
+            # nothing is sent before housekeeping, after the levels
+            # have been pushed, so that no reply gets ahead of the
+            # pots. The requests left over then wait for the POLLOUT
+            # _update_mask asks for once there is room again.
+            if (cl.closing or cl.rxlen == 0 or cl.rxlen == rxlen or
+                not self._has_room(cl)):
+                break
+        cl.backlog = cl.rxlen > 0 and not self._has_room(cl)
+        if cl.closing and not cl.tx_pending():
             return False
+        return True
 
+    def _read(self, cl):
+        """Read whatever the socket has for us into cl.rxbuf, as far as
+           it fits. Sets cl.eof when the client has closed its end."""
+        if cl.eof or cl.rxlen == len(cl.rxbuf):
+            return
         try:
-            self.process_cmd(line)
+            n = cl.sock.readinto(cl.rxview[cl.rxlen:])
+        except OSError as e:
+            if e.args[0] != errno.EAGAIN:
+                raise
+            n = None
+        if n == 0:
+            cl.eof = True
+        elif n:
+            cl.rxlen += n
+
+    def _process(self, cl):
+        """Handle whatever complete requests there are in cl.rxbuf, and
+           remove them from it."""
+        # This function is meant to be overriden in subclasses
+        pass
+
+    def _process_priority(self, cl):
+        """Carry out the high priority requests in cl.rxbuf right away
+           (see VolumeServer.handle_priority), leaving them for
+           _process to reply to."""
+        # This function is meant to be overriden in subclasses
+        pass
+
+    def _consume(self, cl, n):
+        """Remove the first n bytes of the receive buffer"""
+        remaining = cl.rxlen - n
+        if remaining > 0:
+            cl.rxview[0:remaining] = cl.rxbuf[n:cl.rxlen]
+        cl.rxlen = max(0, remaining)
+
+    def _flush(self, cl):
+        """Send as much of the send queue as the socket will take"""
+        try:
+            n = cl.sock.write(cl.txview[cl.txstart:cl.txend])
+        except OSError as e:
+            if e.args[0] != errno.EAGAIN:
+                raise
+            n = None
+        if n:
+            cl.txstart += n
+        if cl.txstart == cl.txend:
+            cl.txstart = cl.txend = 0
+            cl.stalled_since = None
+        elif n:
+            cl.stalled_since = time.ticks_ms() # made progress, restart the clock
+        elif cl.stalled_since is None:
+            cl.stalled_since = time.ticks_ms()
+
+    def _push(self, cl):
+        """Try to send data queued outside of the normal request/reply
+           cycle (from housekeeping) right away. Removes the client if
+           it was closing and everything got sent, so callers
+           iterating over clientset need to iterate backwards."""
+        self._flush(cl)
+        if cl.closing and not cl.tx_pending():
+            self._remove_client(cl)
+        else:
+            self._update_mask(cl)
+
+
+class TCPVolumeServer(StreamVolumeServer):
+    """Implements a row-based (commands are delineated with newline)
+       textual TCP protocol with persistent connections.
+
+       The protocol is composed of plaintext ASCII commands delimited
+       by newlines. Arguments are separated by whitespace. The first
+       argument is the command to run while the following ones are its
+       arguments.
+
+       Unique features:
+          + Always responds with a status message to any command.
+          + Send 'byebye\n' to end connection (or just close your socket)
+          + Send 'subscribe 1\n' to be sent 'STATUS <status>\n' lines
+            whenever the state is changed by someone else (another
+            client, or another transport)
+
+    """
+
+    def housekeeping(self):
+        super().housekeeping()
+        version = self.vc.version
+        for i in range(len(self.clientset) - 1, -1, -1):
+            cl = self.clientset[i]
+            if (cl.subscribed and cl.seen_version != version and
+                self._has_room(cl)):
+                cl.queue(b'STATUS ')
+                cl.queue(self.vc.get_status_body())
+                cl.seen_version = version
+                self._push(cl)
+
+    def _process(self, cl):
+        start = 0
+        i = 0
+        while i < cl.rxlen and not cl.closing and self._has_room(cl):
+            if cl.rxbuf[i] != 0x0a:
+                i += 1
+                continue
+            if cl.discarding:
+                cl.discarding = False
+            else:
+                if DEBUG:
+                    print("{},{}: got cmd {}".format(self.__qualname__, cl.addr, bytes(cl.rxview[start:i])))
+                self.__execute(cl, start, i)
+            i += 1
+            start = i
+
+        # Keep any partial (or not yet processed) line for later
+        if start > 0:
+            self._consume(cl, start)
+        if cl.rxlen == len(cl.rxbuf) and start == 0 and i == cl.rxlen:
+            if not cl.discarding:
+                self.__send_error(cl, "line too long")
+                cl.discarding = True
+            cl.rxlen = 0
+
+    def _process_priority(self, cl):
+        start = 0
+        skip = cl.discarding    # the first line is the rest of a too long one
+        for i in range(cl.rxlen):
+            if cl.rxbuf[i] != 0x0a:
+                continue
+            if not skip and self.is_barrier(cl.rxbuf, start, i):
+                break       # the mutes after it run in order, from _process
+            if not skip and self.is_priority(cl.rxbuf, start, i):
+                try:
+                    self.process_cmd(cl.rxbuf, start, i)
+                except (TypeError, KeyError, ValueError):
+                    pass    # left as it is, so _process reports the error in order
+                else:
+                    if DEBUG:
+                        print("{},{}: priority cmd {}".format(self.__qualname__, cl.addr, bytes(cl.rxview[start:i])))
+                    # Done. Turn it into a status (padded with spaces,
+                    # a valid mute is never shorter) so that _process
+                    # still replies to it in its place.
+                    cl.rxview[start:start + 6] = b'status'
+                    for j in range(start + 6, i):
+                        cl.rxbuf[j] = 0x20
+                    # One line, one command: that status counts for it
+                    self.stats.commands -= 1
+            skip = False
+            start = i + 1
+
+    def __execute(self, cl, start, end):
+        self._accel = cl.accel
+        try:
+            cmd = self.process_cmd(cl.rxbuf, start, end)
         except TypeError as e:
-            send_error_msg("wrong amount of args")
+            self.__send_error(cl, "wrong amount of args")
             sys.print_exception(e)
         except KeyError as e:
-            send_error_msg("no such command")
+            self.__send_error(cl, "no such command")
             sys.print_exception(e)
         except ValueError as e:
-            send_error_msg("bad argument: " + str(e))
+            self.__send_error(cl, "bad argument: " + str(e))
             sys.print_exception(e)
         else:
-            send_string("OK " + self.vc.get_status_string()) # TODO: inform all clients of the state change
+            if cmd is None:
+                cl.closing = True
+            elif cmd == b'byebye':
+                cl.queue(b'CYA\n')
+                cl.closing = True
+            elif cmd == b'stats':
+                cl.queue(self.stats_line(self.MAX_REPLY - 1))
+                cl.queue(b'\n')
+            else:
+                if cmd == b'subscribe':
+                    cl.subscribed = self.subscribe_state
+                cl.queue(self.vc.get_status_bytes())
+                cl.seen_version = self.vc.version # the reply is as good as a push
 
-        return True
+    def __send_error(self, cl, msg):
+        print("ERROR:", msg)
+        cl.queue(b'ERROR ')
+        cl.queue(bytes(msg[:self.MAX_REPLY - 8], 'ascii'))
+        cl.queue(b'\n')
 
 
 class UDPVolumeServer(VolumeServer):
@@ -273,76 +956,586 @@ class UDPVolumeServer(VolumeServer):
     protocol. Clients will have to poll the server for its state to
     keep up to date. No confirmation is returned for normal commands.
 
+    Optionally reliable: a command sent as '@<seq> <base> <command>'
+    is acknowledged with 'ACK <cum> <mask>', saying that everything up
+    to sequence number cum has arrived, as has cum+1+i for every bit i
+    set in mask. The client resends what isn't acknowledged. Resends
+    of a command that already arrived (its ack got lost) are
+    acknowledged again but not carried out again. base tells that the
+    client doesn't care about anything before it any more (it was
+    acknowledged, or superseded by a newer value), so that cum moves
+    on past commands that will never come, and late copies of them
+    are ignored.
+
+    Commands are carried out in sequence order, not as they arrive:
+    one that overtook an earlier one (reordered, or the earlier one
+    was lost) is acknowledged but held back until cum reaches it.
+    Otherwise a late 'set F 10' would undo the 'set FL 50' sent after
+    it, and a late mute the reset after it. A gap that isn't filled
+    within HOLD_MS (the client gave up on it, or went away) is skipped.
+
     """
-    def __init__(self, port, bindaddr="0.0.0.0"):
-        super().__init__()
+
+    ACK_WINDOW = 30     # bits in the ack mask, keeps it a small int
+    SEQ_RESYNC = 1024   # a sequence number this far off starts a new session
+    MAX_PEERS = 4       # clients whose sequence numbers are kept track of
+    HOLD_MS = 2000      # longest a command waits for the ones before it
+
+    def __init__(self, port, bindaddr="0.0.0.0", vc=None):
+        super().__init__(vc)
         self.port = port
         self.bindaddr = bindaddr
+        self._peers = []        # [addr, cum, mask, held, hold_until], most recently
+                                # heard from first. held: seq -> (data, start) of
+                                # commands waiting for cum, until hold_until (ticks)
+        self._accels = []       # [addr, step run] (see _accelerate), most recently
+                                # heard from first
 
-    def server_init(self, timeout=None):
+    def server_init(self, timeout=None, poll=None):
         """Init the server."""
+        super().server_init(timeout, poll)
 
         self.s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
         addr = socket.getaddrinfo(self.bindaddr, self.port)[0][-1]
         self.s.bind(addr)
-        if sys.platform != 'linux':
-            # linux port of micropython doesn't support settimeout,
-            # but we want to be able to run the server on linux when debugging
-            self.s.settimeout(timeout) # set blocking/timeout mode
+
+        # Poll instead of relying on settimeout, so that we can wake
+        # up for background work in between datagrams (and because
+        # the linux port of micropython doesn't support settimeout)
+        self.s.setblocking(False)
+        self.poll.register(self.s, select.POLLIN)
+        self._deferred = []     # (data, addr) read by handle_priority, for handle
 
         print("{}: bound UDP socket to {}".format(self.__qualname__, addr)) # DEBUG
 
-    def server_onestep(self):
-        data, addr = self.s.recvfrom(256)
-        print("{}: received {} from {}".format(self.__qualname__, repr(data), addr))
+    # Most datagrams read ahead per loop iteration by handle_priority
+    MAX_BATCH = 8
 
-        def send_string(string):
-            self.s.sendto(bytes(string, 'ascii'), addr)
+    def handle_priority(self, obj, event):
+        if id(obj) != id(self.s):
+            return False
+        # Read what has arrived. Mutes are carried out right away, the
+        # rest waits for handle. Once a reset is waiting, so does
+        # everything after it.
+        barrier = False
+        while len(self._deferred) < self.MAX_BATCH:
+            dgram = self.__recv()
+            if dgram is None:
+                break
+            start = self.__command_start(dgram[0])
+            barrier = barrier or self.is_barrier(dgram[0], start)
+            if not barrier and self.is_priority(dgram[0], start):
+                self.__request(dgram[0], dgram[1])
+            else:
+                self._deferred.append(dgram)
+        return True
 
-        def send_error_msg(msg):
-            print("ERROR:",msg)
-            send_string("ERROR " + msg)
+    def handle(self, obj, event):
+        if id(obj) != id(self.s):
+            return False
+        if not self._deferred:
+            dgram = self.__recv()
+            if dgram is not None:
+                self._deferred.append(dgram)
+        for dgram in self._deferred:
+            self.__request(dgram[0], dgram[1])
+        del self._deferred[:]
+        return True
 
+    def __recv(self):
+        """One datagram as (data, addr), None if there is none"""
+        try:
+            return self.s.recvfrom(RXBUF_SIZE)
+        except OSError as e:
+            if e.args[0] != errno.EAGAIN:
+                raise
+            return None
+
+    def __request(self, data, addr):
+        mark = self._heap_mark()
+        if DEBUG:
+            print("{}: received {} from {}".format(self.__qualname__, repr(data), addr))
+
+        peer = None
+        start = 0
+        if len(data) > 0 and data[0] == 0x40: # '@', reliable mode
+            try:
+                seq, base, start = self.__parse_header(data)
+            except ValueError as e:
+                self.__send_error("bad argument: " + str(e), addr)
+            else:
+                peer = self.__peer(addr, base)
+                if not self.__sequence(peer, seq, base, data, start):
+                    if DEBUG:
+                        print("{}: duplicate {}".format(self.__qualname__, seq))
+                self.s.sendto(bytes("ACK {} {}".format(peer[1], peer[2]), 'ascii'), addr)
+        else:
+            self.__execute(data, 0, addr)
+
+        self._heap_report(mark, "request")
+
+    def __execute(self, data, start, addr):
         # Notably the UDP protocol only replies if a command fails
         # (useful when debugging a faulty client) or if a status
         # message has been explicitly requested.
 
+        # The datagram is parsed as is. (MicroPython has no
+        # recvfrom_into, so recvfrom is the one allocation left here.)
+        self._accel = self.__accel_run(addr)
         try:
-            self.process_cmd(data.decode('ascii'))
+            cmd = self.process_cmd(data, start)
         except TypeError as e:
-            send_error_msg("wrong amount of args")
+            self.__send_error("wrong amount of args", addr)
             sys.print_exception(e)
         except KeyError as e:
-            send_error_msg("no such command")
+            self.__send_error("no such command", addr)
             sys.print_exception(e)
         except ValueError as e:
-            send_error_msg("bad argument: " + str(e))
+            self.__send_error("bad argument: " + str(e), addr)
             sys.print_exception(e)
+        else:
+            if cmd == b'status':
+                self.s.sendto(self.vc.get_status_bytes(newline=False), addr)
+            elif cmd == b'stats':
+                self.s.sendto(self.stats_line(), addr)
+
+    def __parse_header(self, data):
+        """Parse the '@<seq> <base> ' in front of a reliable mode
+           command. Returns (seq, base, where the command starts)."""
+        i = 1
+        end = len(data)
+        seq = None
+        while True:
+            start = i
+            while i < end and data[i] > 0x20:
+                i += 1
+            if i == start:
+                raise ValueError("bad sequence header")
+            value = parse_int(data, start, i)
+            while i < end and data[i] <= 0x20:
+                i += 1
+            if seq is not None:
+                return seq, value, i
+            seq = value
+
+    def __command_start(self, data):
+        """Where the command in data starts (after any reliable mode
+           header)"""
+        if len(data) > 0 and data[0] == 0x40:
+            try:
+                return self.__parse_header(data)[2]
+            except ValueError:
+                pass
+        return 0
+
+    def __peer(self, addr, base):
+        """The sequence state of the client at addr (see the class
+           docstring), created for a client not heard from before"""
+        peers = self._peers
+        for i in range(len(peers)):
+            if peers[i][0] == addr:
+                peer = peers[i]
+                if i > 0:
+                    del peers[i]
+                    peers.insert(0, peer)
+                return peer
+        peer = [addr, base - 1, 0, {}, None]
+        peers.insert(0, peer)
+        del peers[self.MAX_PEERS:]
+        return peer
+
+    def __accel_run(self, addr):
+        """The step run of the client at addr, kept for the MAX_PEERS
+           clients heard from last"""
+        accels = self._accels
+        for i in range(len(accels)):
+            if accels[i][0] == addr:
+                entry = accels[i]
+                if i > 0:
+                    del accels[i]
+                    accels.insert(0, entry)
+                return entry[1]
+        entry = [addr, new_accel_run()]
+        accels.insert(0, entry)
+        del accels[self.MAX_PEERS:]
+        return entry[1]
+
+    def __sequence(self, peer, seq, base, data, start):
+        """Note the arrival of seq from peer, and carry out (in order)
+           whatever that, or base, lets through: the command itself if
+           it was next, and those that arrived ahead of it. Returns
+           False if it has arrived before (or is older than base)."""
+        cum = peer[1]
+        mask = peer[2]
+        held = peer[3]
+        if seq - cum > self.SEQ_RESYNC or cum - seq > self.SEQ_RESYNC:
+            cum = base - 1      # the client started over
+            mask = 0
+            held.clear()
+            peer[4] = None
+        if base - 1 > cum:
+            mask >>= base - 1 - cum
+            cum = base - 1
+        bit = seq - cum - 1
+        if bit < 0 or (mask >> bit) & 1:
+            peer[1] = cum
+            peer[2] = mask
+            self.__release(peer, cum)   # base may have let some through
+            return False
+        if bit >= self.ACK_WINDOW:
+            # Too far ahead, give up on the oldest ones missing
+            mask >>= bit - self.ACK_WINDOW + 1
+            cum += bit - self.ACK_WINDOW + 1
+            bit = self.ACK_WINDOW - 1
+        mask |= 1 << bit
+        while mask & 1:
+            mask >>= 1
+            cum += 1
+        peer[1] = cum
+        peer[2] = mask
+        if bit == 0 and not held:
+            self.__execute(data, start, peer[0]) # in order, the usual case
+        else:
+            if not held:
+                peer[4] = time.ticks_add(time.ticks_ms(), self.HOLD_MS)
+            held[seq] = (data, start)
+            self.__release(peer, cum)
+        return True
 
-        if "status" in data:
-            send_string("OK " + self.vc.get_status_string())
+    def __release(self, peer, cum):
+        """Carry out the held commands of peer up to cum, oldest first"""
+        held = peer[3]
+        if not held:
+            return
+        for seq in sorted(held):
+            if seq > cum:
+                break
+            data, start = held.pop(seq)
+            self.__execute(data, start, peer[0])
+        if not held:
+            peer[4] = None
+
+    def __give_up(self, peer):
+        """Stop waiting for what is missing before the held commands
+           of peer: move cum past it, and carry them out."""
+        top = max(peer[3])
+        mask = peer[2] >> (top - peer[1])
+        cum = top
+        while mask & 1:
+            mask >>= 1
+            cum += 1
+        peer[1] = cum
+        peer[2] = mask
+        self.__release(peer, cum)
+
+    def _poll_timeout(self, timeout):
+        # Wake up in time to stop holding commands back
+        now = time.ticks_ms()
+        for peer in self._peers:
+            if peer[4] is not None:
+                left = max(0, time.ticks_diff(peer[4], now))
+                if timeout is None or timeout < 0 or left < timeout:
+                    timeout = left
+        return super()._poll_timeout(timeout)
+
+    def housekeeping(self):
+        super().housekeeping()
+        now = time.ticks_ms()
+        for peer in self._peers:
+            if peer[4] is not None and time.ticks_diff(now, peer[4]) >= 0:
+                if DEBUG:
+                    print("{}: gave up waiting for {}".format(self.__qualname__, peer[1] + 1))
+                self.__give_up(peer)
+
+    def __send_error(self, msg, addr):
+        print("ERROR:", msg)
+        self.s.sendto(b'ERROR ' + bytes(msg, 'ascii'), addr)
 
     def server_deinit(self):
         self.s.close()
+        self.s = None
+        super().server_deinit()
+
+
+# Served on / by HTTPVolumeServer. Sliders for all channels, kept up
+# to date by long-polling /status.
+HTTP_PAGE = b"""<!DOCTYPE html>
+<html><head><meta name="viewport" content="width=device-width"><title>Volume</title></head>
+<body><div id="c"></div><pre id="s"></pre><script>
+var ch=[['FL',1],['FR',2],['SUB',6],['CEN',7],['RL',11],['RR',12],['Master',15]],v=-1,el={};
+ch.forEach(function(c){var d=document.createElement('div'),i=document.createElement('input');
+i.type='range';i.min=0;i.max=99;i.onchange=function(){send(c[0]=='Master'?'setmaster '+i.value:'set '+c[0]+' '+i.value);};
+d.textContent=c[0]+' ';d.appendChild(i);document.getElementById('c').appendChild(d);el[c[0]]=i;});
+function show(r){if(r.status!=200)return;v=r.getResponseHeader('X-Status-Version');var t=r.responseText,n=t.match(/\\d+/g);
+document.getElementById('s').textContent=t;ch.forEach(function(c){el[c[0]].value=n[c[1]];});}
+function poll(){var r=new XMLHttpRequest();r.open('GET','/status?since='+v);
+r.onload=function(){show(r);poll();};r.onerror=function(){setTimeout(poll,2000);};r.send();}
+function send(c){var r=new XMLHttpRequest();r.open('POST','/cmd');r.onload=function(){show(r);};r.send(c);}
+poll();
+</script></body></html>
+"""
+
+
+class HTTPVolumeServer(StreamVolumeServer):
+    """Minimal HTTP/1.1 server with keep-alive.
+
+       GET /                     a page with sliders for all channels
+       GET /status               the status string (same format as
+                                 the other protocols, minus 'OK ')
+       GET /status?since=<ver>   long-poll: reply as soon as the state
+                                 version differs from <ver> (or after
+                                 LONGPOLL_MS, whichever comes first)
+       POST /cmd                 body holds one command per line (same
+                                 commands as the TCP protocol), replies
+                                 with the status
+
+       Status replies carry the state version in the X-Status-Version
+       header, to be passed as <ver> in the next long-poll.
 
+    """
 
-class HTTPVolumeServer(VolumeServer):
-    """ Why not? """
+    LONGPOLL_MS = 25000
 
-    def __init__(self, port=8080, bindaddr="0.0.0.0"):
-        super().__init__()
-        self.port = port
-        self.bindaddr = bindaddr
+    def __init__(self, port=8080, bindaddr="0.0.0.0", vc=None):
+        # The send queue has to fit the whole page
+        super().__init__(port, bindaddr, rxbuf_size=1024,
+                         txbuf_size=len(HTTP_PAGE) + 256, vc=vc)
 
-    def server_init(self, timeout=None):
-        # TODO: implement
-        pass
+    def _has_room(self, cl):
+        # Responses are sent one at a time, and one might be as large
+        # as the page
+        return not cl.tx_pending()
 
-    def server_onestep(self):
-        pass
+    def _poll_timeout(self, timeout):
+        now = time.ticks_ms()
+        for cl in self.clientset:
+            if cl.longpoll is not None:
+                left = max(0, time.ticks_diff(cl.longpoll, now))
+                if timeout is None or timeout < 0 or left < timeout:
+                    timeout = left
+        return super()._poll_timeout(timeout)
+
+    def housekeeping(self):
+        super().housekeeping()
+        now = time.ticks_ms()
+        for i in range(len(self.clientset) - 1, -1, -1):
+            cl = self.clientset[i]
+            if cl.longpoll is not None and (cl.seen_version != self.vc.version or
+                                            time.ticks_diff(now, cl.longpoll) >= 0):
+                cl.longpoll = None
+                self.__send_status(cl, cl.longpoll_close)
+                cl.backlog = cl.rxlen > 0 # might have pipelined requests waiting
+                self._push(cl)
+
+    def _process(self, cl):
+        while cl.longpoll is None and not cl.closing and self._has_room(cl):
+            if not self.__request(cl):
+                break
+
+    def __request(self, cl):
+        """Handle the first request in the receive buffer, if it is
+           complete. Returns True if a request was consumed."""
+        hend = -1
+        for i in range(3, cl.rxlen):
+            if (cl.rxbuf[i] == 0x0a and cl.rxbuf[i - 1] == 0x0d and
+                cl.rxbuf[i - 2] == 0x0a and cl.rxbuf[i - 3] == 0x0d):
+                hend = i + 1
+                break
+        if hend < 0:
+            if cl.rxlen == len(cl.rxbuf):
+                self.__respond(cl, b'431 Request Header Fields Too Large', b'', close=True)
+            return False
+
+        # Unlike the command protocols this isn't done in place, HTTP
+        # isn't the fast path
+        lines = bytes(cl.rxview[0:hend]).split(b'\r\n')
+        try:
+            method, target, version = lines[0].split(b' ')
+        except ValueError:
+            self.__respond(cl, b'400 Bad Request', b'', close=True)
+            return True
+        keepalive = version == b'HTTP/1.1'
+        length = 0
+        for line in lines[1:]:
+            name, _, value = line.partition(b':')
+            name = name.strip().lower()
+            value = value.strip().lower()
+            if name == b'content-length':
+                try:
+                    length = int(value)
+                except ValueError:
+                    length = -1
+                if length < 0:
+                    self.__respond(cl, b'400 Bad Request', b'', close=True)
+                    return True
+            elif name == b'connection':
+                keepalive = value == b'keep-alive'
+        if hend + length > len(cl.rxbuf):
+            self.__respond(cl, b'413 Payload Too Large', b'', close=True)
+            return True
+        if hend + length > cl.rxlen:
+            return False        # wait for the rest of the body
+        if DEBUG:
+            print("{},{}: {} {}".format(self.__qualname__, cl.addr, method, target))
+
+        path, _, query = target.partition(b'?')
+        if method == b'GET' and path == b'/':
+            self.__respond(cl, b'200 OK', HTTP_PAGE, b'text/html', not keepalive)
+        elif method == b'GET' and path == b'/status':
+            since = None
+            if query.startswith(b'since='):
+                try:
+                    since = int(query[6:])
+                except ValueError:
+                    pass
+            if since == self.vc.version:
+                cl.seen_version = since
+                cl.longpoll = time.ticks_add(time.ticks_ms(), self.LONGPOLL_MS)
+                cl.longpoll_close = not keepalive
+            else:
+                self.__send_status(cl, not keepalive)
+        elif method == b'GET' and path == b'/stats':
+            self.__respond(cl, b'200 OK', self.stats_line() + b'\n', close=not keepalive)
+        elif method == b'POST' and path == b'/cmd':
+            self.__command(cl, hend, hend + length, not keepalive)
+        else:
+            self.__respond(cl, b'404 Not Found', b'', close=not keepalive)
+        self._consume(cl, hend + length)
+        return True
+
+    def __command(self, cl, start, end, close):
+        self._accel = cl.accel
+        i = start
+        while i < end:
+            j = i
+            while j < end and cl.rxbuf[j] != 0x0a:
+                j += 1
+            try:
+                self.process_cmd(cl.rxbuf, i, j)
+            except TypeError:
+                self.__respond(cl, b'400 Bad Request', b'ERROR wrong amount of args\n', close=close)
+                return
+            except KeyError:
+                self.__respond(cl, b'400 Bad Request', b'ERROR no such command\n', close=close)
+                return
+            except ValueError as e:
+                self.__respond(cl, b'400 Bad Request', b'ERROR bad argument: ' + bytes(str(e), 'ascii') + b'\n', close=close)
+                return
+            i = j + 1
+        self.__send_status(cl, close)
+
+    def __send_status(self, cl, close):
+        cl.seen_version = self.vc.version
+        self.__respond(cl, b'200 OK', self.vc.get_status_body(), close=close,
+                       extra=b'X-Status-Version: ' + bytes(str(cl.seen_version), 'ascii') + b'\r\n')
+
+    def __respond(self, cl, status, body, ctype=b'text/plain', close=False, extra=b''):
+        cl.queue(b'HTTP/1.1 ')
+        cl.queue(status)
+        cl.queue(b'\r\nContent-Type: ')
+        cl.queue(ctype)
+        cl.queue(b'\r\nCache-Control: no-store\r\nContent-Length: ')
+        cl.queue(bytes(str(len(body)), 'ascii'))
+        cl.queue(b'\r\nConnection: close\r\n' if close else b'\r\n')
+        cl.queue(extra)
+        cl.queue(b'\r\n')
+        cl.queue(body)
+        if close:
+            cl.closing = True
+
+
+class MultiVolumeServer(VolumeServer):
+    """Runs several servers in a single poll driven event loop, so that
+       one device can serve all transports at once. The servers should
+       share one VolumeController (see start_server), so that a change
+       made over any of them is seen by all the others.
+    """
+
+    def __init__(self, servers):
+        super().__init__(servers[0].vc)
+        self.servers = servers
+        for server in servers:
+            server.stats = self.stats
+
+    def server_init(self, timeout=None, poll=None):
+        super().server_init(timeout, poll)
+        for server in self.servers:
+            server.server_init(timeout, self.poll)
+
+    def _poll_timeout(self, timeout):
+        for server in self.servers:
+            timeout = server._poll_timeout(timeout)
+        return timeout
+
+    def handle(self, obj, event):
+        for server in self.servers:
+            if server.handle(obj, event):
+                return True
+        return False
+
+    def handle_priority(self, obj, event):
+        for server in self.servers:
+            if server.handle_priority(obj, event):
+                return True
+        return False
+
+    def housekeeping(self):
+        for server in self.servers:
+            server.housekeeping()
 
     def server_deinit(self):
-        pass
+        for server in self.servers:
+            server.server_deinit()
+        super().server_deinit()
+
+
+def benchmark(n=400, burst=20, port=11128):
+    """Throughput of the command path on the unix port, with the dummy
+       driver (mcp42xxx_dummy) and its timing model standing in for
+       the pots. A client in the same process sends bursts of burst
+       set commands over TCP and waits for all the replies, first
+       pushing the levels after every command, then batching (see
+       VolumeServer.batch). The modelled bus time (what the pots would
+       cost on the real thing, CS hold included) is added to the host
+       time for the commands/s figure."""
+    server = TCPVolumeServer(port=port)
+    server.server_init(timeout=0)
+    c = socket.socket()
+    try:
+        c.connect(socket.getaddrinfo('127.0.0.1', port)[0][-1])
+        c.setblocking(False)
+        while not server.clientset:
+            server.server_onestep()
+        model = server.vc.pot.model
+        data = b''.join(b'set F ' + bytes(str(i*5 % 100), 'ascii') + b'\n' for i in range(burst))
+        rates = []
+        for batch in (False, True):
+            server.batch = batch
+            bus0 = model.bus_time_us
+            frames0 = model.frames
+            start = time.ticks_us()
+            for _ in range(n // burst):
+                c.write(data)
+                got = 0
+                while got < burst:
+                    server.server_onestep()
+                    try:
+                        reply = c.read(1024)
+                    except OSError:
+                        reply = None
+                    if reply:
+                        got += reply.count(b'\n')
+            host_us = time.ticks_diff(time.ticks_us(), start)
+            bus_us = model.bus_time_us - bus0
+            count = n // burst * burst
+            rates.append(count*1000000 // (host_us + bus_us))
+            print("{}: {} commands, {} frames, host {} us + modelled bus {} us: {} commands/s".format(
+                "batched" if batch else "one push per command", count, model.frames - frames0,
+                host_us, bus_us, rates[-1]))
+        print("batching: {}x".format(rates[1] // max(rates[0], 1)))
+    finally:
+        c.close()
+        server.server_deinit()
 
 
 def start_tcpserver(port=1128):
@@ -356,3 +1549,21 @@ def start_udpserver(port=1182):
 def start_httpserver(port=8080):
     server = HTTPVolumeServer(port=port)
     return server.server_loop()
+
+def start_server(tcp_port=1128, udp_port=1182, http_port=8080, ir_pin=None):
+    """Serve all transports at once, sharing one VolumeController.
+       Pass None as a port to leave that transport out. ir_pin is the
+       GPIO an IR receiver is connected to (None for no IR remote)."""
+    vc = VolumeController()
+    servers = []
+    if ir_pin is not None:
+        # First, so that IR changes get pushed to clients the same round
+        from ir_remote import IRVolumeServer
+        servers.append(IRVolumeServer(ir_pin, vc=vc))
+    if tcp_port:
+        servers.append(TCPVolumeServer(port=tcp_port, vc=vc))
+    if udp_port:
+        servers.append(UDPVolumeServer(port=udp_port, vc=vc))
+    if http_port:
+        servers.append(HTTPVolumeServer(port=http_port, vc=vc))
+    return MultiVolumeServer(servers).server_loop()
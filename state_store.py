@@ -0,0 +1,233 @@
+"""Persists VolumeController state to flash.
+
+State is written behind the command path: VolumeController only marks
+the store dirty when something changes, and the actual write happens
+from the server loop (see StateStore.poll) once no changes have come
+in for a while. This way a burst of slider movements ends up as a
+single write, and no command ever waits for the filesystem.
+
+Records are appended to a small set of rotating journal files instead
+of rewriting a single file in place, to spread the wear out over more
+of the flash.
+
+---Record format (little endian, RECORD_SIZE bytes)---
+  magic (1 byte, always MAGIC)
+  seq (4 bytes, incremented for every record written)
+  levels (NUMCHANNELS bytes, in the order FL FR SUB CEN RL RR)
+  master (1 byte)
+  mutes (1 byte, bit n = mute state of level n, bit 7 = global mute)
+  checksum (1 byte, sum of the preceding bytes & 0xff)
+
+On boot all journal files are scanned, and the valid record with the
+highest seq wins.
+
+"""
+
+import uos as os
+import utime as time
+import ustruct as struct
+
+MAGIC = 0xa5
+RECORD_FMT = '<BI6BBB'
+RECORD_SIZE = struct.calcsize(RECORD_FMT) + 1 # + checksum
+GLOBAL_MUTE_BIT = 0x80
+
+class StateStore(object):
+
+    def __init__(self,
+                 prefix='vcstate',
+                 num_files=2,
+                 records_per_file=64,
+                 delay_ms=2000,
+                 max_delay_ms=10000):
+        """Create a StateStore writing to the files <prefix>0.bin ...
+        <prefix><num_files-1>.bin. Each file holds at most
+        records_per_file records before we move on to the next one
+        (truncating it).
+
+        delay_ms is how long the state has to stay unchanged before it
+        is written. max_delay_ms bounds how long a constant stream of
+        changes (somebody dragging a slider back and forth) can
+        postpone the write.
+
+        """
+        self.prefix = prefix
+        self.num_files = num_files
+        self.records_per_file = records_per_file
+        self.delay_ms = delay_ms
+        self.max_delay_ms = max_delay_ms
+
+        self.buf = bytearray(RECORD_SIZE) # reused for every read and write
+        self.last = bytearray(RECORD_SIZE) # last record written (or loaded)
+        self.seq = 0
+        self.file_index = 0
+        self.file_count = 0                # records in the current file
+
+        self.dirty = False
+        self.first_change = 0
+        self.last_change = 0
+
+        # Counters, useful for checking flash wear and boot times
+        self.writes = 0
+        self.restore_us = 0
+
+    def _filename(self, index):
+        return '{}{}.bin'.format(self.prefix, index)
+
+    def _valid(self, buf):
+        if buf[0] != MAGIC:
+            return False
+        csum = 0
+        for i in range(RECORD_SIZE - 1):
+            csum += buf[i]
+        return (csum & 0xff) == buf[RECORD_SIZE - 1]
+
+    def load(self, vc):
+        """Restore the newest state found in the journal into the
+        VolumeController vc. Returns True if a state was found. Does
+        not call push_levels, this is meant to be done before the
+        first push.
+
+        """
+        start = time.ticks_us()
+        found = False
+        for index in range(self.num_files):
+            try:
+                f = open(self._filename(index), 'rb')
+            except OSError:
+                continue
+            count = 0
+            with f:
+                while True:
+                    n = f.readinto(self.buf)
+                    if n != RECORD_SIZE:
+                        break
+                    count += 1
+                    if not self._valid(self.buf):
+                        continue
+                    seq = struct.unpack_from('<I', self.buf, 1)[0]
+                    if not found or seq > self.seq:
+                        found = True
+                        self.seq = seq
+                        self.file_index = index
+                        self.last[:] = self.buf
+            if found and self.file_index == index:
+                self.file_count = count
+                if n:
+                    # Torn write at the end of the file, appending
+                    # would misalign all following records. Start on
+                    # the next file instead.
+                    self.file_count = self.records_per_file
+
+        if found:
+            self._unpack(self.last, vc)
+        self.restore_us = time.ticks_diff(time.ticks_us(), start)
+        return found
+
+    def _pack(self, vc):
+        levels = vc.levels
+        mutes = vc.mutes
+        flags = 0
+        bit = 1
+        for schan in range(vc.NUMPOTS):
+            for lr in (vc.L, vc.R):
+                if mutes[schan][lr]:
+                    flags |= bit
+                bit <<= 1
+        if vc.mute_state:
+            flags |= GLOBAL_MUTE_BIT
+        struct.pack_into(RECORD_FMT, self.buf, 0, MAGIC, self.seq,
+                         levels[0][0], levels[0][1],
+                         levels[1][0], levels[1][1],
+                         levels[2][0], levels[2][1],
+                         vc.master, flags)
+
+    def _unpack(self, buf, vc):
+        flags = buf[RECORD_SIZE - 2]
+        i = 5                   # offset of first level
+        bit = 1
+        for schan in range(vc.NUMPOTS):
+            for lr in (vc.L, vc.R):
+                vc.levels[schan][lr] = min(buf[i], vc.MAX_LEVEL)
+                vc.mutes[schan][lr] = bool(flags & bit)
+                i += 1
+                bit <<= 1
+        vc.master = min(buf[i], vc.MAX_LEVEL)
+        vc.mute_state = bool(flags & GLOBAL_MUTE_BIT)
+
+    def mark_dirty(self):
+        """Called by VolumeController whenever its state changes. Cheap
+        enough to be called on the command path."""
+        now = time.ticks_ms()
+        if not self.dirty:
+            self.dirty = True
+            self.first_change = now
+        self.last_change = now
+
+    def pending_ms(self):
+        """Returns how many ms until poll wants to write, or None if
+        there is nothing to write. Servers use this to bound their poll
+        timeouts."""
+        if not self.dirty:
+            return None
+        now = time.ticks_ms()
+        quiet = self.delay_ms - time.ticks_diff(now, self.last_change)
+        cap = self.max_delay_ms - time.ticks_diff(now, self.first_change)
+        return max(0, min(quiet, cap))
+
+    def poll(self, vc):
+        """Write the state of vc if it has been dirty long enough.
+        Meant to be called from the server loop, outside of command
+        handling. Returns True if anything was written."""
+        if not self.dirty or self.pending_ms() > 0:
+            return False
+        return self.flush(vc)
+
+    def flush(self, vc):
+        """Unconditionally write out the state of vc (unless it is the
+        same as the last record written). If the write fails the state
+        stays dirty."""
+        self.dirty = False
+
+        self.seq += 1
+        self._pack(vc)
+        if (self.last[0] == MAGIC and
+            self.buf[5:RECORD_SIZE - 1] == self.last[5:RECORD_SIZE - 1]):
+            self.seq -= 1       # nothing changed since last write
+            return False
+        csum = 0
+        for i in range(RECORD_SIZE - 1):
+            csum += self.buf[i]
+        self.buf[RECORD_SIZE - 1] = csum & 0xff
+
+        if self.file_count >= self.records_per_file:
+            self.file_index = (self.file_index + 1) % self.num_files
+            self.file_count = 0
+        mode = 'ab' if self.file_count > 0 else 'wb'
+        try:
+            with open(self._filename(self.file_index), mode) as f:
+                f.write(self.buf)
+        except OSError as e:
+            print("ERROR: could not persist state:", e)
+            # Still dirty: poll tries again once the delay has passed anew
+            self.seq -= 1
+            self.dirty = True
+            self.first_change = self.last_change = time.ticks_ms()
+            return False
+
+        self.file_count += 1
+        self.last[:] = self.buf
+        self.writes += 1
+        return True
+
+    def clear(self):
+        """Remove all journal files."""
+        for index in range(self.num_files):
+            try:
+                os.remove(self._filename(index))
+            except OSError:
+                pass
+        self.seq = 0
+        self.file_index = 0
+        self.file_count = 0
+        self.last[0] = 0
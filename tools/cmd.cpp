@@ -0,0 +1,392 @@
+/*
+ * One-shot command line client for the volume control server (server.py), for scripts and key
+ * bindings:
+ *
+ *     vc-cmd -h volume.lan inc F 2 , incmaster -1
+ *     vc-cmd -h volume.lan -u mute 1
+ *     echo 'setmaster 40' | vc-cmd -h volume.lan -f -
+ *
+ * Connects, sends the commands (pipelined, one per datagram for UDP), waits for the replies and
+ * prints the final status. A status command is added at the end if the script doesn't end with
+ * one, so that there is always a final state to print and (for UDP, which only answers status)
+ * errors in the earlier commands have had time to arrive.
+ *
+ * Built on the core protocol library without Qt, so the whole run (process start to exit) takes
+ * a couple of milliseconds against a server on the local network. -v prints where the time went.
+ */
+
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "Client.h"
+#include "Command.h"
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    std::string port;           //!< Empty = the default port of the transport
+    Transport transport = Transport::Tcp;
+    unsigned timeoutMs = 2000;
+    bool reliable = false;      //!< UDP: have the commands acknowledged, resend lost ones
+    bool quiet = false;
+    bool verbose = false;
+};
+
+enum ExitCode
+{
+    ExitOk = 0,
+    ExitServerError = 1,        //!< The server said ERROR to something
+    ExitUsage = 2,
+    ExitConnection = 3,         //!< Couldn't connect, connection lost or timed out
+};
+
+/// \brief Argument types, per command (c = channel, i = int, upper case = optional)
+static const char *argSpec(Command cmd)
+{
+    switch (cmd)
+    {
+    case Command::Set:       return "ci";
+    case Command::SetMaster: return "i";
+    case Command::Inc:       return "cI";
+    case Command::IncMaster: return "I";
+    case Command::Mute:      return "i";
+    case Command::MuteChan:  return "ci";
+    case Command::Subscribe: return "i";
+    default:                 return "";
+    }
+}
+
+/**
+ * \brief Build one command from its words.
+ * \return false (after printing why) if the command is unknown or has bad arguments
+ */
+static bool buildCommand(const std::vector<std::string> &words, CommandBuffer &buf)
+{
+    Command cmd;
+    if (!commandFromName(words[0].c_str(), cmd) || cmd == Command::Byebye)
+    {
+        fprintf(stderr, "vc-cmd: no such command: %s\n", words[0].c_str());
+        return false;
+    }
+
+    const char *spec = argSpec(cmd);
+    size_t required = 0;
+    while (spec[required] && islower((unsigned char)spec[required]))
+        ++required;
+    size_t nargs = words.size() - 1;
+    if (nargs < required || nargs > strlen(spec))
+    {
+        fprintf(stderr, "vc-cmd: wrong amount of args for %s\n", words[0].c_str());
+        return false;
+    }
+
+    buf.begin(cmd);
+    for (size_t i = 0; i < nargs; ++i)
+    {
+        const std::string &word = words[i + 1];
+        if (tolower((unsigned char)spec[i]) == 'c')
+        {
+            std::string upper(word);
+            for (char &c : upper)
+                c = (char)toupper((unsigned char)c);
+            Channel chan;
+            if (!channelFromName(upper.c_str(), chan))
+            {
+                fprintf(stderr, "vc-cmd: no such channel: %s\n", word.c_str());
+                return false;
+            }
+            buf.arg(chan);
+        }
+        else
+        {
+            char *end;
+            long value = strtol(word.c_str(), &end, 10);
+            if (word.empty() || *end)
+            {
+                fprintf(stderr, "vc-cmd: not a number: %s\n", word.c_str());
+                return false;
+            }
+            buf.arg((int)value);
+        }
+    }
+    buf.end();
+    return true;
+}
+
+/// \brief Split s into whitespace separated words, appending them to words
+static void splitWords(const std::string &s, std::vector<std::string> &words)
+{
+    size_t i = 0;
+    while (i < s.size())
+    {
+        while (i < s.size() && isspace((unsigned char)s[i]))
+            ++i;
+        size_t start = i;
+        while (i < s.size() && !isspace((unsigned char)s[i]))
+            ++i;
+        if (i > start)
+            words.push_back(s.substr(start, i - start));
+    }
+}
+
+/// \brief Commands from the command line, separated by "," (or words ending in ",")
+static bool parseArgs(int argc, char **argv, std::vector<CommandBuffer> &script)
+{
+    std::vector<std::string> words;
+    for (int i = 0; i <= argc; ++i)
+    {
+        std::string word = i < argc ? argv[i] : ",";
+        bool last = !word.empty() && word.back() == ',';
+        if (last)
+            word.pop_back();
+        if (!word.empty())
+            words.push_back(word);
+        if (last && !words.empty())
+        {
+            script.emplace_back();
+            if (!buildCommand(words, script.back()))
+                return false;
+            words.clear();
+        }
+    }
+    return true;
+}
+
+/// \brief Commands from a file (or stdin for "-"), one per line. # starts a comment.
+static bool parseFile(const char *path, std::vector<CommandBuffer> &script)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f)
+    {
+        perror(path);
+        return false;
+    }
+    bool ok = true;
+    char line[256];
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        std::string s(line);
+        size_t hash = s.find('#');
+        if (hash != std::string::npos)
+            s.erase(hash);
+        std::vector<std::string> words;
+        splitWords(s, words);
+        if (words.empty())
+            continue;
+        script.emplace_back();
+        ok = buildCommand(words, script.back());
+    }
+    if (f != stdin)
+        fclose(f);
+    return ok;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] COMMAND [ARGS] [, COMMAND [ARGS]]...\n"
+            "  -h, --host HOST          server (default 127.0.0.1)\n"
+            "  -p, --port PORT          port (default 1128 for TCP, 1182 for UDP)\n"
+            "  -t, --tcp                use TCP (default)\n"
+            "  -u, --udp                use UDP\n"
+            "  -r, --reliable           UDP: wait for every command to be acknowledged,\n"
+            "                           resending it if need be\n"
+            "  -f, --file FILE          read commands from FILE, one per line (- for stdin)\n"
+            "  -T, --timeout MS         give up after MS milliseconds (default 2000)\n"
+            "  -q, --quiet              don't print the final status\n"
+            "  -v, --verbose            print every reply and the time taken to stderr\n"
+            "Commands: set CHAN LEVEL, setmaster LEVEL, inc CHAN [STEP], incmaster [STEP],\n"
+            "          mute 0/1, mutechan CHAN 0/1, status, stats, reset\n"
+            "Exits with 1 if the server replied ERROR to any command, 3 on connection problems.\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t startUs = nowUs();
+
+    static const struct option longOpts[] = {
+        { "host",    required_argument, NULL, 'h' },
+        { "port",    required_argument, NULL, 'p' },
+        { "tcp",     no_argument,       NULL, 't' },
+        { "udp",     no_argument,       NULL, 'u' },
+        { "reliable", no_argument,      NULL, 'r' },
+        { "file",    required_argument, NULL, 'f' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "quiet",   no_argument,       NULL, 'q' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { "help",    no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options opts;
+    std::vector<CommandBuffer> script;
+    const char *file = nullptr;
+    int opt;
+    // '+': stop at the first non-option, so that negative steps aren't taken for options
+    while ((opt = getopt_long(argc, argv, "+h:p:turf:T:qv", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 't': opts.transport = Transport::Tcp; break;
+        case 'u': opts.transport = Transport::Udp; break;
+        case 'r': opts.reliable = true; break;
+        case 'f': file = optarg; break;
+        case 'T': opts.timeoutMs = (unsigned)atoi(optarg); break;
+        case 'q': opts.quiet = true; break;
+        case 'v': opts.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return ExitUsage;
+        }
+    }
+    if (file ? !parseFile(file, script) : !parseArgs(argc - optind, argv + optind, script))
+        return ExitUsage;
+    if (script.empty())
+    {
+        usage(argv[0]);
+        return ExitUsage;
+    }
+    if (script.back().command() != Command::Status)
+    {
+        script.emplace_back();
+        script.back().begin(Command::Status).end();
+    }
+    if (opts.port.empty())
+        opts.port = opts.transport == Transport::Tcp ? "1128" : "1182";
+
+    Reactor reactor;
+    Client client(reactor, opts.transport);
+    ProtocolCore &core = client.protocol();
+    core.setConnectTimeout(opts.timeoutMs);
+    core.setReliable(opts.reliable);
+
+    int result = ExitOk;
+    bool sent = false;
+    // With --reliable a resend can arrive after the status sent behind it, so the final status
+    // waits until everything has been acknowledged
+    size_t held = opts.reliable ? 1 : 0;
+    bool done = false;
+    std::string lastStatus;
+    uint64_t connectedUs = 0;
+
+    auto finish = [&](int code) {
+        if (code > result)
+            result = code;
+        client.disconnect();
+        done = true;
+    };
+
+    client.connected = [&]() {
+        connectedUs = nowUs();
+        for (size_t i = 0; i < script.size() - held; ++i)
+            core.send(script[i]);
+        sent = true;
+    };
+    client.replyReceived = [&](const char *line, size_t len) {
+        std::string s(line, len);
+        while (!s.empty() && (s.back() == '\n' || s.back() == '\r'))
+            s.pop_back();
+        if (opts.verbose)
+            fprintf(stderr, "< %s\n", s.c_str());
+        // Server counters are printed as they come, there is no "last" one
+        if (sent && !opts.quiet && s.compare(0, 6, "STATS ") == 0)
+            printf("%s\n", s.c_str());
+        else if (sent && s.find("0: (") != std::string::npos)
+            lastStatus = s.compare(0, 3, "OK ") == 0 ? s.substr(3) : s;
+    };
+    client.error = [&](ProtocolError err, const char *detail) {
+        switch (err)
+        {
+        case ProtocolError::ServerError:
+            fprintf(stderr, "vc-cmd: server error:%s\n", detail);
+            result = ExitServerError;
+            break;
+        case ProtocolError::BadStatus:
+            fprintf(stderr, "vc-cmd: couldn't parse status: %s\n", detail);
+            break;
+        case ProtocolError::LineTooLong:
+            fprintf(stderr, "vc-cmd: overlong line from server\n");
+            break;
+        case ProtocolError::ConnectFailed:
+        case ProtocolError::ConnectionLost:
+            fprintf(stderr, "vc-cmd: %s:%s: %s\n", opts.host.c_str(), opts.port.c_str(), detail);
+            finish(ExitConnection);
+            break;
+        }
+    };
+    client.disconnected = [&]() {
+        if (core.pendingReplies() > 0)
+        {
+            fprintf(stderr, "vc-cmd: connection closed: %s\n", client.errorString().c_str());
+            finish(ExitConnection);
+        }
+    };
+
+    if (!client.connect(opts.host.c_str(), opts.port.c_str()))
+    {
+        fprintf(stderr, "vc-cmd: %s\n", client.errorString().c_str());
+        return ExitConnection;
+    }
+    reactor.addTimer(opts.timeoutMs, [&]() {
+            fprintf(stderr, "vc-cmd: timed out waiting for %s\n",
+                    sent ? "replies" : "the connection");
+            finish(ExitConnection);
+        });
+
+    // Done once everything sent has been answered
+    while (!done && reactor.runOnce())
+    {
+        if (sent && core.pendingReplies() == 0)
+        {
+            if (held)
+            {
+                core.send(script.back());
+                held = 0;
+            }
+            else
+            {
+                finish(ExitOk);
+            }
+        }
+    }
+
+    if (result != ExitConnection && !opts.quiet && !lastStatus.empty())
+        printf("%s\n", lastStatus.c_str());
+
+    if (opts.verbose)
+    {
+        uint64_t endUs = nowUs();
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        if (opts.reliable)
+            fprintf(stderr, "rtt %.1f ms, rto %u ms, %lu resent\n",
+                    core.roundTripTime(), core.retransmitTimeout(), core.retransmits());
+        fprintf(stderr, "connect %.2f ms, commands %.2f ms, total %.2f ms (cpu %.2f ms) for %zu commands\n",
+                connectedUs ? (connectedUs - startUs)/1000.0 : 0.0,
+                connectedUs ? (endUs - connectedUs)/1000.0 : 0.0,
+                (endUs - startUs)/1000.0,
+                (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1000.0 +
+                (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1000.0,
+                script.size());
+    }
+    return result;
+}
@@ -0,0 +1,197 @@
+/*
+ * Checks of the ordering guarantees of ProtocolCore (see core/) that are easy to break and hard
+ * to notice against a real server, run without any sockets:
+ *
+ *     make -C tools check
+ *
+ * Every check drives a ProtocolCore by hand (connect, send, feed replies, tick) and looks at the
+ * exact sequence of lines or datagrams it wrote (the server never answers in the reliable UDP
+ * checks, so what isn't acknowledged gets sent again). Prints the checks that fail and exits 1
+ * if any did.
+ */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ProtocolCore.h"
+
+static const char STATUS_REPLY[] = "OK 0: (1,1,0,0); 1: (1,1,0,0); 2: (1,1,0,0); Master: 50 Mute: 0\n";
+
+static unsigned failures = 0;
+
+/// Collects what the core sends, one string per write (without newlines)
+class Recorder : public ProtocolHandler
+{
+public:
+    std::vector<std::string> sent;
+
+    void writeToServer(const char *data, std::size_t len) override
+    {
+        std::string s(data, len);
+        if (!s.empty() && s.back() == '\n')
+            s.pop_back();
+        sent.push_back(s);
+    }
+
+    std::string joined() const
+    {
+        std::string s;
+        for (const std::string &line: sent)
+        {
+            // Reliable mode: leave out the "@<seq> <base> " in front, it's different every run
+            std::size_t start = 0;
+            if (!line.empty() && line[0] == '@')
+                start = line.find(' ', line.find(' ') + 1) + 1;
+            s += (s.empty() ? "" : ", ") + line.substr(start);
+        }
+        return s;
+    }
+};
+
+static void expect(const char *name, const Recorder &rec, const char *expected)
+{
+    std::string got = rec.joined();
+    if (got == expected)
+        return;
+    ++failures;
+    printf("FAIL %s:\n  expected: %s\n  got:      %s\n", name, expected, got.c_str());
+}
+
+static void reply(ProtocolCore &core, unsigned n = 1)
+{
+    for (unsigned i = 0; i < n; ++i)
+        core.received(STATUS_REPLY, sizeof(STATUS_REPLY) - 1);
+}
+
+/// TCP, one command in flight: a mute jumps the queued level changes...
+static void checkMuteJumpsQueue()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Tcp, rec);
+    core.setMaxInFlight(1);
+    core.startConnect("test", 1);
+    core.connectionUp();                    // status
+    core.sendCmd(Command::Set, Channel::F, 10);
+    core.sendCmd(Command::Mute, 1);
+    reply(core, 3);
+    expect("mute jumps queued level changes", rec, "status, mute 1, set F 10");
+}
+
+/// ...but not a queued reset, which would unmute again after it
+static void checkMuteAfterQueuedReset()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Tcp, rec);
+    core.setMaxInFlight(1);
+    core.startConnect("test", 1);
+    core.connectionUp();
+    core.sendCmd(Command::Set, Channel::F, 10);
+    core.sendCmd(Command::Reset);
+    core.sendCmd(Command::Mute, 1);
+    reply(core, 3);
+    // The reset makes the queued set pointless (see CommandBuffer::supersedes)
+    expect("reset queued, then mute", rec, "status, reset, mute 1");
+}
+
+static void connectUdp(ProtocolCore &core, Recorder &rec)
+{
+    core.startConnect("test", 1);           // status (the first ping)
+    reply(core);
+    rec.sent.clear();
+}
+
+/// UDP: a mute goes out again a couple of times...
+static void checkMuteCopies()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Udp, rec);
+    core.setRedundancy(2, 10);
+    connectUdp(core, rec);
+    core.sendCmd(Command::Mute, 1);
+    for (int i = 0; i < 4; ++i)
+    {
+        usleep(15000);
+        core.tick();
+    }
+    expect("mute copies", rec, "mute 1, mute 1, mute 1");
+}
+
+/// ...but no copy of it may follow a later reset
+static void checkResetStopsCopies()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Udp, rec);
+    core.setRedundancy(2, 10);
+    connectUdp(core, rec);
+    core.sendCmd(Command::Mute, 1);
+    core.sendCmd(Command::Reset);
+    for (int i = 0; i < 4; ++i)
+    {
+        usleep(15000);
+        core.tick();
+    }
+    expect("mute, then reset: no copies after the reset", rec, "mute 1, reset");
+}
+
+/// Tick until the core has written n more times (retransmissions), or a second has gone by
+static void waitForWrites(ProtocolCore &core, Recorder &rec, std::size_t n)
+{
+    std::size_t target = rec.sent.size() + n;
+    for (int i = 0; i < 200 && rec.sent.size() < target; ++i)
+    {
+        usleep(5000);
+        core.tick();
+    }
+}
+
+/// Reliable UDP: the server applies commands as they arrive, so a lost older value that is
+/// resent must not undo a newer one, even on an overlapping channel...
+static void checkResendNarrowed()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Udp, rec);
+    core.setReliable(true);
+    connectUdp(core, rec);
+    core.sendCmd(Command::Set, Channel::F, 10);
+    core.sendCmd(Command::Set, Channel::FL, 50);
+    core.sendCmd(Command::MuteChan, Channel::R, 1);
+    core.sendCmd(Command::MuteChan, Channel::R, 0);
+    waitForWrites(core, rec, 3);
+    expect("resend of set F narrowed to FR", rec,
+           "set F 10, set FL 50, mutechan R 1, mutechan R 0, set FR 10, set FL 50, mutechan R 0");
+}
+
+/// ...or a newer reset
+static void checkResetDropsResends()
+{
+    Recorder rec;
+    ProtocolCore core(Transport::Udp, rec);
+    core.setReliable(true);
+    connectUdp(core, rec);
+    core.sendCmd(Command::MuteChan, Channel::F, 1);
+    core.sendCmd(Command::Inc, Channel::RL, 2);
+    core.sendCmd(Command::Reset);
+    waitForWrites(core, rec, 1);
+    expect("reset drops older resends", rec, "mutechan F 1, inc RL 2, reset, reset");
+}
+
+int main()
+{
+    checkMuteJumpsQueue();
+    checkMuteAfterQueuedReset();
+    checkMuteCopies();
+    checkResetStopsCopies();
+    checkResendNarrowed();
+    checkResetDropsResends();
+
+    if (failures)
+    {
+        printf("%u check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,705 @@
+/*
+ * Load generator for the volume control server (server.py).
+ *
+ * Opens a number of TCP and UDP clients against a server (the real device, the MicroPython unix
+ * port or any stand-in), replays a random mix of commands at a target rate and reports
+ * throughput, latency percentiles, errors and timeouts per interval. Meant both for finding how
+ * much load the server takes before latency explodes, and for long soak runs (--duration 0)
+ * logging to CSV.
+ *
+ * Latency is measured from sending a command until its reply arrives. TCP replies to every
+ * command. UDP only replies to status, so for UDP clients only status commands are timed (the
+ * rest are just counted as sent).
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/**
+ * \brief Log-linear latency histogram (64 sub-buckets per power of two, so values are accurate
+ *        to within ~1.5%). Fixed size, so it can be used for runs of any length.
+ */
+class LatencyHistogram
+{
+public:
+    static const int subBits = 6;
+    static const int numBuckets = (64 - subBits + 1) << subBits;
+
+    LatencyHistogram() : counts(numBuckets, 0) { reset(); }
+
+    void reset()
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        maxValue = 0;
+    }
+
+    void add(uint64_t us)
+    {
+        ++counts[index(us)];
+        ++total;
+        maxValue = std::max(maxValue, us);
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (int i = 0; i < numBuckets; ++i)
+            counts[i] += other.counts[i];
+        total += other.total;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    /// \brief Value at quantile q (0..1), 0 if empty
+    uint64_t percentile(double q) const
+    {
+        if (total == 0)
+            return 0;
+        uint64_t rank = (uint64_t)std::ceil(q*total);
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(value(i), maxValue);
+        }
+        return maxValue;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+
+private:
+    static int index(uint64_t v)
+    {
+        if (v < (1u << subBits))
+            return (int)v;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - subBits;
+        return ((shift + 1) << subBits) + (int)((v >> shift) & ((1u << subBits) - 1));
+    }
+
+    /// Upper bound of the values in bucket i
+    static uint64_t value(int i)
+    {
+        if (i < (1 << subBits))
+            return i;
+        int shift = (i >> subBits) - 1;
+        uint64_t base = ((uint64_t)(1u << subBits) | (i & ((1u << subBits) - 1))) << shift;
+        return base + ((uint64_t)1 << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t maxValue;
+};
+
+/// Counters for one reporting interval (and, merged, for the whole run)
+struct Stats
+{
+    uint64_t sent = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;     //!< ERROR replies, socket errors and disconnects
+    uint64_t timeouts = 0;
+    LatencyHistogram latency;
+
+    void reset()
+    {
+        sent = replies = errors = timeouts = 0;
+        latency.reset();
+    }
+
+    void merge(const Stats &other)
+    {
+        sent += other.sent;
+        replies += other.replies;
+        errors += other.errors;
+        timeouts += other.timeouts;
+        latency.merge(other.latency);
+    }
+};
+
+enum CommandType { CMD_SET, CMD_INC, CMD_MUTECHAN, CMD_STATUS, NUM_CMD_TYPES };
+static const char *const commandNames[NUM_CMD_TYPES] = { "set", "inc", "mutechan", "status" };
+static const char *const channelNames[] = { "FL", "FR", "F", "CEN", "SUB", "CENSUB", "RL", "RR", "R" };
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    unsigned short tcpPort = 1128;
+    unsigned short udpPort = 1182;
+    unsigned tcpClients = 1;
+    unsigned udpClients = 0;
+    double rate = 10.0;           //!< commands per second and client
+    unsigned window = 1;          //!< max outstanding commands per client
+    double duration = 10.0;       //!< seconds, 0 = run until interrupted
+    double interval = 1.0;        //!< seconds between reports
+    unsigned timeoutMs = 1000;
+    unsigned weights[NUM_CMD_TYPES] = { 50, 20, 10, 20 };
+    std::string csvFile;
+    unsigned seed = 0;
+};
+
+/// A timed command that hasn't been answered yet
+struct Pending
+{
+    uint64_t sentAt;
+    bool timedOut;
+};
+
+struct Client
+{
+    bool tcp;
+    int fd = -1;
+    bool connecting = false;
+    uint64_t nextSend = 0;        //!< when the next command is due
+    uint64_t reconnectAt = 0;     //!< TCP: when to try reconnecting (0 = connected or connecting)
+    std::deque<Pending> pending;
+    std::string rx;               //!< TCP: partial reply line
+};
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(const Options &_opts) :
+        opts(_opts), rng(_opts.seed ? _opts.seed : std::random_device()()), csv(NULL)
+    {
+    }
+
+    ~LoadGenerator()
+    {
+        for (Client &c : clients)
+            if (c.fd >= 0)
+                close(c.fd);
+        if (csv)
+            fclose(csv);
+    }
+
+    bool init();
+    void run(volatile sig_atomic_t &stop);
+
+private:
+    bool resolve(unsigned short port, struct sockaddr_in &addr);
+    void openClient(Client &c, uint64_t now);
+    void dropClient(Client &c, uint64_t now);
+    void sendCommand(Client &c, uint64_t now);
+    void receive(Client &c, uint64_t now);
+    void handleReply(Client &c, const char *line, uint64_t now);
+    void checkTimeouts(Client &c, uint64_t now);
+    void report(double elapsed, bool final);
+    int buildCommand(char *buf, size_t size, CommandType &type);
+
+    const Options opts;
+    std::mt19937 rng;
+    struct sockaddr_in tcpAddr;
+    struct sockaddr_in udpAddr;
+    std::vector<Client> clients;
+    Stats interval;
+    Stats total;
+    unsigned weightSum = 0;
+    FILE *csv;
+};
+
+bool LoadGenerator::resolve(unsigned short port, struct sockaddr_in &addr)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    int err = getaddrinfo(opts.host.c_str(), NULL, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "Could not resolve %s: %s\n", opts.host.c_str(), gai_strerror(err));
+        return false;
+    }
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return true;
+}
+
+bool LoadGenerator::init()
+{
+    if (!resolve(opts.tcpPort, tcpAddr) || !resolve(opts.udpPort, udpAddr))
+        return false;
+
+    for (unsigned w : opts.weights)
+        weightSum += w;
+    if (weightSum == 0)
+    {
+        fprintf(stderr, "Command mix is empty\n");
+        return false;
+    }
+
+    if (!opts.csvFile.empty())
+    {
+        csv = fopen(opts.csvFile.c_str(), "w");
+        if (!csv)
+        {
+            perror(opts.csvFile.c_str());
+            return false;
+        }
+        fprintf(csv, "time_s,sent,replies,throughput,p50_us,p95_us,p99_us,max_us,errors,timeouts,connected\n");
+    }
+
+    uint64_t now = nowUs();
+    std::uniform_real_distribution<double> spread(0.0, 1e6/opts.rate);
+    clients.resize(opts.tcpClients + opts.udpClients);
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        Client &c = clients[i];
+        c.tcp = i < opts.tcpClients;
+        c.nextSend = now + (uint64_t)spread(rng); // spread clients out over the first period
+        openClient(c, now);
+    }
+    return true;
+}
+
+void LoadGenerator::openClient(Client &c, uint64_t now)
+{
+    c.fd = socket(AF_INET, (c.tcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK, 0);
+    if (c.fd < 0)
+    {
+        perror("socket");
+        dropClient(c, now);
+        return;
+    }
+
+    if (c.tcp)
+    {
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c.fd, (struct sockaddr *)&tcpAddr, sizeof(tcpAddr)) < 0 && errno != EINPROGRESS)
+        {
+            dropClient(c, now);
+            return;
+        }
+        c.connecting = true;
+    }
+    else
+    {
+        // connect() on UDP so we only get replies from the server and can use send/recv
+        connect(c.fd, (struct sockaddr *)&udpAddr, sizeof(udpAddr));
+    }
+    c.reconnectAt = 0;
+}
+
+void LoadGenerator::dropClient(Client &c, uint64_t now)
+{
+    ++interval.errors;
+    if (c.fd >= 0)
+        close(c.fd);
+    c.fd = -1;
+    c.connecting = false;
+    c.pending.clear();
+    c.rx.clear();
+    c.reconnectAt = now + 1000000;
+}
+
+int LoadGenerator::buildCommand(char *buf, size_t size, CommandType &type)
+{
+    unsigned r = std::uniform_int_distribution<unsigned>(0, weightSum - 1)(rng);
+    int t = 0;
+    while (r >= opts.weights[t])
+        r -= opts.weights[t++];
+    type = (CommandType)t;
+
+    const size_t numChannels = sizeof(channelNames)/sizeof(channelNames[0]);
+    const char *chan = channelNames[std::uniform_int_distribution<size_t>(0, numChannels - 1)(rng)];
+    switch (type)
+    {
+    case CMD_SET:
+        return snprintf(buf, size, "set %s %u\n", chan, std::uniform_int_distribution<unsigned>(0, 99)(rng));
+    case CMD_INC:
+        return snprintf(buf, size, "inc %s\n", chan);
+    case CMD_MUTECHAN:
+        return snprintf(buf, size, "mutechan %s %u\n", chan, std::uniform_int_distribution<unsigned>(0, 1)(rng));
+    default:
+        return snprintf(buf, size, "status\n");
+    }
+}
+
+void LoadGenerator::sendCommand(Client &c, uint64_t now)
+{
+    char buf[64];
+    CommandType type;
+    int len = buildCommand(buf, sizeof(buf), type);
+
+    // The UDP protocol has one command per datagram, no newline
+    ssize_t ret = send(c.fd, buf, c.tcp ? len : len - 1, MSG_NOSIGNAL);
+    if (ret < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;               // count it as not sent, try again next period
+        if (c.tcp)
+            dropClient(c, now);
+        else
+            ++interval.errors;
+        return;
+    }
+    // Short writes are very unlikely for a few bytes on an empty socket, but would desync
+    // the reply matching, so treat them as fatal
+    if (ret != (c.tcp ? len : len - 1))
+    {
+        dropClient(c, now);
+        return;
+    }
+
+    ++interval.sent;
+    if (c.tcp || type == CMD_STATUS)
+        c.pending.push_back(Pending{now, false});
+}
+
+void LoadGenerator::handleReply(Client &c, const char *line, uint64_t now)
+{
+    if (0 == strncmp(line, "STATUS", 6))
+        return;                   // pushed status, not a reply
+
+    if (c.pending.empty())
+        return;                   // late reply to something already given up on
+    Pending p = c.pending.front();
+    c.pending.pop_front();
+    if (p.timedOut)
+        return;
+
+    ++interval.replies;
+    if (0 == strncmp(line, "ERROR", 5))
+        ++interval.errors;
+    else
+        interval.latency.add(now - p.sentAt);
+}
+
+void LoadGenerator::receive(Client &c, uint64_t now)
+{
+    char buf[2048];
+    for (;;)
+    {
+        ssize_t n = recv(c.fd, buf, sizeof(buf) - 1, 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (c.tcp)
+                dropClient(c, now);
+            else
+                ++interval.errors; // e.g. ECONNREFUSED when nothing listens
+            return;
+        }
+        if (n == 0 && c.tcp)
+        {
+            dropClient(c, now);
+            return;
+        }
+        buf[n] = '\0';
+
+        if (!c.tcp)
+        {
+            handleReply(c, buf, now);
+            continue;
+        }
+
+        c.rx.append(buf, n);
+        size_t start = 0, nl;
+        while ((nl = c.rx.find('\n', start)) != std::string::npos)
+        {
+            c.rx[nl] = '\0';
+            handleReply(c, c.rx.c_str() + start, now);
+            start = nl + 1;
+        }
+        c.rx.erase(0, start);
+    }
+}
+
+void LoadGenerator::checkTimeouts(Client &c, uint64_t now)
+{
+    uint64_t limit = (uint64_t)opts.timeoutMs*1000;
+    for (Pending &p : c.pending)
+    {
+        if (now - p.sentAt < limit)
+            break;                // FIFO, the rest are newer
+        if (!p.timedOut)
+        {
+            p.timedOut = true;
+            ++interval.timeouts;
+        }
+    }
+    // UDP replies can be lost for good, don't keep waiting for them. TCP replies arrive in order
+    // eventually, so timed out entries are kept there to match them up.
+    if (!c.tcp)
+        while (!c.pending.empty() && c.pending.front().timedOut)
+            c.pending.pop_front();
+}
+
+void LoadGenerator::report(double elapsed, bool final)
+{
+    const Stats &s = final ? total : interval;
+    double span = final ? elapsed : opts.interval;
+    unsigned connected = 0;
+    for (const Client &c : clients)
+        if (c.fd >= 0 && !c.connecting)
+            ++connected;
+
+    double throughput = s.replies/span;
+    printf("%s%8.1fs sent %7llu replies %7llu (%8.1f/s) p50 %6llu us p95 %6llu us p99 %6llu us max %7llu us errors %llu timeouts %llu connected %u/%zu\n",
+           final ? "TOTAL " : "", elapsed,
+           (unsigned long long)s.sent, (unsigned long long)s.replies, throughput,
+           (unsigned long long)s.latency.percentile(0.50),
+           (unsigned long long)s.latency.percentile(0.95),
+           (unsigned long long)s.latency.percentile(0.99),
+           (unsigned long long)s.latency.max(),
+           (unsigned long long)s.errors, (unsigned long long)s.timeouts,
+           connected, clients.size());
+    fflush(stdout);
+
+    if (csv && !final)
+    {
+        fprintf(csv, "%.3f,%llu,%llu,%.1f,%llu,%llu,%llu,%llu,%llu,%llu,%u\n",
+                elapsed, (unsigned long long)s.sent, (unsigned long long)s.replies, throughput,
+                (unsigned long long)s.latency.percentile(0.50),
+                (unsigned long long)s.latency.percentile(0.95),
+                (unsigned long long)s.latency.percentile(0.99),
+                (unsigned long long)s.latency.max(),
+                (unsigned long long)s.errors, (unsigned long long)s.timeouts, connected);
+        fflush(csv);
+    }
+}
+
+void LoadGenerator::run(volatile sig_atomic_t &stop)
+{
+    const uint64_t start = nowUs();
+    const uint64_t period = (uint64_t)(1e6/opts.rate);
+    const uint64_t reportPeriod = (uint64_t)(opts.interval*1e6);
+    const uint64_t end = opts.duration > 0 ? start + (uint64_t)(opts.duration*1e6) : 0;
+    uint64_t nextReport = start + reportPeriod;
+
+    std::vector<struct pollfd> pfds(clients.size());
+    while (!stop)
+    {
+        uint64_t now = nowUs();
+        if (end && now >= end)
+            break;
+
+        // Send whatever is due and figure out how long we may sleep
+        uint64_t wake = nextReport;
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            Client &c = clients[i];
+            pfds[i].fd = c.fd;
+            pfds[i].events = POLLIN | (c.connecting ? POLLOUT : 0);
+            pfds[i].revents = 0;
+
+            if (c.fd < 0)
+            {
+                if (c.reconnectAt && now >= c.reconnectAt)
+                    openClient(c, now);
+                wake = std::min(wake, c.reconnectAt ? c.reconnectAt : now + period);
+                pfds[i].fd = c.fd;
+                pfds[i].events = POLLIN | (c.connecting ? POLLOUT : 0);
+                continue;
+            }
+            checkTimeouts(c, now);
+            if (!c.connecting && now >= c.nextSend)
+            {
+                if (c.pending.size() < opts.window)
+                    sendCommand(c, now);
+                // Fixed schedule (not "period after the last send"), so a slow server doesn't
+                // lower the offered load, but skip periods we're hopelessly behind on
+                c.nextSend += period;
+                if (c.nextSend < now)
+                    c.nextSend = now + period;
+            }
+            wake = std::min(wake, c.nextSend);
+        }
+        if (end)
+            wake = std::min(wake, end);
+
+        int timeout = wake > now ? (int)((wake - now + 999)/1000) : 0;
+        int ret = poll(pfds.data(), pfds.size(), timeout);
+        if (ret < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        now = nowUs();
+        for (size_t i = 0; ret > 0 && i < clients.size(); ++i)
+        {
+            Client &c = clients[i];
+            if (c.fd < 0 || pfds[i].fd != c.fd || !pfds[i].revents)
+                continue;
+            if (c.connecting && (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err)
+                {
+                    dropClient(c, now);
+                    continue;
+                }
+                c.connecting = false;
+            }
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+                receive(c, now);
+        }
+
+        if (now >= nextReport)
+        {
+            report((now - start)/1e6, false);
+            total.merge(interval);
+            interval.reset();
+            nextReport += reportPeriod;
+        }
+    }
+
+    total.merge(interval);
+    report((nowUs() - start)/1e6, true);
+}
+
+static bool parseMix(const char *arg, unsigned weights[NUM_CMD_TYPES])
+{
+    std::fill(weights, weights + NUM_CMD_TYPES, 0);
+    std::string mix(arg);
+    size_t pos = 0;
+    while (pos < mix.size())
+    {
+        size_t comma = mix.find(',', pos);
+        std::string item = mix.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos)
+            return false;
+        std::string name = item.substr(0, eq);
+        int t;
+        for (t = 0; t < NUM_CMD_TYPES; ++t)
+            if (name == commandNames[t])
+                break;
+        if (t == NUM_CMD_TYPES)
+            return false;
+        weights[t] = (unsigned)atoi(item.c_str() + eq + 1);
+        if (comma == std::string::npos)
+            break;
+        pos = comma + 1;
+    }
+    return true;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h, --host HOST          server to connect to (default 127.0.0.1)\n"
+            "  -p, --tcp-port PORT      TCP port (default 1128)\n"
+            "  -P, --udp-port PORT      UDP port (default 1182)\n"
+            "  -t, --tcp N              number of TCP clients (default 1)\n"
+            "  -u, --udp N              number of UDP clients (default 0)\n"
+            "  -r, --rate R             commands per second per client (default 10)\n"
+            "  -w, --window N           max outstanding commands per client (default 1)\n"
+            "  -d, --duration S         seconds to run, 0 = until interrupted (default 10)\n"
+            "  -i, --interval S         seconds between reports (default 1)\n"
+            "  -T, --timeout MS         reply timeout (default 1000)\n"
+            "  -m, --mix MIX            command weights (default set=50,inc=20,mutechan=10,status=20)\n"
+            "  -c, --csv FILE           also write one row per interval to FILE\n"
+            "  -s, --seed N             random seed (default random)\n",
+            argv0);
+}
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void onSignal(int)
+{
+    g_stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOpts[] = {
+        { "host",     required_argument, NULL, 'h' },
+        { "tcp-port", required_argument, NULL, 'p' },
+        { "udp-port", required_argument, NULL, 'P' },
+        { "tcp",      required_argument, NULL, 't' },
+        { "udp",      required_argument, NULL, 'u' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "window",   required_argument, NULL, 'w' },
+        { "duration", required_argument, NULL, 'd' },
+        { "interval", required_argument, NULL, 'i' },
+        { "timeout",  required_argument, NULL, 'T' },
+        { "mix",      required_argument, NULL, 'm' },
+        { "csv",      required_argument, NULL, 'c' },
+        { "seed",     required_argument, NULL, 's' },
+        { "help",     no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options opts;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h:p:P:t:u:r:w:d:i:T:m:c:s:", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.tcpPort = (unsigned short)atoi(optarg); break;
+        case 'P': opts.udpPort = (unsigned short)atoi(optarg); break;
+        case 't': opts.tcpClients = (unsigned)atoi(optarg); break;
+        case 'u': opts.udpClients = (unsigned)atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'w': opts.window = std::max(1, atoi(optarg)); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'i': opts.interval = atof(optarg); break;
+        case 'T': opts.timeoutMs = (unsigned)atoi(optarg); break;
+        case 'm':
+            if (!parseMix(optarg, opts.weights))
+            {
+                fprintf(stderr, "Bad command mix: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c': opts.csvFile = optarg; break;
+        case 's': opts.seed = (unsigned)atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.rate <= 0 || opts.interval <= 0 || opts.tcpClients + opts.udpClients == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    LoadGenerator gen(opts);
+    if (!gen.init())
+        return 1;
+    gen.run(g_stop);
+    return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ * Network impairment proxy for testing clients of the volume control server (server.py) under
+ * bad network conditions, on loopback:
+ *
+ *     vc-netem -u -p 1182 -l 9182 delay=40 jitter=20 loss=10% reorder=5%
+ *     vc-netem -u -p 1182 -f wifi-drops.txt -- vc-cmd -u -r -p {port} inc F 1
+ *
+ * Sits between the client and the server (see NetProxy for what it can do to the traffic). The
+ * impairment is given as key=value words, and can be changed over time with a timeline file
+ * (-f), one phase per line:
+ *
+ *     # seconds  impairment (replaces the previous phase entirely)
+ *     0          delay=20 jitter=5
+ *     2.5        delay=20 loss=50%
+ *     4          stall=800 every=2000
+ *
+ * With a command after --, the proxy is up before the command starts and goes away when it exits,
+ * {port} in its arguments (and $VC_NETEM_PORT) is the port of the proxy, and vc-netem exits with
+ * the command's exit status. That makes a run something a script can check: did the client get
+ * there, and how long did it take, under this profile. The same seed (-S) gives the same losses.
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "NetProxy.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int)
+{
+    interrupted = 1;
+}
+
+typedef std::vector<std::pair<std::uint64_t, Impairment>> Timeline;
+
+/// \brief Read a timeline file (see above). Returns false after printing why.
+static bool readTimeline(const char *path, Timeline &timeline)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        perror(path);
+        return false;
+    }
+    char line[512];
+    unsigned lineNo = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        ++lineNo;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *end;
+        double secs = strtod(line, &end);
+        if (end == line)
+        {
+            // Blank (or comment only) lines are fine, anything else isn't
+            if (strspn(line, " \t\r\n") != strlen(line))
+            {
+                fprintf(stderr, "%s:%u: expected the time of the phase in seconds\n", path, lineNo);
+                ok = false;
+            }
+            continue;
+        }
+        Impairment imp;
+        std::string error;
+        if (secs < 0 || !imp.parse(end, error))
+        {
+            fprintf(stderr, "%s:%u: %s\n", path, lineNo, secs < 0 ? "negative time" : error.c_str());
+            ok = false;
+            continue;
+        }
+        timeline.emplace_back((std::uint64_t)(secs*1000 + 0.5), imp);
+    }
+    fclose(f);
+    return ok;
+}
+
+static void printCounters(const char *name, const NetProxy::Counters &c)
+{
+    fprintf(stderr, "%s: %lu packets, %lu bytes, %lu dropped, %lu duplicated, %lu reordered, "
+            "delay avg %.1f ms, max %.0f ms\n",
+            name, c.packets, c.bytes, c.dropped, c.duplicated, c.reordered,
+            c.packets ? c.delayMsTotal / c.packets : 0.0, c.delayMsMax);
+}
+
+/// \brief Start argv with {port} replaced. Returns the pid, -1 on failure.
+static pid_t startCommand(char **argv, unsigned port)
+{
+    char portText[8];
+    snprintf(portText, sizeof(portText), "%u", port);
+    std::vector<std::string> args;
+    for (char **a = argv; *a; ++a)
+    {
+        std::string arg(*a);
+        for (std::size_t pos; (pos = arg.find("{port}")) != std::string::npos; )
+            arg.replace(pos, 6, portText);
+        args.push_back(arg);
+    }
+
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    std::vector<char *> cargs;
+    for (std::string &arg: args)
+        cargs.push_back(&arg[0]);
+    cargs.push_back(nullptr);
+    setenv("VC_NETEM_PORT", portText, 1);
+    execvp(cargs[0], cargs.data());
+    fprintf(stderr, "vc-netem: %s: %s\n", cargs[0], strerror(errno));
+    _exit(127);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [KEY=VALUE]... [-- COMMAND [ARGS]...]\n"
+            "  -h, --host HOST          server (default 127.0.0.1)\n"
+            "  -p, --port PORT          port (default 1128 for TCP, 1182 for UDP)\n"
+            "  -t, --tcp                proxy TCP (default)\n"
+            "  -u, --udp                proxy UDP\n"
+            "  -l, --listen PORT        listen on 127.0.0.1:PORT (default: any free port, printed)\n"
+            "  -f, --file FILE          timeline of impairments (see the top of netem.cpp)\n"
+            "  -S, --seed N             seed for the random losses and delays (default 1)\n"
+            "  -d, --duration SECONDS   stop after this long (default: until interrupted, or\n"
+            "                           until COMMAND exits)\n"
+            "  -v, --verbose            print the counters once a second\n"
+            "Impairments: delay=MS jitter=MS dist=uniform|normal|pareto loss=P dup=P\n"
+            "             reorder=P gap=MS rate=KBITS stall=MS every=MS\n"
+            "             (P is 0-1 or a percentage: loss=10%%). Loss, dup and reorder are UDP only.\n"
+            "With COMMAND, {port} in its arguments is the port of the proxy, and the exit status\n"
+            "is the command's.\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOpts[] = {
+        { "host",     required_argument, NULL, 'h' },
+        { "port",     required_argument, NULL, 'p' },
+        { "tcp",      no_argument,       NULL, 't' },
+        { "udp",      no_argument,       NULL, 'u' },
+        { "listen",   required_argument, NULL, 'l' },
+        { "file",     required_argument, NULL, 'f' },
+        { "seed",     required_argument, NULL, 'S' },
+        { "duration", required_argument, NULL, 'd' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "help",     no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    std::string host = "127.0.0.1";
+    std::string port;
+    Transport transport = Transport::Tcp;
+    unsigned listenPort = 0;
+    const char *file = nullptr;
+    unsigned seed = 1;
+    double duration = 0;
+    bool verbose = false;
+    int opt;
+    // '+': the command after -- has options of its own
+    while ((opt = getopt_long(argc, argv, "+h:p:tul:f:S:d:v", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 't': transport = Transport::Tcp; break;
+        case 'u': transport = Transport::Udp; break;
+        case 'l': listenPort = (unsigned)atoi(optarg); break;
+        case 'f': file = optarg; break;
+        case 'S': seed = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 'd': duration = atof(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (port.empty())
+        port = transport == Transport::Tcp ? "1128" : "1182";
+
+    // KEY=VALUE words, then the command (getopt has already eaten the -- if there are no words)
+    Timeline timeline;
+    Impairment base;
+    std::string spec;
+    char **command = nullptr;
+    int i = optind;
+    if (i > 1 && strcmp(argv[i - 1], "--") == 0)
+        command = argv + i;
+    for (; !command && i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--") == 0)
+            command = argv + i + 1;
+        else
+            spec += std::string(spec.empty() ? "" : " ") + argv[i];
+    }
+    std::string error;
+    if (!base.parse(spec.c_str(), error))
+    {
+        fprintf(stderr, "vc-netem: %s\n", error.c_str());
+        return 2;
+    }
+    if (command && !*command)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (file && !readTimeline(file, timeline))
+        return 2;
+
+    Reactor reactor;
+    NetProxy proxy(reactor, transport);
+    proxy.setSeed(seed);
+    proxy.setImpairment(base);
+    if (!proxy.listen(listenPort, host.c_str(), (unsigned)atoi(port.c_str())))
+    {
+        fprintf(stderr, "vc-netem: %s\n", proxy.errorString().c_str());
+        return 1;
+    }
+    fprintf(stderr, "vc-netem: %s 127.0.0.1:%u -> %s:%s, %s\n", transport == Transport::Tcp ? "TCP" : "UDP",
+            proxy.port(), host.c_str(), port.c_str(), base.describe().c_str());
+
+    for (const auto &phase: timeline)
+    {
+        Impairment imp = phase.second;
+        reactor.addTimer((unsigned)phase.first, [&proxy, imp]() {
+                proxy.setImpairment(imp);
+                fprintf(stderr, "vc-netem: now %s\n", imp.describe().c_str());
+            });
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    pid_t child = command ? startCommand(command, proxy.port()) : 0;
+    if (child < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+
+    int result = 0;
+    std::uint64_t start = monotonicMs();
+    std::uint64_t reportAt = start + 1000;
+    while (!interrupted)
+    {
+        reactor.runOnce(child ? 10 : 100);
+        std::uint64_t now = monotonicMs();
+        if (child)
+        {
+            int status;
+            if (waitpid(child, &status, WNOHANG) == child)
+            {
+                result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                fprintf(stderr, "vc-netem: command exited with %d after %.1f ms\n", result,
+                        (double)(now - start));
+                break;
+            }
+        }
+        if (duration > 0 && now - start >= duration*1000)
+            break;
+        if (verbose && now >= reportAt)
+        {
+            reportAt += 1000;
+            printCounters("up", proxy.counters(NetProxy::Up));
+            printCounters("down", proxy.counters(NetProxy::Down));
+        }
+    }
+
+    printCounters("up", proxy.counters(NetProxy::Up));
+    printCounters("down", proxy.counters(NetProxy::Down));
+    proxy.close();
+    return result;
+}
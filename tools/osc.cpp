@@ -0,0 +1,424 @@
+/*
+ * OSC bridge for the volume control server (server.py): lets a control surface (a hardware
+ * controller, or a tablet app like TouchOSC) drive the server, and shows it the server's state.
+ *
+ *     vc-osc -h volume.lan -l 8000 -o 9000
+ *
+ * Listens for OSC on UDP port 8000 and sends the state back to port 9000 of whoever sent the
+ * last message (see OscBridge for the addresses). Fader streams are coalesced to -R commands per
+ * second, whatever rate the surface sends at.
+ *
+ * For trying it out without a surface, -s turns it into a loopback sender that streams a fader
+ * sweep to a bridge and counts what comes back:
+ *
+ *     vc-osc -s -l 8000 -R 200 -d 2 /vc/f
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Client.h"
+#include "OscBridge.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int)
+{
+    interrupted = 1;
+}
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    std::string port;           //!< Empty = the default port of the transport
+    Transport transport = Transport::Tcp;
+    bool reliable = false;
+    unsigned listenPort = 8000;
+    unsigned replyPort = 0;     //!< 0 = reply to the port the surface sends from
+    unsigned rate = 0;          //!< Commands/s (bridge) or messages/s (sender), 0 = default
+    double duration = 2;        //!< Sender: seconds to sweep for
+    bool verbose = false;
+};
+
+/// \brief UDP socket bound to port on all interfaces, -1 (after printing why) on failure
+static int bindUdp(unsigned port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//// Bridge ////
+
+class Bridge : public OscBridgeHandler
+{
+public:
+    Bridge(Reactor &reactor, const Options &opts) :
+        opts(opts), client(reactor, opts.transport), bridge(*this), fd(-1), haveSurface(false)
+    {
+    }
+
+    int run(Reactor &reactor);
+
+private:
+    const Options &opts;
+    Client client;
+    OscBridge bridge;
+    int fd;
+    bool haveSurface;
+    sockaddr_in surface;        //!< Where the state goes
+
+    void sendCommand(const CommandBuffer &cmd) override
+    {
+        if (client.protocol().isConnected())
+            client.protocol().send(cmd);
+    }
+
+    void sendToSurface(const char *data, std::size_t len) override
+    {
+        if (haveSurface)
+            sendto(fd, data, len, 0, (const sockaddr *)&surface, sizeof(surface));
+    }
+
+    void readSurface();
+};
+
+void Bridge::readSurface()
+{
+    char buf[1024];
+    for (;;)
+    {
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+        if (n < 0)
+            break;
+        if (opts.replyPort)
+            from.sin_port = htons((uint16_t)opts.replyPort);
+        bool newSurface = !haveSurface || from.sin_addr.s_addr != surface.sin_addr.s_addr ||
+            from.sin_port != surface.sin_port;
+        surface = from;
+        haveSurface = true;
+        if (newSurface)
+        {
+            if (opts.verbose)
+                fprintf(stderr, "surface %s:%u\n", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+            bridge.mirrorAll();
+        }
+        if (!bridge.received(buf, (std::size_t)n) && opts.verbose)
+            fprintf(stderr, "ignored a %zd byte packet\n", n);
+    }
+}
+
+int Bridge::run(Reactor &reactor)
+{
+    fd = bindUdp(opts.listenPort);
+    if (fd < 0)
+        return 1;
+    reactor.add(fd, Reactor::Read, [this](int, unsigned) { readSurface(); });
+
+    ProtocolCore &core = client.protocol();
+    core.setSubscribe(true);    // Mirror what other clients do too
+    core.setPing(500, 5);       // UDP: the pings are the only news of other clients
+    core.setReliable(opts.reliable);
+    if (opts.rate)
+        bridge.setRate(opts.rate, 4);
+
+    int result = 0;
+    bool done = false;
+    client.statusReceived = [this](const ServerStatus &status) { bridge.statusReceived(status); };
+    client.connected = [this]() { fprintf(stderr, "vc-osc: connected to %s\n", opts.host.c_str()); };
+    client.error = [&](ProtocolError err, const char *detail) {
+        switch (err)
+        {
+        case ProtocolError::ServerError:
+            fprintf(stderr, "vc-osc: server error:%s\n", detail);
+            break;
+        case ProtocolError::ConnectFailed:
+        case ProtocolError::ConnectionLost:
+            fprintf(stderr, "vc-osc: %s:%s: %s\n", opts.host.c_str(), opts.port.c_str(), detail);
+            result = 3;
+            done = true;
+            break;
+        default:
+            break;
+        }
+    };
+    client.disconnected = [&]() {
+        if (done || interrupted)
+            return;             // Our own doing
+        fprintf(stderr, "vc-osc: disconnected: %s\n", client.errorString().c_str());
+        result = 3;
+        done = true;
+    };
+    if (!client.connect(opts.host.c_str(), opts.port.c_str()))
+    {
+        fprintf(stderr, "vc-osc: %s\n", client.errorString().c_str());
+        return 3;
+    }
+
+    uint64_t reportAt = monotonicMs() + 1000;
+    unsigned long lastMessages = 0, lastCommands = 0, lastMirrored = 0;
+    while (!done && !interrupted)
+    {
+        uint64_t now = monotonicMs();
+        uint64_t deadline = bridge.nextDeadline();
+        int waitMs = (int)(reportAt - now);
+        if (deadline && deadline < reportAt)
+            waitMs = deadline > now ? (int)(deadline - now) : 0;
+        reactor.runOnce(waitMs);
+        bridge.tick();
+
+        if (monotonicMs() >= reportAt)
+        {
+            reportAt += 1000;
+            if (opts.verbose && bridge.messages() != lastMessages)
+                fprintf(stderr, "osc in %lu/s, commands out %lu/s, mirrored %lu/s\n",
+                        bridge.messages() - lastMessages, bridge.commands() - lastCommands,
+                        bridge.mirrored() - lastMirrored);
+            lastMessages = bridge.messages();
+            lastCommands = bridge.commands();
+            lastMirrored = bridge.mirrored();
+        }
+    }
+
+    fprintf(stderr, "vc-osc: %lu OSC messages, %lu commands sent, %lu mirrored\n",
+            bridge.messages(), bridge.commands(), bridge.mirrored());
+    client.disconnect();
+    reactor.remove(fd);
+    close(fd);
+    return result;
+}
+
+//// Loopback sender ////
+
+/// \brief One OSC message with a float argument
+static std::size_t oscFloat(char *buf, const char *address, float value)
+{
+    std::size_t len = (strlen(address) + 4) & ~(std::size_t)3;
+    memset(buf, 0, len + 8);
+    memcpy(buf, address, strlen(address));
+    memcpy(buf + len, ",f", 2);
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = htonl(bits);
+    memcpy(buf + len + 4, &bits, 4);
+    return len + 8;
+}
+
+/// \brief Address and value of an OSC message with one float or int argument
+static bool oscParse(const char *buf, std::size_t len, std::string &address, double &value)
+{
+    const char *nul = (const char *)memchr(buf, '\0', len);
+    if (!nul)
+        return false;
+    std::size_t pos = ((std::size_t)(nul - buf) + 4) & ~(std::size_t)3;
+    if (pos + 8 > len || buf[pos] != ',')
+        return false;
+    address.assign(buf, nul);
+    uint32_t bits;
+    memcpy(&bits, buf + pos + 4, 4);
+    bits = ntohl(bits);
+    if (buf[pos + 1] == 'f')
+    {
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        value = f;
+    }
+    else if (buf[pos + 1] == 'i')
+    {
+        value = (int32_t)bits;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static int runSender(const Options &opts, const char *address)
+{
+    int fd = bindUdp(0);
+    if (fd < 0)
+        return 1;
+    sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons((uint16_t)opts.listenPort);
+    if (inet_pton(AF_INET, opts.host.c_str(), &to.sin_addr) != 1)
+    {
+        fprintf(stderr, "vc-osc: -s wants an IPv4 address: %s\n", opts.host.c_str());
+        return 2;
+    }
+
+    unsigned rate = opts.rate ? opts.rate : 200;
+    uint64_t start = monotonicMs();
+    uint64_t end = start + (uint64_t)(opts.duration*1000);
+    unsigned long sent = 0, back = 0;
+    std::map<std::string, double> last;
+
+    auto drain = [&]() {
+        char buf[512];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+        {
+            std::string addr;
+            double value;
+            ++back;
+            if (oscParse(buf, (std::size_t)n, addr, value))
+            {
+                last[addr] = value;
+                if (opts.verbose)
+                    fprintf(stderr, "< %s %g\n", addr.c_str(), value);
+            }
+        }
+    };
+
+    // A triangle from 0 to 1 and back, once a second
+    float value = 0;
+    for (uint64_t now = start; now < end && !interrupted; now = monotonicMs())
+    {
+        double phase = std::fmod((now - start) / 1000.0, 1.0);
+        value = (float)(phase < 0.5 ? 2*phase : 2 - 2*phase);
+        char buf[64];
+        std::size_t len = oscFloat(buf, address, value);
+        sendto(fd, buf, len, 0, (sockaddr *)&to, sizeof(to));
+        ++sent;
+        drain();
+
+        uint64_t next = start + sent*1000/rate;
+        uint64_t t = monotonicMs();
+        if (next > t)
+        {
+            struct timespec ts = { 0, (long)(next - t)*1000000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+    double secs = (monotonicMs() - start) / 1000.0;
+
+    // The last value is mirrored back once the fader has been let go
+    for (uint64_t settle = monotonicMs() + 1000; monotonicMs() < settle && !interrupted; )
+    {
+        struct timespec ts = { 0, 10000000L };
+        nanosleep(&ts, NULL);
+        drain();
+    }
+
+    printf("sent %lu messages in %.2f s (%.0f/s), last %s %.3f (level %d)\n",
+           sent, secs, sent / (secs > 0 ? secs : 1), address, value, (int)(value*99 + 0.5));
+    printf("got %lu messages back\n", back);
+    for (const auto &entry: last)
+        printf("  %s %g\n", entry.first.c_str(), entry.second);
+    close(fd);
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]               bridge OSC to the server\n"
+            "       %s -s [options] [ADDRESS]  stream a fader sweep to a bridge (default /vc/f)\n"
+            "  -h, --host HOST          server (with -s: the bridge, default 127.0.0.1)\n"
+            "  -p, --port PORT          server port (default 1128 for TCP, 1182 for UDP)\n"
+            "  -t, --tcp                use TCP (default)\n"
+            "  -u, --udp                use UDP\n"
+            "  -r, --reliable           UDP: have commands acknowledged, resend lost ones\n"
+            "  -l, --listen PORT        OSC port of the bridge (default 8000)\n"
+            "  -o, --reply-port PORT    send the state to this port of the surface\n"
+            "                           (default: the port it sends from)\n"
+            "  -R, --rate N             commands/s to the server (default 40);\n"
+            "                           with -s: messages/s to send (default 200)\n"
+            "  -s, --send               loopback sender, for testing\n"
+            "  -d, --duration SECONDS   with -s: how long to sweep (default 2)\n"
+            "  -v, --verbose            print rates once a second (with -s: what comes back)\n",
+            argv0, argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOpts[] = {
+        { "host",       required_argument, NULL, 'h' },
+        { "port",       required_argument, NULL, 'p' },
+        { "tcp",        no_argument,       NULL, 't' },
+        { "udp",        no_argument,       NULL, 'u' },
+        { "reliable",   no_argument,       NULL, 'r' },
+        { "listen",     required_argument, NULL, 'l' },
+        { "reply-port", required_argument, NULL, 'o' },
+        { "rate",       required_argument, NULL, 'R' },
+        { "send",       no_argument,       NULL, 's' },
+        { "duration",   required_argument, NULL, 'd' },
+        { "verbose",    no_argument,       NULL, 'v' },
+        { "help",       no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options opts;
+    bool send = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h:p:turl:o:R:sd:v", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 't': opts.transport = Transport::Tcp; break;
+        case 'u': opts.transport = Transport::Udp; break;
+        case 'r': opts.reliable = true; break;
+        case 'l': opts.listenPort = (unsigned)atoi(optarg); break;
+        case 'o': opts.replyPort = (unsigned)atoi(optarg); break;
+        case 'R': opts.rate = (unsigned)atoi(optarg); break;
+        case 's': send = true; break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'v': opts.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc - (send ? 1 : 0))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (opts.port.empty())
+        opts.port = opts.transport == Transport::Tcp ? "1128" : "1182";
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    if (send)
+        return runSender(opts, optind < argc ? argv[optind] : "/vc/f");
+
+    Reactor reactor;
+    Bridge bridge(reactor, opts);
+    return bridge.run(reactor);
+}
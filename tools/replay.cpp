@@ -0,0 +1,641 @@
+/*
+ * Replays sessions recorded with the Qt GUI's --capture option (see core/SessionCapture.h).
+ *
+ * Two directions:
+ *
+ *  - Against a server (default): the recorded commands are sent to a server at their recorded
+ *    times (scaled by --speed), the replies are compared with the recorded ones and the reply
+ *    latency is reported next to the recorded latency. Reproduces lag and server-side bugs.
+ *
+ *  - As a server (--serve PORT): waits for a client and feeds it the recorded replies at their
+ *    recorded times, printing whatever the client sends. Reproduces client-side parser and
+ *    display bugs without the device.
+ *
+ * --speed 0 replays as fast as possible, which makes the runs deterministic apart from timing
+ * and handy for regression tests.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SessionCapture.h"
+#include "Status.h"
+
+typedef SessionCapture::Record Record;
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/// Printable version of recorded data (newlines and such escaped)
+static std::string printable(const std::string &data)
+{
+    std::string out;
+    for (unsigned char c : data)
+    {
+        if (c == '\n')
+            out += "\\n";
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            char hex[5];
+            snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        }
+        else
+            out += (char)c;
+    }
+    return out;
+}
+
+struct Session
+{
+    std::string description;
+    bool tcp = true;            //!< From the recorded "connect tcp/udp" event
+    std::string host;
+    unsigned short port = 0;
+    std::vector<Record> records;
+};
+
+static bool loadSessions(const char *path, std::vector<Session> &sessions)
+{
+    SessionCapture::Reader reader;
+    if (!reader.open(path))
+    {
+        fprintf(stderr, "%s: can't open or not a capture file\n", path);
+        return false;
+    }
+
+    Record rec;
+    while (reader.next(rec))
+    {
+        if (rec.type == SessionCapture::Session)
+        {
+            sessions.push_back(Session());
+            sessions.back().description = rec.data;
+            continue;
+        }
+        if (sessions.empty())
+            sessions.push_back(Session()); // shouldn't happen, but don't lose anything
+        Session &s = sessions.back();
+        if (rec.type == SessionCapture::Event && rec.data.compare(0, 8, "connect ") == 0)
+        {
+            char transport[8], host[256];
+            unsigned port;
+            if (sscanf(rec.data.c_str(), "connect %7s %255s %u", transport, host, &port) == 3)
+            {
+                s.tcp = strcmp(transport, "udp") != 0;
+                s.host = host;
+                s.port = (unsigned short)port;
+            }
+        }
+        s.records.push_back(rec);
+    }
+    return true;
+}
+
+static void dump(const std::vector<Session> &sessions)
+{
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+        const Session &s = sessions[i];
+        printf("session %zu: %s\n", i, s.description.c_str());
+        for (const Record &rec : s.records)
+            printf("%10.6f %c %s\n", rec.timeUs/1e6, (char)rec.type, printable(rec.data).c_str());
+    }
+}
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    unsigned short port = 0;    //!< 0 = as recorded, or the default port of the transport
+    int transport = 0;          //!< 0 = as recorded, 't' or 'u' to override
+    double speed = 1.0;         //!< 0 = as fast as possible
+    unsigned short servePort = 0;
+    int session = -1;           //!< -1 = all
+    unsigned timeoutMs = 1000;
+    bool verbose = false;
+    bool restore = false;       //!< Put the server in the recorded state first
+};
+
+class Replayer
+{
+public:
+    explicit Replayer(const Options &opts) : opts(opts) {}
+
+    /// Drive session against a server, returns the number of mismatching replies (-1 on errors)
+    int drive(const Session &session);
+    /// Act as the server for session, returns -1 on errors
+    int serve(const Session &session);
+
+private:
+    bool connectTo(bool tcp, unsigned short port);
+    bool restoreState(const Session &session);
+    void receive(uint64_t now);
+    void handleReply(const std::string &line, uint64_t now);
+
+    const Options &opts;
+    int fd = -1;
+    bool tcp = true;
+    std::string rx;
+
+    // drive state
+    std::deque<uint64_t> pending;      //!< Send times of commands waiting for a reply
+    std::deque<std::string> expected;  //!< Recorded replies, in order
+    std::vector<uint64_t> latencies;
+    unsigned replies = 0, mismatches = 0, pushed = 0;
+};
+
+bool Replayer::connectTo(bool useTcp, unsigned short port)
+{
+    tcp = useTcp;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    int err = getaddrinfo(opts.host.c_str(), NULL, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "Could not resolve %s: %s\n", opts.host.c_str(), gai_strerror(err));
+        return false;
+    }
+    struct sockaddr_in addr;
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+    if (tcp)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void Replayer::handleReply(const std::string &line, uint64_t now)
+{
+    if (line.compare(0, 7, "STATUS ") == 0)
+    {
+        ++pushed;               // pushed by the server, timing depends on other clients
+        return;
+    }
+    ++replies;
+    if (!pending.empty())
+    {
+        latencies.push_back(now - pending.front());
+        pending.pop_front();
+    }
+    if (!expected.empty())
+    {
+        if (line != expected.front())
+        {
+            ++mismatches;
+            if (opts.verbose || mismatches <= 5)
+                printf("  reply %u differs:\n    recorded: %s\n    got:      %s\n", replies,
+                       printable(expected.front()).c_str(), printable(line).c_str());
+        }
+        expected.pop_front();
+    }
+}
+
+void Replayer::receive(uint64_t now)
+{
+    char buf[2048];
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            close(fd);
+            fd = -1;
+        }
+        return;
+    }
+    if (!tcp)
+    {
+        handleReply(std::string(buf, n), now);
+        return;
+    }
+    rx.append(buf, n);
+    size_t start = 0, nl;
+    while ((nl = rx.find('\n', start)) != std::string::npos)
+    {
+        handleReply(rx.substr(start, nl + 1 - start), now);
+        start = nl + 1;
+    }
+    rx.erase(0, start);
+}
+
+/*
+ * Send the commands needed to bring the server to the state in the first recorded status, so that
+ * the replies of the replay can match the recorded ones. Waits for the replies (TCP) or a status
+ * (UDP) before returning.
+ */
+bool Replayer::restoreState(const Session &session)
+{
+    const Record *first = nullptr;
+    for (const Record &rec : session.records)
+        if (rec.type == SessionCapture::Received && rec.data.find("0: (") != std::string::npos)
+        {
+            first = &rec;
+            break;
+        }
+    if (!first)
+    {
+        fprintf(stderr, "  no status recorded, can't restore state\n");
+        return false;
+    }
+
+    ServerStatus status;
+    if (!parseStatus(first->data.data(), first->data.size(), status))
+    {
+        fprintf(stderr, "  can't parse recorded status: %s\n", printable(first->data).c_str());
+        return false;
+    }
+    const int v[14] = {
+        status.fl_level, status.fr_level, status.fl_mute, status.fr_mute,
+        status.sub_level, status.cen_level, status.sub_mute, status.cen_mute,
+        status.rl_level, status.rr_level, status.rl_mute, status.rr_mute,
+        status.master, status.global_mute,
+    };
+
+    // Pots in status order, left channel first
+    static const char *const channels[3][2] = { { "FL", "FR" }, { "SUB", "CEN" }, { "RL", "RR" } };
+    std::string cmds;
+    char line[64];
+    for (int pot = 0; pot < 3; ++pot)
+        for (int lr = 0; lr < 2; ++lr)
+        {
+            snprintf(line, sizeof(line), "set %s %d\nmutechan %s %d\n", channels[pot][lr], v[pot*4 + lr],
+                     channels[pot][lr], v[pot*4 + 2 + lr]);
+            cmds += line;
+        }
+    snprintf(line, sizeof(line), "setmaster %d\nmute %d\nstatus\n", v[12], v[13]);
+    cmds += line;
+
+    // One command per datagram for UDP, which only answers the final status
+    size_t start = 0, nl;
+    unsigned waitFor = 0;
+    while ((nl = cmds.find('\n', start)) != std::string::npos)
+    {
+        size_t len = tcp ? nl + 1 - start : nl - start;
+        if (send(fd, cmds.data() + start, len, 0) < 0)
+        {
+            perror("send");
+            return false;
+        }
+        if (tcp)
+            ++waitFor;
+        start = nl + 1;
+    }
+    if (!tcp)
+        waitFor = 1;
+
+    uint64_t deadline = nowUs() + (uint64_t)opts.timeoutMs*1000;
+    char buf[2048];
+    while (waitFor > 0 && nowUs() < deadline)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) <= 0)
+            continue;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return false;
+        if (!tcp)
+            --waitFor;
+        else
+            for (ssize_t i = 0; i < n; ++i)
+                if (buf[i] == '\n' && waitFor > 0)
+                    --waitFor;
+    }
+    if (waitFor > 0)
+    {
+        fprintf(stderr, "  timed out restoring state\n");
+        return false;
+    }
+    return true;
+}
+
+int Replayer::drive(const Session &session)
+{
+    bool useTcp = opts.transport ? opts.transport == 't' : session.tcp;
+    unsigned short port = opts.port ? opts.port : (session.port ? session.port : (useTcp ? 1128 : 1182));
+    if (!connectTo(useTcp, port))
+        return -1;
+    if (opts.restore && !restoreState(session))
+    {
+        close(fd);
+        fd = -1;
+        return -1;
+    }
+
+    // Recorded latency: from each command to the next reply that isn't a pushed status. UDP only
+    // replies to status, so only those count there. Replies are only compared when replaying
+    // over the transport the session was recorded with, the two reply differently.
+    std::vector<uint64_t> recorded;
+    std::deque<uint64_t> recPending;
+    for (const Record &rec : session.records)
+    {
+        if (rec.type == SessionCapture::Sent && (session.tcp || rec.data.compare(0, 6, "status") == 0))
+            recPending.push_back(rec.timeUs);
+        else if (rec.type == SessionCapture::Received && rec.data.compare(0, 7, "STATUS ") != 0)
+        {
+            if (tcp == session.tcp)
+                expected.push_back(rec.data);
+            if (!recPending.empty())
+            {
+                recorded.push_back(rec.timeUs - recPending.front());
+                recPending.pop_front();
+            }
+        }
+    }
+
+    uint64_t start = nowUs();
+    unsigned sent = 0;
+    for (const Record &rec : session.records)
+    {
+        if (rec.type != SessionCapture::Sent)
+            continue;
+        // Wait for the recorded time, handling replies meanwhile
+        for (;;)
+        {
+            uint64_t now = nowUs();
+            uint64_t due = start + (opts.speed > 0 ? (uint64_t)(rec.timeUs/opts.speed) : 0);
+            if (now >= due || fd < 0)
+                break;
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, (int)std::max<uint64_t>(1, (due - now)/1000)) > 0)
+                receive(nowUs());
+        }
+        if (fd < 0)
+        {
+            fprintf(stderr, "Server closed the connection after %u commands\n", sent);
+            break;
+        }
+        // TCP commands end in a newline, UDP datagrams don't
+        std::string data = rec.data;
+        if (tcp && !session.tcp)
+            data += '\n';
+        else if (!tcp && session.tcp && !data.empty() && data.back() == '\n')
+            data.erase(data.size() - 1);
+        if (tcp || data.compare(0, 6, "status") == 0)
+            pending.push_back(nowUs());
+        if (send(fd, data.data(), data.size(), 0) < 0)
+        {
+            perror("send");
+            break;
+        }
+        ++sent;
+    }
+
+    // Collect the outstanding replies
+    uint64_t deadline = nowUs() + (uint64_t)opts.timeoutMs*1000;
+    while (fd >= 0 && !pending.empty() && nowUs() < deadline)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 10) > 0)
+            receive(nowUs());
+    }
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+
+    auto percentile = [](std::vector<uint64_t> v, double q) -> uint64_t {
+        if (v.empty())
+            return 0;
+        std::sort(v.begin(), v.end());
+        return v[std::min(v.size() - 1, (size_t)(q*v.size()))];
+    };
+    printf("  %u commands sent, %u replies (%zu missing), %u pushed statuses, %u mismatches\n",
+           sent, replies, pending.size(), pushed, mismatches);
+    printf("  latency p50/p99/max: replay %llu/%llu/%llu us, recorded %llu/%llu/%llu us\n",
+           (unsigned long long)percentile(latencies, 0.5), (unsigned long long)percentile(latencies, 0.99),
+           (unsigned long long)percentile(latencies, 1.0),
+           (unsigned long long)percentile(recorded, 0.5), (unsigned long long)percentile(recorded, 0.99),
+           (unsigned long long)percentile(recorded, 1.0));
+
+    int result = (int)(mismatches + pending.size());
+    pending.clear();
+    expected.clear();
+    latencies.clear();
+    replies = mismatches = pushed = 0;
+    return result;
+}
+
+int Replayer::serve(const Session &session)
+{
+    bool useTcp = opts.transport ? opts.transport == 't' : session.tcp;
+
+    int lfd = socket(AF_INET, useTcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(opts.servePort);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || (useTcp && listen(lfd, 1) < 0))
+    {
+        perror("bind");
+        close(lfd);
+        return -1;
+    }
+
+    printf("  waiting for a %s client on port %u\n", useTcp ? "TCP" : "UDP", opts.servePort);
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
+    if (useTcp)
+    {
+        fd = accept(lfd, (struct sockaddr *)&peer, &peerLen);
+        close(lfd);
+        if (fd < 0)
+        {
+            perror("accept");
+            return -1;
+        }
+    }
+    else
+    {
+        // The client's first datagram tells us where to send to
+        char buf[2048];
+        ssize_t n = recvfrom(lfd, buf, sizeof(buf), 0, (struct sockaddr *)&peer, &peerLen);
+        if (n < 0 || connect(lfd, (struct sockaddr *)&peer, peerLen) < 0)
+        {
+            perror("recvfrom");
+            close(lfd);
+            return -1;
+        }
+        printf("  client: %s\n", printable(std::string(buf, n)).c_str());
+        fd = lfd;
+    }
+    tcp = useTcp;
+
+    // Recorded times are relative to the session start, the client only connected a bit later
+    uint64_t offset = 0;
+    for (const Record &rec : session.records)
+        if (rec.type == SessionCapture::Event && rec.data == "connected")
+        {
+            offset = rec.timeUs;
+            break;
+        }
+
+    uint64_t start = nowUs();
+    unsigned fed = 0;
+    for (const Record &rec : session.records)
+    {
+        if (rec.type != SessionCapture::Received)
+            continue;
+        uint64_t t = rec.timeUs > offset ? rec.timeUs - offset : 0;
+        for (;;)
+        {
+            uint64_t now = nowUs();
+            uint64_t due = start + (opts.speed > 0 ? (uint64_t)(t/opts.speed) : 0);
+            if (now >= due || fd < 0)
+                break;
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, (int)std::max<uint64_t>(1, (due - now)/1000)) > 0)
+            {
+                char buf[2048];
+                ssize_t n = recv(fd, buf, sizeof(buf), 0);
+                if (n <= 0)
+                {
+                    close(fd);
+                    fd = -1;
+                    break;
+                }
+                printf("  client: %s\n", printable(std::string(buf, n)).c_str());
+            }
+        }
+        if (fd < 0)
+        {
+            fprintf(stderr, "Client went away after %u replies\n", fed);
+            return -1;
+        }
+        send(fd, rec.data.data(), rec.data.size(), 0);
+        ++fed;
+    }
+    printf("  fed %u recorded replies\n", fed);
+    close(fd);
+    fd = -1;
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] CAPTURE\n"
+            "  -d, --dump               print the recorded sessions and exit\n"
+            "  -h, --host HOST          server to replay against (default 127.0.0.1)\n"
+            "  -p, --port PORT          port (default as recorded)\n"
+            "  -t, --tcp                use TCP (default as recorded)\n"
+            "  -u, --udp                use UDP (default as recorded)\n"
+            "  -x, --speed X            replay speed, 2 = twice as fast, 0 = as fast as possible (default 1)\n"
+            "  -s, --serve PORT         act as the server, feeding a client the recorded replies\n"
+            "  -S, --session N          only replay session N (default all)\n"
+            "  -T, --timeout MS         how long to wait for the last replies (default 1000)\n"
+            "  -r, --restore            first put the server in the state of the first recorded status\n"
+            "  -v, --verbose            print every mismatching reply\n"
+            "Exits with 1 if any reply differed from the recording or went missing.\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOpts[] = {
+        { "dump",    no_argument,       NULL, 'd' },
+        { "host",    required_argument, NULL, 'h' },
+        { "port",    required_argument, NULL, 'p' },
+        { "tcp",     no_argument,       NULL, 't' },
+        { "udp",     no_argument,       NULL, 'u' },
+        { "speed",   required_argument, NULL, 'x' },
+        { "serve",   required_argument, NULL, 's' },
+        { "session", required_argument, NULL, 'S' },
+        { "timeout", required_argument, NULL, 'T' },
+        { "restore", no_argument,       NULL, 'r' },
+        { "verbose", no_argument,       NULL, 'v' },
+        { "help",    no_argument,       NULL, '?' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Options opts;
+    bool dumpOnly = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dh:p:tux:s:S:T:rv", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': dumpOnly = true; break;
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = (unsigned short)atoi(optarg); break;
+        case 't': opts.transport = 't'; break;
+        case 'u': opts.transport = 'u'; break;
+        case 'x': opts.speed = atof(optarg); break;
+        case 's': opts.servePort = (unsigned short)atoi(optarg); break;
+        case 'S': opts.session = atoi(optarg); break;
+        case 'T': opts.timeoutMs = (unsigned)atoi(optarg); break;
+        case 'r': opts.restore = true; break;
+        case 'v': opts.verbose = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || opts.speed < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Session> sessions;
+    if (!loadSessions(argv[optind], sessions))
+        return 1;
+    if (dumpOnly)
+    {
+        dump(sessions);
+        return 0;
+    }
+
+    Replayer replayer(opts);
+    int failed = 0;
+    for (size_t i = 0; i < sessions.size(); ++i)
+    {
+        if (opts.session >= 0 && (size_t)opts.session != i)
+            continue;
+        printf("session %zu: %s\n", i, sessions[i].description.c_str());
+        int result = opts.servePort ? replayer.serve(sessions[i]) : replayer.drive(sessions[i]);
+        if (result != 0)
+            failed = 1;
+    }
+    return failed;
+}
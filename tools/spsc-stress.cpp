@@ -0,0 +1,218 @@
+/*
+ * Stress test for the lock-free hand-over between the GUI and its network thread (see
+ * qt-gui/ProtocolThread): SpscQueue for commands one way, LatestValue for statuses the other,
+ * and the wake-up/notification flags that keep it down to one event per batch. Meant to be run
+ * under ThreadSanitizer, which is how make builds it:
+ *
+ *     make -C tools stress
+ *     vc-spsc-stress -n 5000000 -s 50
+ *
+ * Two threads play the two sides the way ProtocolThread does, Qt's posted events standing in as a
+ * mutex protected event queue per thread. The "GUI" pushes numbered commands (CommandBuffers, as
+ * the real thing) and posts a wake-up when it sets the flag; the "network thread" pops them all
+ * per wake-up, checks they come in order, and publishes a status per command with every field set
+ * to its number. The GUI takes statuses when notified and checks that none is torn or older than
+ * the one before. At the end the very last status must have made it across: a lost wake-up or
+ * notification would leave it behind. Exits 1 on any of those, TSan adds its own reports (and
+ * exit status) for races.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "Command.h"
+#include "LatestValue.h"
+#include "SpscQueue.h"
+
+/// Stands in for a ServerStatus: every field is seq, so a torn copy shows
+struct Snapshot
+{
+    unsigned seq;
+    unsigned fields[14];
+};
+
+/// Posted events of one thread: post from anywhere, wait/poll from the owner
+class EventQueue
+{
+public:
+    void post(int event)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(event);
+        cond.notify_one();
+    }
+
+    int wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return !events.empty(); });
+        int event = events.front();
+        events.pop_front();
+        return event;
+    }
+
+    bool poll(int &event)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (events.empty())
+            return false;
+        event = events.front();
+        events.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<int> events;
+};
+
+enum { WakeUp, StatusAvailable, Quit };
+
+static void fail(const char *what, unsigned got, unsigned expected)
+{
+    fprintf(stderr, "vc-spsc-stress: %s: got %u, expected %u\n", what, got, expected);
+    exit(1);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n, --count N            commands to send (default 2000000)\n"
+            "  -s, --slow US            network thread sleeps this long per wake-up, so that the\n"
+            "                           queue fills up (default 0)\n",
+            argv0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOpts[] = {
+        { "count", required_argument, NULL, 'n' },
+        { "slow",  required_argument, NULL, 's' },
+        { "help",  no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    unsigned count = 2000000;
+    unsigned slowUs = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:s:h", longOpts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': count = (unsigned)strtoul(optarg, NULL, 10); break;
+        case 's': slowUs = (unsigned)strtoul(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    SpscQueue<CommandBuffer, 256> commands;
+    std::atomic<bool> wakePending(false);
+    LatestValue<Snapshot> status;
+    std::atomic<bool> statusNotified(false);
+    EventQueue networkEvents, guiEvents;
+    unsigned long wakeUps = 0, notifications = 0, takes = 0, queueFull = 0;
+
+    std::thread network([&]() {
+        unsigned expected = 0;
+        while (networkEvents.wait() != Quit)
+        {
+            // As ProtocolThread::drainCommands
+            wakePending.exchange(false, std::memory_order_acq_rel);
+            if (slowUs)
+                usleep(slowUs);
+            CommandBuffer cmd;
+            while (commands.pop(cmd))
+            {
+                unsigned seq = (unsigned)strtoul(cmd.data() + 10, NULL, 10); // "setmaster N\n"
+                if (seq != expected % 100000)
+                    fail("command out of order", seq, expected % 100000);
+                ++expected;
+
+                Snapshot s;
+                s.seq = expected;
+                for (unsigned &f: s.fields)
+                    f = expected;
+                status.publish(s);
+                if (!statusNotified.exchange(true, std::memory_order_acq_rel))
+                {
+                    ++notifications;
+                    guiEvents.post(StatusAvailable);
+                }
+            }
+        }
+        if (expected != count)
+            fail("commands received", expected, count);
+    });
+
+    unsigned lastSeq = 0;
+    auto processGuiEvents = [&]() {
+        int event;
+        while (guiEvents.poll(event))
+        {
+            // As ProtocolThread::takeStatus
+            statusNotified.store(false, std::memory_order_release);
+            Snapshot s;
+            if (!status.take(s))
+                continue;
+            ++takes;
+            for (unsigned f: s.fields)
+            {
+                if (f != s.seq)
+                    fail("torn status", f, s.seq);
+            }
+            if (s.seq <= lastSeq)
+                fail("status went backwards", s.seq, lastSeq + 1);
+            lastSeq = s.seq;
+        }
+    };
+
+    CommandBuffer cmd;
+    for (unsigned i = 0; i < count; )
+    {
+        cmd.begin(Command::SetMaster).arg((int)(i % 100000)).end();
+        if (commands.push(cmd))
+        {
+            ++i;
+            // As ProtocolThread::enqueue
+            if (!wakePending.exchange(true, std::memory_order_acq_rel))
+            {
+                ++wakeUps;
+                networkEvents.post(WakeUp);
+            }
+        }
+        else
+        {
+            ++queueFull;
+            std::this_thread::yield();
+        }
+        if ((i & 63) == 0)
+            processGuiEvents();
+    }
+
+    // Everything sent, now the last status has to arrive without any further prodding
+    for (unsigned spins = 0; lastSeq < count && spins < 10000000; ++spins)
+    {
+        processGuiEvents();
+        std::this_thread::yield();
+    }
+    networkEvents.post(Quit);
+    network.join();
+
+    printf("%u commands in order, %lu wake-ups, %lu times full; %lu notifications, %lu statuses "
+           "taken, last %u\n", count, wakeUps, queueFull, notifications, takes, lastSeq);
+    if (lastSeq != count)
+        fail("last status", lastSeq, count);
+    return 0;
+}
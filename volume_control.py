@@ -1,7 +1,9 @@
 import sys
 import math
+import utime as time
 import usocket as socket
 import uerrno as errno
+from state_store import StateStore
 
 if sys.platform == 'linux':
     # Use dummy MCP42XXX for testing on Linux
@@ -21,6 +23,13 @@ else:
 # logarithmic digital potentiometer.
 g_logarithmic_mapping = [0] + [int(MCP42XXX.MAX_VALUE*(math.log(i)/math.log(100)) + 1.0) for i in range(1, 100)]
 
+# Layout of the status buffer (see VolumeController.get_status_bytes).
+# Every field has a fixed width so that it can be patched in place.
+STATUS_PREFIX = b'OK '
+STATUS_POT_LEN = len(b'0: (99,99,0,0); ')
+STATUS_MASTER_LABEL = b'Master: '
+STATUS_MUTE_LABEL = b' Mute: '
+
 # Our 6 channel volume controller
 class VolumeController(object):
     NUMCHANNELS = 6
@@ -36,13 +45,32 @@ class VolumeController(object):
     SUB = L
     CEN = R
 
-    def __init__(self):
+    def __init__(self, store=None):
+        """store is the StateStore used to persist state between boots
+           (a default one is created if None)."""
         self.pot = MCP42XXX(baudrate=40000, daisyCount=self.NUMPOTS)
-        self.levels = [[self.MAX_LEVEL,self.MAX_LEVEL] for _ in range(self.NUMPOTS)] # TODO: initialize from values stored to flash (re-store periodically, or on request)
+        self.levels = [[self.MAX_LEVEL,self.MAX_LEVEL] for _ in range(self.NUMPOTS)]
         self.master = self.MAX_LEVEL // 2
         self.mutes  = [[False,False] for _ in range(self.NUMPOTS)]
-        self.push_levels()
         self.mute_state = False
+        self.version = 0        # incremented on every change, lets servers notice changes made by others
+        self._held = False      # push_levels only notes that a push is due (see hold)
+        self._push_pending = False
+        # Counters for the stats command (see server.VolumeServer.stats_line)
+        self.pushes = 0
+        self.push_avg_us = 0    # moving average
+        self.push_max_us = 0
+
+        # Restore last known state before the first push so we don't
+        # blast the defaults at the amplifier on every boot
+        self.store = store or StateStore()
+        if self.store.load(self):
+            print("VolumeController: restored state in {} us".format(self.store.restore_us))
+        if self.mute_state:
+            self.pot.shdn_all()
+        self.push_levels()
+
+        self._build_status()
 
     def reset(self):
         """Resets the volume controller. Do not confuse with the RESET pin on
@@ -51,8 +79,10 @@ class VolumeController(object):
         """
         self.levels = [[0,0] for _ in range(self.NUMPOTS)] # TODO: memset instead of realloc
         self.master = self.MAX_LEVEL
+        self._changed()
         self.push_levels()
         self.unmute()
+        self._build_status()
 
     def volume_sweep(self):
         """Test routine that sweeps the volume of all potentiometers"""
@@ -64,16 +94,47 @@ class VolumeController(object):
             for i in reversed(g_logarithmic_mapping):
                 self.pot.set_chain([i, i, i])
 
+    def hold(self):
+        """Hold back pushes to the pots until release (or flush), so that
+           a whole batch of changes costs one push instead of one per
+           change. Used by the server loop. Global mute (the SHDN pin)
+           is never held back."""
+        self._held = True
+
+    def release(self):
+        """End hold, pushing the levels if anything changed meanwhile"""
+        self._held = False
+        self.flush()
+
+    def flush(self):
+        """Push the levels now if a push has been held back"""
+        if self._push_pending:
+            self._push_pending = False
+            self._write_levels()
+
     def push_levels(self):
-        """Sets the actual value of the pots to correspond to self.levels"""
+        """Sets the actual value of the pots to correspond to self.levels
+           (on release if held, see hold)"""
+        if self._held:
+            self._push_pending = True
+        else:
+            self._write_levels()
+
+    def _write_levels(self):
         global g_logarithmic_mapping
 
+        start = time.ticks_us()
         # TODO: restructure self.levels and self.mutes in a way that requires less zipping here...
         for chan, values in zip([MCP42XXX.P0, MCP42XXX.P1], zip(zip(*self.levels), zip(*self.mutes))):
             # Since we always send everything we neatly avoid the glitch where a channel is unshdn:ed by even a regular NOP
             self.pot.set_chain(['shdn' if mute else (g_logarithmic_mapping[level]*g_logarithmic_mapping[self.master]//MCP42XXX.MAX_VALUE)
                                 for level, mute in zip(*values)],
                                [chan]*self.NUMPOTS)
+        us = time.ticks_diff(time.ticks_us(), start)
+        self.pushes += 1
+        self.push_avg_us += (us - self.push_avg_us) >> 4
+        if us > self.push_max_us:
+            self.push_max_us = us
 
     def set_volume(self, schannel, lr, level):
         """Set the volume of a particular channel, possibly setting both
@@ -101,7 +162,9 @@ class VolumeController(object):
             self.levels[schannel][lr] = level
 
         # TODO: only push_levels if something actually changed
+        self._changed()
         self.push_levels()
+        self._status_levels(schannel)
 
     def set_mute(self, schannel, lr, state):
         """Set mute state of a particular channel.
@@ -124,8 +187,40 @@ class VolumeController(object):
             self.mutes[schannel][lr] = state
 
         # TODO: only push_levels if something actually changed
+        self._changed()
         self.push_levels()
+        self._status_mutes(schannel)
+
+
+    def step_volume(self, schannel, lr, step):
+        """Change the volume of a channel by step (which may be
+           negative), clamping the result to MIN_LEVEL..MAX_LEVEL. For
+           lr == LR both channels are stepped, so the balance between
+           them is kept until one of them hits the limit. Returns the
+           new level (the max of L/R for LR, like get_volume).
 
+        """
+        if schannel < 0 or schannel > self.NUMPOTS:
+            raise ValueError("schannel out of bounds")
+        if lr not in (self.L, self.R, self.LR):
+            raise ValueError("lr out of bounds")
+
+        levels = self.levels[schannel]
+        changed = False
+        for side in ((self.L, self.R) if lr == self.LR else (lr,)):
+            level = levels[side]
+            if level is None:
+                continue
+            level = min(max(level + step, self.MIN_LEVEL), self.MAX_LEVEL)
+            if level != levels[side]:
+                levels[side] = level
+                changed = True
+
+        if changed:
+            self._changed()
+            self.push_levels()
+            self._status_levels(schannel)
+        return self.get_volume(schannel, lr)
 
     def get_volume(self, schannel, lr):
         """Same parameters as set_volume, except it gets the volume instead.
@@ -146,8 +241,21 @@ class VolumeController(object):
 
     def set_master(self, level):
         """Set the master volume level (scales down the value sent to all other pots)."""
+        if level > self.MAX_LEVEL or level < self.MIN_LEVEL:
+            raise ValueError("level out of bounds")
         self.master = level
+        self._changed()
         self.push_levels()
+        self._put2(self.status_master_offset, level)
+
+    def step_master(self, step):
+        """Change the master volume level by step (which may be
+           negative), clamped to MIN_LEVEL..MAX_LEVEL. Returns the new
+           level."""
+        level = min(max(self.master + step, self.MIN_LEVEL), self.MAX_LEVEL)
+        if level != self.master:
+            self.set_master(level)
+        return level
 
     def get_master(self):
         """Get the master volume level"""
@@ -157,28 +265,101 @@ class VolumeController(object):
         """Set global mute state"""
         self.pot.shdn_all()     # Implemented by pulling SHDN pin low
         self.mute_state = True
+        self._changed()
+        self.status[self.status_mute_offset] = 0x31
 
     def unmute(self):
         """Unset global mute state"""
         self.pot.unshdn_all()
         self.mute_state = False
+        self._changed()
+        self.status[self.status_mute_offset] = 0x30
         # when bringing SHDN pin high MCP42XXX will remove SHDN status
         # from any pot that was put in this state through a command,
         # thus we need to resend the volume controller state to the
         # daisy chain so that individually muted channels won't be
-        # unmuted
-        self.push_levels()
+        # unmuted. Right away, even when held.
+        self._push_pending = False
+        self._write_levels()
+
+    def _changed(self):
+        self.version += 1
+        self.store.mark_dirty()
+
+    def idle_timeout(self):
+        """How many ms the server loop may sleep before idle() needs to
+           be called, or None if it may sleep indefinitely."""
+        return self.store.pending_ms()
+
+    def idle(self):
+        """Background work that must never happen on the command path
+           (currently persisting state to flash). Called by the server
+           loop between commands."""
+        self.store.poll(self)
+
+    def _put2(self, offset, value):
+        """Write value (0-99) into the status buffer as two characters,
+           right-aligned (space padded)."""
+        self.status[offset] = 0x20 if value < 10 else 0x30 + value // 10
+        self.status[offset + 1] = 0x30 + value % 10
+
+    def _status_levels(self, schannel):
+        offset = len(STATUS_PREFIX) + schannel*STATUS_POT_LEN + 4
+        self._put2(offset, self.levels[schannel][self.L])
+        self._put2(offset + 3, self.levels[schannel][self.R])
+
+    def _status_mutes(self, schannel):
+        offset = len(STATUS_PREFIX) + schannel*STATUS_POT_LEN + 10
+        self.status[offset] = 0x31 if self.mutes[schannel][self.L] else 0x30
+        self.status[offset + 2] = 0x31 if self.mutes[schannel][self.R] else 0x30
+
+    def _build_status(self):
+        """(Re)build the whole status buffer. Only needed once, after that
+           the setters patch the fields they change in place."""
+        if not hasattr(self, 'status'):
+            buf = bytearray(STATUS_PREFIX)
+            for i in range(self.NUMPOTS):
+                buf.append(0x30 + i)
+                buf.extend(b': (00,00,0,0); ')
+            buf.extend(STATUS_MASTER_LABEL)
+            self.status_master_offset = len(buf)
+            buf.extend(b'00')
+            buf.extend(STATUS_MUTE_LABEL)
+            self.status_mute_offset = len(buf)
+            buf.extend(b'0\n')
+            self.status = buf
+            self.status_view = memoryview(buf)
+            self.status_view_nonl = self.status_view[:-1]
+            self.status_body_view = self.status_view[len(STATUS_PREFIX):]
+        for i in range(self.NUMPOTS):
+            self._status_levels(i)
+            self._status_mutes(i)
+        self._put2(self.status_master_offset, self.master)
+        self.status[self.status_mute_offset] = 0x31 if self.mute_state else 0x30
+
+    def get_status_bytes(self, newline=True):
+        """Returns the status reply (including the leading 'OK ') as a
+           memoryview into a buffer owned by the VolumeController. The
+           buffer is kept up to date in place, so no allocation happens
+           here. Do not hold on to the result across commands.
+
+           newline selects whether the terminating newline is included
+           (TCP) or not (UDP).
+           Format: OK <pot nr>: (<left level>,<right level>,<left mute state>,<right mute state>); ...; Master: <master level> Mute: <global mute state>
+           Levels are always two characters wide (space padded).
+        """
+        return self.status_view if newline else self.status_view_nonl
+
+    def get_status_body(self):
+        """Same as get_status_bytes, but without the leading 'OK '."""
+        return self.status_body_view
 
     def get_status_string(self):
         """Returns a string describing the state of the volume controller.
-           NOTE: This string is used directectly by VolumeServer, it thus forms part of the protocol.
-           Format: <pot nr>: (<left level>, <right level>, <left mute state>, <right mute state>); ...; Master: <master level> Mute: <global mute state>
+           Same as get_status_bytes, minus the 'OK ' and newline.
         """
         # TODO: Switch over to symbolic mapped names instead? (FL, FR, RR, RL, CEN, SUB etc.)
-        # TODO: Build bytearray iteratively in loop instead (speed & memory usage improvement)?
-        return "; ".join(("{}: ({},{},{},{})".format(i, schan[self.L], schan[self.R], int(smute[self.L]), int(smute[self.R]))
-                          for i, (schan, smute) in enumerate(zip(self.levels, self.mutes)))) \
-                    + "; Master: {} Mute: {}".format(self.master, int(self.mute_state))
+        return bytes(self.status_view[len(STATUS_PREFIX):-1]).decode('ascii')
 
     _chan_table = {
         'FL': (0, L), 'FR': (0, R), 'F': (0, LR),